@@ -1,5 +1,12 @@
 #version 330 core
 
+// See Shaders/anim.vert
+#ifndef HAS_TANGENT
+#define HAS_TANGENT 1
+#endif
+// When defined, the material flags of every draw with this shader, which turns the flag checks into constants
+// #define STATIC_MATERIAL_FLAGS 0
+
 out vec4 color;
 
 struct PointLight {
@@ -41,17 +48,28 @@ layout (std140) uniform Lights {
 
 #define MATERIAL_FLAG_DIFFUSE_WITH_ALPHA 1u
 
+#define MAX_MATERIALS 256
+
 struct Material {
-    sampler2D diffuse;  
-    sampler2D specular;
-    sampler2D normal;
     vec3 diffuse_coeff;
-    vec3 specular_coeff;
     float shininess;
+    vec3 specular_coeff;
     uint flags;
+    ivec4 layers; // diffuse, specular and normal map layers
 };
 
-uniform Material material;
+// Every material of the model being drawn, material_index picks the one for this draw
+layout (std140) uniform Materials {
+    Material materials[MAX_MATERIALS];
+};
+uniform int material_index;
+
+// Same sized maps are packed into one array, a material's maps are at its layers
+uniform sampler2DArray diffuse_maps;
+uniform sampler2DArray specular_maps;
+uniform sampler2DArray normal_maps;
+
+Material material;
 
 in VS_OUT {
     mat3 TBN;
@@ -103,27 +121,39 @@ vec3 CalcDirLightContribution(DirectionalLight light, vec3 mat_ambient, vec3 mat
 
 void main()
 {
+    material = materials[material_index];
+
     vec3 diffuse_texel;
     float alpha = 1.0;
 
-    if ((material.flags & MATERIAL_FLAG_DIFFUSE_WITH_ALPHA) != 0u)
+#ifdef STATIC_MATERIAL_FLAGS
+    const uint flags = uint(STATIC_MATERIAL_FLAGS);
+#else
+    uint flags = material.flags;
+#endif
+
+    if ((flags & MATERIAL_FLAG_DIFFUSE_WITH_ALPHA) != 0u)
     {
-        vec4 diffuse_texel_with_alpha = texture(material.diffuse, fs_in.texCoords).rgba;
+        vec4 diffuse_texel_with_alpha = texture(diffuse_maps, vec3(fs_in.texCoords, material.layers.x)).rgba;
         diffuse_texel = diffuse_texel_with_alpha.rgb;
         alpha = diffuse_texel_with_alpha.a;
     }
     else
     {
-        diffuse_texel = texture(material.diffuse, fs_in.texCoords).rgb;
+        diffuse_texel = texture(diffuse_maps, vec3(fs_in.texCoords, material.layers.x)).rgb;
     }
 
-    vec3 specular_texel = texture(material.specular, fs_in.texCoords).rgb;
+    vec3 specular_texel = texture(specular_maps, vec3(fs_in.texCoords, material.layers.y)).rgb;
     vec3 mat_diffuse = material.diffuse_coeff * diffuse_texel;
     vec3 mat_ambient = vec3(0.2, 0.2, 0.2) * mat_diffuse;
     vec3 mat_specular = material.specular_coeff * specular_texel;
-    vec3 normal = texture(material.normal, fs_in.texCoords).rgb;
+#if HAS_TANGENT
+    vec3 normal = texture(normal_maps, vec3(fs_in.texCoords, material.layers.z)).rgb;
     normal = normal * 2.0 - 1.0;
     normal = normalize(fs_in.TBN * normal);
+#else
+    vec3 normal = normalize(fs_in.TBN[2]);
+#endif
 
     // vec3 normal = normalize(fs_in.TBN[0]);
 
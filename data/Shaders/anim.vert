@@ -1,9 +1,38 @@
 #version 330 core
 
+// Features are compiled in or out by ShaderPermutations, the defaults handle any mesh
+#ifndef HAS_TANGENT
+#define HAS_TANGENT 1
+#endif
+// Leading joint weights a mesh uses (1, 2 or 4), weights after them are zero for every vertex
+#ifndef JOINT_INFLUENCES
+#define JOINT_INFLUENCES 4
+#endif
+// Skinning matrices are rotations with uniform scale, so they transform normals as is
+#ifndef UNIFORM_SCALE
+#define UNIFORM_SCALE 0
+#endif
+// Vertices in the VertexFlags::COMPRESSED layout
+#ifndef COMPRESSED_VERTICES
+#define COMPRESSED_VERTICES 0
+#endif
+
+#if COMPRESSED_VERTICES
+// Positions and octahedral directions arrive as the integer values of their snorm16 components
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+#if HAS_TANGENT
+layout(location = 3) in vec2 aTangent;
+#endif
+#else
 layout(location = 0) in vec3 aPos;
 layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoords;
+#if HAS_TANGENT
 layout(location = 3) in vec3 aTangent;
+#endif
+#endif
 layout(location = 4) in uint aJointIndices;
 layout(location = 5) in vec4 aJointWeights;
 // layout(location = 6) in vec3 aBitangent;
@@ -13,7 +42,10 @@ layout (std140) uniform Matrices{
     mat4 view;
 };
 
-uniform mat4 skinning_matrices[128];
+// Skinning matrices streamed by the scene. Each joint takes three texels holding the columns of its 4x3 matrix
+// back to back, starting at palette_offset for this draw.
+uniform samplerBuffer skinning_palette;
+uniform int palette_offset;
 
 uniform mat4 model;
 uniform mat3 normalMatrix;
@@ -24,27 +56,80 @@ out VS_OUT {
     vec2 texCoords;
 } vs_out;
 
+#if COMPRESSED_VERTICES
+// Bounds of the mesh being drawn, see PositionQuantization
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+
+// Unit vector from the integer values of its octahedral snorm16 encoding
+vec3 DecodeOctahedral(vec2 encoded)
+{
+    vec2 e = encoded * (1.0 / 32767.0);
+    vec3 direction = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-direction.z, 0.0);
+    direction.x += direction.x >= 0.0 ? -t : t;
+    direction.y += direction.y >= 0.0 ? -t : t;
+    return normalize(direction);
+}
+#endif
+
+mat4x3 FetchSkinningMatrix(uint joint)
+{
+    int texel = palette_offset + int(joint) * 3;
+    vec4 a = texelFetch(skinning_palette, texel);
+    vec4 b = texelFetch(skinning_palette, texel + 1);
+    vec4 c = texelFetch(skinning_palette, texel + 2);
+    return mat4x3(a.xyz, vec3(a.w, b.xy), vec3(b.zw, c.x), c.yzw);
+}
+
 void main()
 {
-    vec4 modelSpacePos = vec4(aPos, 1.0);
-    mat4 modelSpaceMatrix = skinning_matrices[aJointIndices & 0xFFu] * aJointWeights.x;
-    modelSpaceMatrix += skinning_matrices[(aJointIndices >> 8) & 0xFFu] * aJointWeights.y;
-    modelSpaceMatrix += skinning_matrices[(aJointIndices >> 16) & 0xFFu] * aJointWeights.z;
-    modelSpaceMatrix += skinning_matrices[(aJointIndices >> 24) & 0xFFu] * aJointWeights.w;
+#if COMPRESSED_VERTICES
+    vec3 vertexPos = position_offset + aPos * position_scale;
+    vec3 vertexNormal = DecodeOctahedral(aNormal);
+#if HAS_TANGENT
+    vec3 vertexTangent = DecodeOctahedral(aTangent);
+#endif
+#else
+    vec3 vertexPos = aPos;
+    vec3 vertexNormal = aNormal;
+#if HAS_TANGENT
+    vec3 vertexTangent = aTangent;
+#endif
+#endif
+    mat4x3 modelSpaceMatrix = FetchSkinningMatrix(aJointIndices & 0xFFu) * aJointWeights.x;
+#if JOINT_INFLUENCES >= 2
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 8) & 0xFFu) * aJointWeights.y;
+#endif
+#if JOINT_INFLUENCES >= 4
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 16) & 0xFFu) * aJointWeights.z;
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 24) & 0xFFu) * aJointWeights.w;
+#endif
     // mat4 modelSpaceMatrix = identity * aJointWeights.x;
     // modelSpaceMatrix += identity * aJointWeights.y;
     // modelSpaceMatrix += identity * aJointWeights.z;
     // modelSpaceMatrix += identity * aJointWeights.w;
-    modelSpacePos = modelSpaceMatrix * modelSpacePos;
+    vec4 modelSpacePos = vec4(modelSpaceMatrix * vec4(vertexPos, 1.0), 1.0);
     
+#if UNIFORM_SCALE
+    // The fragment shader normalizes, so the scale doesn't matter
+    mat3 modelSpaceNormalMatrix = mat3(modelSpaceMatrix);
+#else
     mat3 modelSpaceNormalMatrix = transpose(inverse(mat3(modelSpaceMatrix)));
+#endif
     mat3 finalNormalMatrix = normalMatrix * modelSpaceNormalMatrix;
 
     // mat3 finalNormalMatrix = transpose(inverse(mat3(view) * mat3(model) * modelSpaceNormalMatrix));
 
-    vec3 normal = finalNormalMatrix * aNormal;
-    vec3 tangent = finalNormalMatrix * aTangent;
-    vec3 bitangent = finalNormalMatrix * normalize(cross(aNormal, aTangent));
+    vec3 normal = finalNormalMatrix * vertexNormal;
+#if HAS_TANGENT
+    vec3 tangent = finalNormalMatrix * vertexTangent;
+    vec3 bitangent = finalNormalMatrix * normalize(cross(vertexNormal, vertexTangent));
+#else
+    // Without tangents there's no normal mapping, the fragment shader only reads the last column
+    vec3 tangent = vec3(0.0);
+    vec3 bitangent = vec3(0.0);
+#endif
 
     vec4 viewSpacePos = view * model * modelSpacePos;
 
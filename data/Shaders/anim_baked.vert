@@ -0,0 +1,114 @@
+#version 330 core
+
+// Vertices in the VertexFlags::COMPRESSED layout, defined by the scene
+#ifndef COMPRESSED_VERTICES
+#define COMPRESSED_VERTICES 0
+#endif
+
+#if COMPRESSED_VERTICES
+// Positions and octahedral directions arrive as the integer values of their snorm16 components
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec2 aTangent;
+#else
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec3 aTangent;
+#endif
+layout(location = 4) in uint aJointIndices;
+layout(location = 5) in vec4 aJointWeights;
+
+layout (std140) uniform Matrices{
+    mat4 projection;
+    mat4 view;
+};
+
+#define MAX_BAKED_INSTANCES 64
+
+// One row per pose, three texels per joint holding the rows of its 4x3 skinning matrix
+uniform sampler2D baked_palettes;
+uniform int baked_pose_count;
+// Per instance fractional pose (clip time * frames per second) and world space offset, indexed by gl_InstanceID
+uniform float baked_poses[MAX_BAKED_INSTANCES];
+uniform vec3 instance_offsets[MAX_BAKED_INSTANCES];
+
+uniform mat4 model;
+uniform mat3 normalMatrix;
+
+out VS_OUT {
+    mat3 TBN;
+    vec3 fragViewPos;
+    vec2 texCoords;
+} vs_out;
+
+#if COMPRESSED_VERTICES
+// Bounds of the mesh being drawn, see PositionQuantization
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+
+// Unit vector from the integer values of its octahedral snorm16 encoding
+vec3 DecodeOctahedral(vec2 encoded)
+{
+    vec2 e = encoded * (1.0 / 32767.0);
+    vec3 direction = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-direction.z, 0.0);
+    direction.x += direction.x >= 0.0 ? -t : t;
+    direction.y += direction.y >= 0.0 ? -t : t;
+    return normalize(direction);
+}
+#endif
+
+mat4x3 FetchSkinningMatrix(uint joint, int pose)
+{
+    int x = int(joint) * 3;
+    vec4 row0 = texelFetch(baked_palettes, ivec2(x, pose), 0);
+    vec4 row1 = texelFetch(baked_palettes, ivec2(x + 1, pose), 0);
+    vec4 row2 = texelFetch(baked_palettes, ivec2(x + 2, pose), 0);
+    return transpose(mat3x4(row0, row1, row2));
+}
+
+mat4x3 SampleSkinningMatrix(uint joint, int pose_a, int pose_b, float t)
+{
+    return FetchSkinningMatrix(joint, pose_a) * (1.0 - t) + FetchSkinningMatrix(joint, pose_b) * t;
+}
+
+void main()
+{
+#if COMPRESSED_VERTICES
+    vec3 vertexPos = position_offset + aPos * position_scale;
+    vec3 vertexNormal = DecodeOctahedral(aNormal);
+    vec3 vertexTangent = DecodeOctahedral(aTangent);
+#else
+    vec3 vertexPos = aPos;
+    vec3 vertexNormal = aNormal;
+    vec3 vertexTangent = aTangent;
+#endif
+    float pose = clamp(baked_poses[gl_InstanceID], 0.0, float(baked_pose_count - 1));
+    int pose_a = int(pose);
+    int pose_b = min(pose_a + 1, baked_pose_count - 1);
+    float t = pose - float(pose_a);
+
+    mat4x3 modelSpaceMatrix = SampleSkinningMatrix(aJointIndices & 0xFFu, pose_a, pose_b, t) * aJointWeights.x;
+    modelSpaceMatrix += SampleSkinningMatrix((aJointIndices >> 8) & 0xFFu, pose_a, pose_b, t) * aJointWeights.y;
+    modelSpaceMatrix += SampleSkinningMatrix((aJointIndices >> 16) & 0xFFu, pose_a, pose_b, t) * aJointWeights.z;
+    modelSpaceMatrix += SampleSkinningMatrix((aJointIndices >> 24) & 0xFFu, pose_a, pose_b, t) * aJointWeights.w;
+    vec4 modelSpacePos = vec4(modelSpaceMatrix * vec4(vertexPos, 1.0), 1.0);
+
+    mat3 modelSpaceNormalMatrix = transpose(inverse(mat3(modelSpaceMatrix)));
+    mat3 finalNormalMatrix = normalMatrix * modelSpaceNormalMatrix;
+
+    vec3 normal = finalNormalMatrix * vertexNormal;
+    vec3 tangent = finalNormalMatrix * vertexTangent;
+    vec3 bitangent = finalNormalMatrix * normalize(cross(vertexNormal, vertexTangent));
+
+    vec4 worldPos = model * modelSpacePos + vec4(instance_offsets[gl_InstanceID], 0.0);
+    vec4 viewSpacePos = view * worldPos;
+
+    vs_out.TBN = mat3(tangent, bitangent, normal);
+    vs_out.fragViewPos = vec3(viewSpacePos);
+    vs_out.texCoords = aTexCoords;
+
+    gl_Position = projection * viewSpacePos;
+}
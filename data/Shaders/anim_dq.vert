@@ -0,0 +1,108 @@
+#version 330 core
+
+// Vertices in the VertexFlags::COMPRESSED layout, defined by the scene
+#ifndef COMPRESSED_VERTICES
+#define COMPRESSED_VERTICES 0
+#endif
+
+#if COMPRESSED_VERTICES
+// Positions and octahedral directions arrive as the integer values of their snorm16 components
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec2 aTangent;
+#else
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec3 aTangent;
+#endif
+layout(location = 4) in uint aJointIndices;
+layout(location = 5) in vec4 aJointWeights;
+
+layout (std140) uniform Matrices{
+    mat4 projection;
+    mat4 view;
+};
+
+// Streamed by the scene, two texels per joint starting at palette_offset: the rotation quaternion (x, y, z, w)
+// followed by the dual part
+uniform samplerBuffer skinning_palette;
+uniform int palette_offset;
+
+uniform mat4 model;
+uniform mat3 normalMatrix;
+
+out VS_OUT {
+    mat3 TBN;
+    vec3 fragViewPos;
+    vec2 texCoords;
+} vs_out;
+
+#if COMPRESSED_VERTICES
+// Bounds of the mesh being drawn, see PositionQuantization
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+
+// Unit vector from the integer values of its octahedral snorm16 encoding
+vec3 DecodeOctahedral(vec2 encoded)
+{
+    vec2 e = encoded * (1.0 / 32767.0);
+    vec3 direction = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-direction.z, 0.0);
+    direction.x += direction.x >= 0.0 ? -t : t;
+    direction.y += direction.y >= 0.0 ? -t : t;
+    return normalize(direction);
+}
+#endif
+
+vec3 Rotate(vec4 q, vec3 v)
+{
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+void main()
+{
+#if COMPRESSED_VERTICES
+    vec3 vertexPos = position_offset + aPos * position_scale;
+    vec3 vertexNormal = DecodeOctahedral(aNormal);
+    vec3 vertexTangent = DecodeOctahedral(aTangent);
+#else
+    vec3 vertexPos = aPos;
+    vec3 vertexNormal = aNormal;
+    vec3 vertexTangent = aTangent;
+#endif
+    uvec4 joints = uvec4(aJointIndices & 0xFFu, (aJointIndices >> 8) & 0xFFu, (aJointIndices >> 16) & 0xFFu, (aJointIndices >> 24) & 0xFFu);
+
+    // q and -q are the same rotation, flip every influence into the hemisphere of the first so they don't cancel out
+    vec4 firstReal = texelFetch(skinning_palette, palette_offset + int(joints.x) * 2);
+    vec4 real = vec4(0.0);
+    vec4 dual = vec4(0.0);
+    for (int i = 0; i < 4; i++)
+    {
+        vec4 jointReal = texelFetch(skinning_palette, palette_offset + int(joints[i]) * 2);
+        vec4 jointDual = texelFetch(skinning_palette, palette_offset + int(joints[i]) * 2 + 1);
+        float weight = dot(firstReal, jointReal) < 0.0 ? -aJointWeights[i] : aJointWeights[i];
+        real += jointReal * weight;
+        dual += jointDual * weight;
+    }
+    float invLength = 1.0 / length(real);
+    real *= invLength;
+    dual *= invLength;
+
+    vec3 translation = 2.0 * (real.w * dual.xyz - dual.w * real.xyz + cross(real.xyz, dual.xyz));
+    vec4 modelSpacePos = vec4(Rotate(real, vertexPos) + translation, 1.0);
+
+    // The blended transform is a rotation, so normals and tangents are rotated as is without an inverse transpose
+    vec3 normal = normalMatrix * Rotate(real, vertexNormal);
+    vec3 tangent = normalMatrix * Rotate(real, vertexTangent);
+    vec3 bitangent = normalMatrix * Rotate(real, normalize(cross(vertexNormal, vertexTangent)));
+
+    vec4 viewSpacePos = view * model * modelSpacePos;
+
+    vs_out.TBN = mat3(tangent, bitangent, normal);
+    vs_out.fragViewPos = vec3(viewSpacePos);
+    vs_out.texCoords = aTexCoords;
+
+    gl_Position = projection * viewSpacePos;
+}
@@ -0,0 +1,100 @@
+#version 330 core
+
+// Vertices in the VertexFlags::COMPRESSED layout, defined by the scene
+#ifndef COMPRESSED_VERTICES
+#define COMPRESSED_VERTICES 0
+#endif
+
+#if COMPRESSED_VERTICES
+// Positions and octahedral directions arrive as the integer values of their snorm16 components
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec2 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec2 aTangent;
+#else
+layout(location = 0) in vec3 aPos;
+layout(location = 1) in vec3 aNormal;
+layout(location = 2) in vec2 aTexCoords;
+layout(location = 3) in vec3 aTangent;
+#endif
+layout(location = 4) in uint aJointIndices;
+layout(location = 5) in vec4 aJointWeights;
+// Per instance, see SkinnedInstance
+layout(location = 6) in mat4 aModel;
+layout(location = 10) in int aPaletteOffset;
+
+layout (std140) uniform Matrices{
+    mat4 projection;
+    mat4 view;
+};
+
+// Every instance's skinning matrices streamed by the scene, three texels per joint starting at aPaletteOffset
+uniform samplerBuffer skinning_palette;
+
+out VS_OUT {
+    mat3 TBN;
+    vec3 fragViewPos;
+    vec2 texCoords;
+} vs_out;
+
+#if COMPRESSED_VERTICES
+// Bounds of the mesh being drawn, see PositionQuantization
+uniform vec3 position_scale;
+uniform vec3 position_offset;
+
+// Unit vector from the integer values of its octahedral snorm16 encoding
+vec3 DecodeOctahedral(vec2 encoded)
+{
+    vec2 e = encoded * (1.0 / 32767.0);
+    vec3 direction = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-direction.z, 0.0);
+    direction.x += direction.x >= 0.0 ? -t : t;
+    direction.y += direction.y >= 0.0 ? -t : t;
+    return normalize(direction);
+}
+#endif
+
+mat4x3 FetchSkinningMatrix(uint joint)
+{
+    int texel = aPaletteOffset + int(joint) * 3;
+    vec4 a = texelFetch(skinning_palette, texel);
+    vec4 b = texelFetch(skinning_palette, texel + 1);
+    vec4 c = texelFetch(skinning_palette, texel + 2);
+    return mat4x3(a.xyz, vec3(a.w, b.xy), vec3(b.zw, c.x), c.yzw);
+}
+
+void main()
+{
+#if COMPRESSED_VERTICES
+    vec3 vertexPos = position_offset + aPos * position_scale;
+    vec3 vertexNormal = DecodeOctahedral(aNormal);
+    vec3 vertexTangent = DecodeOctahedral(aTangent);
+#else
+    vec3 vertexPos = aPos;
+    vec3 vertexNormal = aNormal;
+    vec3 vertexTangent = aTangent;
+#endif
+    mat4x3 modelSpaceMatrix = FetchSkinningMatrix(aJointIndices & 0xFFu) * aJointWeights.x;
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 8) & 0xFFu) * aJointWeights.y;
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 16) & 0xFFu) * aJointWeights.z;
+    modelSpaceMatrix += FetchSkinningMatrix((aJointIndices >> 24) & 0xFFu) * aJointWeights.w;
+    vec4 modelSpacePos = vec4(modelSpaceMatrix * vec4(vertexPos, 1.0), 1.0);
+
+    // Instances are only translated and uniformly scaled, so the model view matrix works for normals as is. The
+    // fragment shader normalizes the result.
+    mat4 modelView = view * aModel;
+    mat3 modelSpaceNormalMatrix = transpose(inverse(mat3(modelSpaceMatrix)));
+    mat3 finalNormalMatrix = mat3(modelView) * modelSpaceNormalMatrix;
+
+    vec3 normal = finalNormalMatrix * vertexNormal;
+    vec3 tangent = finalNormalMatrix * vertexTangent;
+    vec3 bitangent = finalNormalMatrix * normalize(cross(vertexNormal, vertexTangent));
+
+    vec4 viewSpacePos = modelView * modelSpacePos;
+
+    vs_out.TBN = mat3(tangent, bitangent, normal);
+    vs_out.fragViewPos = vec3(viewSpacePos);
+    vs_out.texCoords = aTexCoords;
+
+    gl_Position = projection * viewSpacePos;
+}
@@ -0,0 +1,86 @@
+#include "AllocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+static std::atomic<std::uint64_t> heap_allocation_count{ 0 };
+
+// Replacing the plain forms is enough, the array and nothrow forms forward to these
+void* operator new(std::size_t size)
+{
+	heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (size == 0) size = 1;
+	if (void* ptr = std::malloc(size)) return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+// Over-aligned types (AnimationClip's tracks) go through these. The array forms forward to them as well.
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	heap_allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (size == 0) size = 1;
+#ifdef _WIN32
+	if (void* ptr = _aligned_malloc(size, (std::size_t)alignment)) return ptr;
+#else
+	// aligned_alloc wants a multiple of the alignment
+	const auto align = (std::size_t)alignment;
+	if (void* ptr = std::aligned_alloc(align, (size + align - 1) / align * align)) return ptr;
+#endif
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	std::free(ptr);
+#endif
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t alignment) noexcept
+{
+	operator delete(ptr, alignment);
+}
+
+std::uint64_t HeapAllocationCount()
+{
+	return heap_allocation_count.load(std::memory_order_relaxed);
+}
+
+std::size_t PeakResidentBytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return (std::size_t)usage.ru_maxrss; // bytes
+#else
+	return (std::size_t)usage.ru_maxrss * 1024; // KB
+#endif
+#endif
+}
@@ -0,0 +1,14 @@
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Number of times the global operator new has been called since startup. Take the difference
+// around a block of code to check whether it allocates.
+std::uint64_t HeapAllocationCount();
+
+// Most physical memory the process has had resident at once (peak working set on Windows), 0 if unknown
+std::size_t PeakResidentBytes();
+
+#endif // !ALLOCATION_COUNTER_H
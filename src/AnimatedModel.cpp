@@ -1,52 +1,464 @@
 #include "AnimatedModel.h"
 
+#include "AnimationKernels.h"
+#include "ClipCompression.h"
+#include "MeshOptimizer.h"
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
+#include <limits>
+#include <type_traits>
 #include <utility>
 #include <glm/glm.hpp>
 #include "stb_image.h"
 
 #include <glm/ext/matrix_relational.hpp>
 
-AnimatedModel::AnimatedModel(const std::string& directory)
+AnimatedModel::AnimatedModel(const std::string& directory, const ClipCompressionSettings& compression, VertexFlags vertex_options)
 {
-	LoadAnimatedModel(directory);
+	LoadAnimatedModel(directory, compression, vertex_options);
+}
+
+void AnimatedModel::DrawMesh(std::uint32_t mesh_index, int lod) const
+{
+	const auto& draw = mesh_draws[mesh_index * max_mesh_lods + lod];
+	glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)draw.index_count, draw.index_type, (void*)draw.first_index_byte, draw.base_vertex);
+}
+
+void AnimatedModel::DrawMeshInstanced(std::uint32_t mesh_index, int instance_count, int lod) const
+{
+	const auto& draw = mesh_draws[mesh_index * max_mesh_lods + lod];
+	glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)draw.index_count, draw.index_type, (void*)draw.first_index_byte, instance_count,
+		draw.base_vertex);
+}
+
+void AnimatedModel::SetMeshUniforms(Shader& shader, std::uint32_t mesh_index) const
+{
+	shader.SetInt("material_index", (int)meshes[mesh_index].material_index);
+	if (HasFlag(vertex_flags, VertexFlags::COMPRESSED))
+	{
+		const auto& quantization = mesh_position_quantization[mesh_index];
+		shader.SetVec3("position_scale", quantization.scale);
+		shader.SetVec3("position_offset", quantization.offset);
+	}
+}
+
+void AnimatedModel::BindMaterialTextures(std::uint32_t material_index) const
+{
+	const auto& material = materials[material_index];
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture_arrays[material.diffuse_map.array].id);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture_arrays[material.specular_map.array].id);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, texture_arrays[material.normal_map.array].id);
+}
+
+void AnimatedModel::BindInstancedGeometry(unsigned int instance_buffer, std::size_t offset) const
+{
+	glBindVertexArray(instanced_VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	const auto stride = (GLsizei)sizeof(SkinnedInstance);
+	for (auto column = 0u; column < 4; column++)
+	{
+		glVertexAttribPointer(first_instance_attribute + column, 4, GL_FLOAT, GL_FALSE, stride,
+			(const void*)(offset + offsetof(SkinnedInstance, world_matrix) + column * sizeof(glm::vec4)));
+	}
+	glVertexAttribIPointer(first_instance_attribute + 4, 1, GL_INT, stride, (const void*)(offset + offsetof(SkinnedInstance, palette_offset)));
+}
+
+// std140 layout of Material in Shaders/anim.frag
+struct MaterialBlock
+{
+	glm::vec3 diffuse_coefficient;
+	float shininess;
+	glm::vec3 specular_coefficient;
+	std::uint32_t flags;
+	glm::ivec4 layers; // diffuse, specular, normal
+};
+static_assert(sizeof(MaterialBlock) == 48);
+
+static_assert(sizeof(glm::quat) == 4 * sizeof(float) && sizeof(glm::vec3) == 3 * sizeof(float), "Kernels treat tracks as float arrays");
+
+static inline std::size_t AlignUp(std::size_t size, std::size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+void AnimationClip::Allocate(unsigned int pose_count, unsigned int joint_count)
+{
+	this->pose_count = pose_count;
+	this->joint_count = joint_count;
+	const std::size_t num_keys = (std::size_t)pose_count * joint_count;
+	const auto rotations_size_bytes = AlignUp(num_keys * sizeof(glm::quat), track_alignment);
+	const auto translations_size_bytes = AlignUp(num_keys * sizeof(glm::vec3), track_alignment);
+	const auto scales_size_bytes = AlignUp(num_keys * sizeof(glm::vec3), track_alignment);
+	auto* block = (std::byte*)::operator new(rotations_size_bytes + translations_size_bytes + scales_size_bytes, std::align_val_t(track_alignment));
+	keyframe_data = std::unique_ptr<std::byte[], AlignedDelete>(block, AlignedDelete{ track_alignment });
+	rotations = { (glm::quat*)block, num_keys };
+	translations = { (glm::vec3*)(block + rotations_size_bytes), num_keys };
+	scales = { (glm::vec3*)(block + rotations_size_bytes + translations_size_bytes), num_keys };
+}
+
+void SkeletonPose::Resize(std::size_t num_joints)
+{
+	rotations.resize(num_joints);
+	translations.resize(num_joints);
+	scales.resize(num_joints);
+}
+
+// Checks that the joints form a single tree: one root, every parent in range, and no cycles. Joint indices also have
+// to fit in the 8 bits per index vertices store.
+static bool ValidateSkeleton(std::span<const Joint> joints, std::string& out_error)
+{
+	constexpr std::size_t max_joints = 256;
+	if (joints.empty() || joints.size() > max_joints)
+	{
+		out_error = "joint count " + std::to_string(joints.size()) + " is outside [1, " + std::to_string(max_joints) + "]";
+		return false;
+	}
+
+	int root = -1;
+	for (auto i = 0u; i < joints.size(); i++)
+	{
+		const auto parent = joints[i].parent;
+		if (parent < 0)
+		{
+			if (root >= 0)
+			{
+				out_error = "joints " + std::to_string(root) + " and " + std::to_string(i) + " are both roots";
+				return false;
+			}
+			root = (int)i;
+		}
+		else if (parent >= (int)joints.size() || parent == (int)i)
+		{
+			out_error = "joint " + std::to_string(i) + " has invalid parent " + std::to_string(parent);
+			return false;
+		}
+	}
+	if (root < 0)
+	{
+		out_error = "no root joint";
+		return false;
+	}
+
+	// With one root and valid parents, a joint that doesn't reach the root within joints.size() steps is on a cycle
+	for (auto i = 0u; i < joints.size(); i++)
+	{
+		auto joint = (int)i;
+		for (auto steps = 0u; joint >= 0; steps++)
+		{
+			if (steps == joints.size())
+			{
+				out_error = "joint " + std::to_string(i) + " is part of a cycle";
+				return false;
+			}
+			joint = joints[joint].parent;
+		}
+	}
+	return true;
+}
+
+// Breadth first order of a validated skeleton. Children of a joint end up next to each other, in file order, and
+// each depth is a contiguous range recorded in out_level_offsets.
+static void BreadthFirstJointOrder(std::span<const Joint> joints, std::vector<std::uint16_t>& out_order, std::vector<std::uint16_t>& out_level_offsets)
+{
+	std::vector<std::uint16_t> first_child(joints.size() + 1, 0); // children grouped by parent, counting sort style
+	for (const auto& joint : joints)
+	{
+		if (joint.parent >= 0) first_child[joint.parent + 1]++;
+	}
+	for (auto i = 1u; i < first_child.size(); i++)
+	{
+		first_child[i] += first_child[i - 1];
+	}
+	std::vector<std::uint16_t> children(joints.size());
+	auto next_child = first_child;
+	for (auto i = 0u; i < joints.size(); i++)
+	{
+		if (joints[i].parent >= 0) children[next_child[joints[i].parent]++] = (std::uint16_t)i;
+	}
+
+	out_order.clear();
+	out_level_offsets.clear();
+	const auto root = std::find_if(joints.begin(), joints.end(), [](const Joint& joint) { return joint.parent < 0; });
+	out_order.push_back((std::uint16_t)(root - joints.begin()));
+	std::size_t level_begin = 0;
+	while (level_begin < out_order.size())
+	{
+		out_level_offsets.push_back((std::uint16_t)level_begin);
+		const auto level_end = out_order.size();
+		for (auto i = level_begin; i < level_end; i++)
+		{
+			const auto joint = out_order[i];
+			out_order.insert(out_order.end(), children.begin() + first_child[joint], children.begin() + first_child[joint + 1]);
+		}
+		level_begin = level_end;
+	}
+	out_level_offsets.push_back((std::uint16_t)out_order.size());
+	assert(out_order.size() == joints.size());
+}
+
+// Moves the root's ground plane translation out of the clip into root_motion, leaving the root track in place.
+// Joints are breadth first so the root is joint 0 and its translation is in model space.
+static void ExtractRootMotion(AnimationClip& clip)
+{
+	const auto origin = clip.translations[0];
+	clip.root_motion.resize(clip.pose_count);
+	for (auto pose = 0u; pose < clip.pose_count; pose++)
+	{
+		auto& translation = clip.translations[pose * clip.joint_count];
+		clip.root_motion[pose] = glm::vec2(translation.x - origin.x, translation.z - origin.z);
+		translation.x = origin.x;
+		translation.z = origin.z;
+	}
+
+	// The last pose of a looping clip is a copy of the first, so its displacement would snap back to 0. Continue
+	// at the speed of the last frame instead, which is where the next loop starts from.
+	const auto last_pose = clip.pose_count - 1;
+	if (clip.loops && last_pose >= 2)
+	{
+		clip.root_motion[last_pose] = 2.0f * clip.root_motion[last_pose - 1] - clip.root_motion[last_pose - 2];
+	}
+	clip.root_motion_per_loop = clip.root_motion[last_pose];
+}
+
+static constexpr float snorm16_max = 32767.0f;
+
+static std::int16_t QuantizeSnorm16(float value)
+{
+	return (std::int16_t)std::round(std::clamp(value, -1.0f, 1.0f) * snorm16_max);
+}
+
+// Octahedral encoding maps the unit sphere onto the [-1, 1] square, the lower hemisphere folded over the corners
+static glm::vec2 EncodeOctahedral(glm::vec3 direction)
+{
+	direction /= std::abs(direction.x) + std::abs(direction.y) + std::abs(direction.z);
+	glm::vec2 encoded(direction.x, direction.y);
+	if (direction.z < 0.0f)
+	{
+		encoded.x = (1.0f - std::abs(direction.y)) * (direction.x >= 0.0f ? 1.0f : -1.0f);
+		encoded.y = (1.0f - std::abs(direction.x)) * (direction.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	return encoded;
+}
+
+// Same as DecodeOctahedral in the vertex shaders
+static glm::vec3 DecodeOctahedral(glm::vec2 encoded)
+{
+	glm::vec3 direction(encoded.x, encoded.y, 1.0f - std::abs(encoded.x) - std::abs(encoded.y));
+	const float t = std::max(-direction.z, 0.0f);
+	direction.x += direction.x >= 0.0f ? -t : t;
+	direction.y += direction.y >= 0.0f ? -t : t;
+	return glm::normalize(direction);
+}
+
+// Offsets of the VertexFlags::COMPRESSED attributes: 3 x int16 position (padded to 8 bytes), 2 x int16 normal,
+// 2 x half uv, 2 x int16 tangent, uint32 joint indices, 4 x uint8 joint weights
+static VertexLayout CompressedVertexLayout(bool has_tangents, bool has_joint_data)
+{
+	VertexLayout layout;
+	layout.normal_offset = 8;
+	layout.uv_offset = 12;
+	layout.size_bytes = 16;
+	if (has_tangents)
+	{
+		layout.tangent_offset = layout.size_bytes;
+		layout.size_bytes += 4;
+	}
+	if (has_joint_data)
+	{
+		layout.joints_offset = layout.size_bytes;
+		layout.weights_offset = layout.size_bytes + 4;
+		layout.size_bytes += 8;
+	}
+	return layout;
+}
+
+struct VertexCompressionError
+{
+	float position = 0.0f; // model units
+	float normal_degrees = 0.0f;
+	float tangent_degrees = 0.0f;
+	float uv = 0.0f;
+	float weight = 0.0f;
+};
+
+// Packs float vertices into out in the compressed layout. vertex_meshes holds the mesh each vertex is quantized
+// with. Returns the largest error of each attribute after decoding it the way the shaders do.
+static VertexCompressionError CompressVertices(std::span<const std::uint8_t> vertices, const VertexLayout& layout,
+	const VertexLayout& compressed_layout, std::span<const std::uint32_t> vertex_meshes,
+	std::span<const PositionQuantization> quantization, std::vector<std::uint8_t>& out)
+{
+	const auto num_vertices = vertices.size() / layout.size_bytes;
+	out.assign(num_vertices * compressed_layout.size_bytes, 0);
+	VertexCompressionError error;
+	auto AngleDegrees = [](glm::vec3 a, glm::vec3 b)
+	{
+		return glm::degrees(std::acos(std::clamp(glm::dot(glm::normalize(a), b), -1.0f, 1.0f)));
+	};
+	auto CompressDirection = [&](const std::uint8_t* source, std::uint8_t* destination, float& max_error_degrees)
+	{
+		glm::vec3 direction;
+		std::memcpy(&direction, source, sizeof(direction));
+		if (glm::dot(direction, direction) == 0.0f) direction = glm::vec3(0.0f, 0.0f, 1.0f);
+		const auto encoded = EncodeOctahedral(glm::normalize(direction));
+		const std::int16_t packed[2] = { QuantizeSnorm16(encoded.x), QuantizeSnorm16(encoded.y) };
+		std::memcpy(destination, packed, sizeof(packed));
+		const auto decoded = DecodeOctahedral(glm::vec2(packed[0], packed[1]) / snorm16_max);
+		max_error_degrees = std::max(max_error_degrees, AngleDegrees(direction, decoded));
+	};
+
+	for (std::size_t i = 0; i < num_vertices; i++)
+	{
+		const auto* vertex = vertices.data() + i * layout.size_bytes;
+		auto* compressed = out.data() + i * compressed_layout.size_bytes;
+
+		const auto& mesh_quantization = quantization[vertex_meshes[i]];
+		glm::vec3 position;
+		std::memcpy(&position, vertex, sizeof(position));
+		std::int16_t packed_position[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const auto scale = mesh_quantization.scale[axis];
+			packed_position[axis] = scale > 0.0f ? (std::int16_t)std::clamp(std::round((position[axis] - mesh_quantization.offset[axis]) / scale), -snorm16_max, snorm16_max) : 0;
+		}
+		std::memcpy(compressed, packed_position, sizeof(packed_position));
+		const auto decoded_position = mesh_quantization.offset + mesh_quantization.scale * glm::vec3(packed_position[0], packed_position[1], packed_position[2]);
+		error.position = std::max(error.position, glm::length(decoded_position - position));
+
+		CompressDirection(vertex + layout.normal_offset, compressed + compressed_layout.normal_offset, error.normal_degrees);
+		if (layout.tangent_offset != 0)
+		{
+			CompressDirection(vertex + layout.tangent_offset, compressed + compressed_layout.tangent_offset, error.tangent_degrees);
+		}
+
+		glm::vec2 uv;
+		std::memcpy(&uv, vertex + layout.uv_offset, sizeof(uv));
+		const auto packed_uv = glm::packHalf2x16(uv);
+		std::memcpy(compressed + compressed_layout.uv_offset, &packed_uv, sizeof(packed_uv));
+		const auto uv_error = glm::abs(glm::unpackHalf2x16(packed_uv) - uv);
+		error.uv = std::max(error.uv, std::max(uv_error.x, uv_error.y));
 
-	// Render opaque meshes before transparent ones
-	std::partition(meshes.begin(), meshes.end(),
-		[&materials = this->materials](const Mesh& mesh)
+		if (layout.joints_offset != 0)
+		{
+			std::memcpy(compressed + compressed_layout.joints_offset, vertex + layout.joints_offset, sizeof(std::uint32_t));
+			float weights[4];
+			std::memcpy(weights, vertex + layout.weights_offset, sizeof(weights));
+			// Rounded weights can miss a sum of 255 by a few steps, the largest weight takes up the difference so
+			// vertices don't shrink towards the origin
+			std::uint8_t packed_weights[4];
+			int sum = 0, largest = 0;
+			for (int j = 0; j < 4; j++)
+			{
+				packed_weights[j] = (std::uint8_t)std::round(std::clamp(weights[j], 0.0f, 1.0f) * 255.0f);
+				sum += packed_weights[j];
+				if (weights[j] > weights[largest]) largest = j;
+			}
+			if (sum != 0) packed_weights[largest] = (std::uint8_t)std::clamp(packed_weights[largest] + 255 - sum, 0, 255);
+			std::memcpy(compressed + compressed_layout.weights_offset, packed_weights, sizeof(packed_weights));
+			for (int j = 0; j < 4; j++)
+			{
+				error.weight = std::max(error.weight, std::abs(packed_weights[j] / 255.0f - weights[j]));
+			}
+		}
+	}
+	return error;
+}
+
+// Output of LoadSourceFiles and LoadModelPack that LoadAnimatedModel still has to turn into GL objects
+struct AnimatedModel::LoadData
+{
+	VertexFlags file_vertex_flags = VertexFlags::DEFAULT; // of the float vertices
+	std::vector<std::string> material_map_names; // diffuse, specular and normal map of each material, empty if unused
+	std::vector<std::uint8_t> index_storage; // index_data when loaded from the source files
+	std::span<const std::uint8_t> index_data; // GPU index buffer with every mesh LOD, see MeshDraw
+};
+
+// Inside each model directory
+static constexpr const char* model_pack_directory = "ModelCache";
+// Bumped whenever LoadSourceFiles derives different data from the same files (welding, index and vertex
+// optimization, mesh simplification, key hemisphere fix-up) without the pack layout changing, so packs written by
+// an older loader are rebuilt rather than used
+static constexpr std::uint32_t model_pack_loader_version = 1;
+
+// Identifies the source files of a model directory as they are now, a model pack made from them stores it
+static std::uint64_t SourceStamp(std::vector<std::filesystem::path> paths)
+{
+	// 64 bit FNV-1a
+	std::uint64_t hash = 14695981039346656037ull;
+	auto HashBytes = [&hash](const void* bytes, std::size_t size)
+	{
+		for (std::size_t i = 0; i < size; i++)
+		{
+			hash = (hash ^ ((const std::uint8_t*)bytes)[i]) * 1099511628211ull;
+		}
+	};
+	const std::uint32_t format[3] = { ModelPackFile::version, model_pack_loader_version, (std::uint32_t)AnimatedModel::max_mesh_lods };
+	HashBytes(format, sizeof(format));
+	std::sort(paths.begin(), paths.end());
+	for (const auto& path : paths)
 	{
-		auto& material = materials[mesh.material_index];
-		return !material.HasFlag(PhongMaterialFlags::DIFFUSE_WITH_ALPHA);
-	});
+		const auto file_name = path.filename().string();
+		std::error_code error;
+		const std::uint64_t size = std::filesystem::file_size(path, error);
+		const std::int64_t write_time = std::filesystem::last_write_time(path, error).time_since_epoch().count();
+		HashBytes(file_name.data(), file_name.size() + 1);
+		HashBytes(&size, sizeof(size));
+		HashBytes(&write_time, sizeof(write_time));
+	}
+	return hash;
 }
 
-static inline glm::vec3 Lerp(const glm::vec3& a, const glm::vec3& b, float t)
+// Offsets of the float attributes of the VertexFlags the model files store: vec3 position, vec3 normal, vec2 uv,
+// vec3 tangent, uint32 joint indices, vec4 joint weights
+static VertexLayout FloatVertexLayout(bool has_tangents, bool has_joint_data)
 {
-	return a * (1.0f - t) + b * t;
+	VertexLayout layout;
+	layout.normal_offset = sizeof(glm::vec3);
+	layout.uv_offset = 2 * sizeof(glm::vec3);
+	layout.size_bytes = 2 * sizeof(glm::vec3) + sizeof(glm::vec2);
+	if (has_tangents)
+	{
+		layout.tangent_offset = layout.size_bytes;
+		layout.size_bytes += sizeof(glm::vec3);
+	}
+	if (has_joint_data)
+	{
+		layout.joints_offset = layout.size_bytes;
+		layout.weights_offset = layout.size_bytes + sizeof(std::uint32_t);
+		layout.size_bytes += sizeof(std::uint32_t) + sizeof(glm::vec4);
+	}
+	return layout;
 }
 
-static SkeletonPose Interpolate(const SkeletonPose& a, const SkeletonPose& b, float t)
+// Vertex referenced by the i-th index of a draw in the index buffer
+static std::uint32_t ReadIndex(std::span<const std::uint8_t> index_data, const MeshDraw& draw, std::uint32_t i)
 {
-	const auto num_poses = a.joint_poses.size();
-	SkeletonPose interpolated;
-	interpolated.joint_poses.resize(num_poses);
-	for (auto i = 0u; i < num_poses; i++)
+	if (draw.index_type == GL_UNSIGNED_SHORT)
 	{
-		auto& a_pose = a.joint_poses[i];
-		auto& b_pose = b.joint_poses[i];
-		auto& interpolated_joint_pose = interpolated.joint_poses[i];
-		interpolated_joint_pose.translation = Lerp(a_pose.translation, b_pose.translation, t);
-		interpolated_joint_pose.scale = Lerp(a_pose.scale, b_pose.scale, t);
-		// Some animations have weird stutters with quaternion lerp (Warrok wave dance for example)
-		interpolated_joint_pose.rotation = glm::slerp(a_pose.rotation, b_pose.rotation, t);
+		std::uint16_t index;
+		std::memcpy(&index, index_data.data() + draw.first_index_byte + i * sizeof(index), sizeof(index));
+		return index + (std::uint32_t)draw.base_vertex;
 	}
-	return interpolated;
+	std::uint32_t index;
+	std::memcpy(&index, index_data.data() + draw.first_index_byte + i * sizeof(index), sizeof(index));
+	return index + (std::uint32_t)draw.base_vertex;
+}
+
+// Elements of a section of a mapped model pack whose offset table has been checked against the file size
+template <typename T>
+static std::span<T> PackSection(std::span<std::uint8_t> bytes, const ModelPackFile::Header& header, ModelPackFile::Section section)
+{
+	return { (T*)(bytes.data() + header.section_offsets[section]), (std::size_t)(header.section_sizes[section] / sizeof(T)) };
 }
 
-void AnimatedModel::LoadAnimatedModel(const std::string& directory)
+void AnimatedModel::LoadAnimatedModel(const std::string& directory, const ClipCompressionSettings& compression, VertexFlags vertex_options)
 {
 	namespace fs = std::filesystem;
 
@@ -56,6 +468,7 @@ void AnimatedModel::LoadAnimatedModel(const std::string& directory)
 	std::vector<fs::path> animation_file_paths;
 	for (const auto& dir_entry : fs::directory_iterator(path))
 	{
+		if (dir_entry.is_directory()) continue; // model_pack_directory
 		auto extension = dir_entry.path().extension();
 		if (extension == ".model")
 		{
@@ -81,103 +494,224 @@ void AnimatedModel::LoadAnimatedModel(const std::string& directory)
 
 	this->name = model_file_path.stem().string();
 
-	std::ifstream model_file_stream(model_file_path, std::ios::binary);
+	// The pack is used as long as it was made from the files that are there now
+	std::vector<fs::path> source_file_paths = animation_file_paths;
+	source_file_paths.push_back(model_file_path);
+	source_file_paths.push_back(skeleton_file_path);
+	const auto source_stamp = SourceStamp(std::move(source_file_paths));
+	const auto pack_path = path / model_pack_directory / (this->name + ".pack");
+	LoadData data;
+	this->loaded_from_pack = LoadModelPack(pack_path, source_stamp, data);
+	if (!this->loaded_from_pack)
+	{
+		LoadSourceFiles(model_file_path, skeleton_file_path, animation_file_paths, data);
+		SaveModelPack(pack_path, source_stamp, data);
+	}
 
-	ModelFile model_file_data;
-	model_file_stream.read((char*)&model_file_data.header, sizeof(model_file_data.header));
-	assert(model_file_data.header.magic_number == 'ldom');
-	model_file_data.meshes = std::make_unique<Mesh[]>(model_file_data.header.num_meshes);
-	model_file_stream.read((char*)model_file_data.meshes.get(), model_file_data.header.num_meshes * sizeof(Mesh));
-	const auto has_tangents = HasFlag(model_file_data.header.vertex_flags, VertexFlags::HAS_TANGENT);
-	const auto has_joint_data = HasFlag(model_file_data.header.vertex_flags, VertexFlags::HAS_JOINT_DATA);
-	constexpr auto default_vertex_size_bytes = sizeof(glm::vec3) + sizeof(glm::vec3) + sizeof(glm::vec2); // position normal uv
-	constexpr auto tangent_data_size_bytes = sizeof(glm::vec3);
-	constexpr auto joint_data_size_bytes = sizeof(std::uint32_t) + sizeof(glm::vec4);
-	const auto vertex_size_bytes = default_vertex_size_bytes + (has_tangents ? tangent_data_size_bytes : 0) + (has_joint_data ? joint_data_size_bytes : 0);
-	const auto vertex_buffer_size_bytes = model_file_data.header.num_vertices * vertex_size_bytes;
-	model_file_data.vertex_buffer = std::make_unique<std::uint8_t[]>(vertex_buffer_size_bytes);
-	model_file_data.indices = std::make_unique<unsigned int[]>(model_file_data.header.num_indices);
-	model_file_data.materials = std::make_unique<PhongMaterial[]>(model_file_data.header.num_materials);
-	model_file_stream.read((char*)model_file_data.vertex_buffer.get(), vertex_buffer_size_bytes);
-	const auto index_buffer_size_bytes = model_file_data.header.num_indices * sizeof(unsigned int);
-	model_file_stream.read((char*)model_file_data.indices.get(), index_buffer_size_bytes);
-	for (auto i = 0u; i < model_file_data.header.num_materials; i++)
+	const auto has_tangents = HasFlag(data.file_vertex_flags, VertexFlags::HAS_TANGENT);
+	const auto has_joint_data = HasFlag(data.file_vertex_flags, VertexFlags::HAS_JOINT_DATA);
+	const auto& layout = this->vertex_layout;
+	const auto vertex_size_bytes = layout.size_bytes;
+	const auto num_vertices = this->vertices.size() / vertex_size_bytes;
+
+	// Diffuse, specular and normal map of each material, packed into texture arrays once all are loaded
+	std::vector<unsigned int> map_textures(this->materials.size() * 3);
+	for (std::size_t i = 0; i < map_textures.size(); i++)
 	{
-		auto& material = model_file_data.materials[i];
-		model_file_stream.read((char*)&material.diffuse_coefficient, sizeof(material.diffuse_coefficient));
-		model_file_stream.read((char*)&material.specular_coefficient, sizeof(material.specular_coefficient));
-		model_file_stream.read((char*)&material.shininess, sizeof(material.shininess));
-		model_file_stream.read((char*)&material.flags, sizeof(material.flags));
-		std::string diffusemap_filename; std::getline(model_file_stream, diffusemap_filename, '\0');
-		std::string specularmap_filename; std::getline(model_file_stream, specularmap_filename, '\0');
-		std::string normalmap_filename; std::getline(model_file_stream, normalmap_filename, '\0');
-		if (!diffusemap_filename.empty()) material.diffuse_map.id = LoadTexture(diffusemap_filename.c_str(), directory);
-		else material.diffuse_map.id = White1x1Texture();
-		if (!specularmap_filename.empty()) material.specular_map.id = LoadTexture(specularmap_filename.c_str(), directory);
-		else material.specular_map.id = White1x1Texture();
-		if (!normalmap_filename.empty()) material.normal_map.id = LoadTexture(normalmap_filename.c_str(), directory);
-		else material.normal_map.id = Blue1x1Texture();
+		const auto& map_name = data.material_map_names[i];
+		if (!map_name.empty()) map_textures[i] = LoadTexture(map_name.c_str(), directory);
+		else map_textures[i] = i % 3 == 2 ? Blue1x1Texture() : White1x1Texture();
 	}
 
-	std::copy(model_file_data.meshes.get(), model_file_data.meshes.get() + model_file_data.header.num_meshes, std::back_inserter(this->meshes));
-	std::copy(model_file_data.materials.get(), model_file_data.materials.get() + model_file_data.header.num_materials, std::back_inserter(this->materials));
+	// Same sized maps share an array so meshes with different materials can be drawn without rebinding textures.
+	// The 2D textures aren't needed afterwards.
+	const auto map_layers = PackTextureArrays(map_textures, this->texture_arrays);
+	std::sort(map_textures.begin(), map_textures.end());
+	map_textures.erase(std::unique(map_textures.begin(), map_textures.end()), map_textures.end());
+	for (auto texture : map_textures) ReleaseTexture(texture);
+	std::vector<MaterialBlock> material_blocks(max_materials);
+	std::vector<std::array<std::uint16_t, 3>> texture_sets;
+	for (std::size_t i = 0; i < this->materials.size(); i++)
+	{
+		auto& material = this->materials[i];
+		material.diffuse_map = map_layers[i * 3];
+		material.specular_map = map_layers[i * 3 + 1];
+		material.normal_map = map_layers[i * 3 + 2];
+		const std::array<std::uint16_t, 3> arrays = { material.diffuse_map.array, material.specular_map.array, material.normal_map.array };
+		auto texture_set = std::find(texture_sets.begin(), texture_sets.end(), arrays);
+		if (texture_set == texture_sets.end()) texture_set = texture_sets.insert(texture_sets.end(), arrays);
+		material.texture_set = (std::uint16_t)(texture_set - texture_sets.begin());
+
+		static_assert(std::is_same_v<std::uint32_t, std::underlying_type<PhongMaterialFlags>::type>);
+		material_blocks[i] = { material.diffuse_coefficient, material.shininess, material.specular_coefficient, (std::uint32_t)material.flags,
+			glm::ivec4(material.diffuse_map.layer, material.specular_map.layer, material.normal_map.layer, 0) };
+	}
+	// The whole block is allocated since the shader declares max_materials entries
+	glGenBuffers(1, &material_ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, material_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, material_blocks.size() * sizeof(MaterialBlock), material_blocks.data(), GL_STATIC_DRAW);
+
+	constexpr auto no_mesh = std::numeric_limits<std::uint32_t>::max();
+	// Compressed positions are quantized within the bounds of the one mesh drawing them, vertices shared between
+	// meshes make every mesh use the model's bounds. LODs only use vertices of the full mesh, LOD 0 covers them all.
+	std::vector<std::uint32_t> vertex_meshes(num_vertices, no_mesh);
+	bool meshes_share_vertices = false;
+	glm::vec3 model_min(std::numeric_limits<float>::max()), model_max(-std::numeric_limits<float>::max());
+	for (std::uint32_t mesh_index = 0; mesh_index < this->meshes.size(); mesh_index++)
+	{
+		const auto& draw = this->mesh_draws[mesh_index * max_mesh_lods];
+		glm::vec3 min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max());
+		std::uint8_t influences = 1;
+		for (std::uint32_t i = 0; i < draw.index_count; i++)
+		{
+			const auto vertex = ReadIndex(data.index_data, draw, i);
+			glm::vec3 position;
+			std::memcpy(&position, this->vertices.data() + vertex * vertex_size_bytes, sizeof(position));
+			min = glm::min(min, position);
+			max = glm::max(max, position);
+			meshes_share_vertices |= vertex_meshes[vertex] != no_mesh && vertex_meshes[vertex] != mesh_index;
+			vertex_meshes[vertex] = mesh_index;
+			if (has_joint_data)
+			{
+				float weights[4];
+				std::memcpy(weights, this->vertices.data() + vertex * vertex_size_bytes + layout.weights_offset, sizeof(weights));
+				if (weights[2] != 0.0f || weights[3] != 0.0f) influences = 4;
+				else if (weights[1] != 0.0f && influences < 2) influences = 2;
+			}
+		}
+		this->mesh_centers.push_back((min + max) * 0.5f);
+		this->mesh_position_quantization.push_back({ glm::max(max - min, glm::vec3(0.0f)) * 0.5f / snorm16_max, (min + max) * 0.5f });
+		this->mesh_joint_influences.push_back(influences);
+		model_min = glm::min(model_min, min);
+		model_max = glm::max(model_max, max);
+	}
+
+	this->vertex_flags = data.file_vertex_flags;
+	const bool compress_vertices = HasFlag(vertex_options, VertexFlags::COMPRESSED);
+	auto gpu_layout = layout;
+	std::vector<std::uint8_t> compressed_vertices;
+	if (compress_vertices)
+	{
+		this->vertex_flags |= VertexFlags::COMPRESSED;
+		if (meshes_share_vertices || this->meshes.empty())
+		{
+			const PositionQuantization model_quantization = { glm::max(model_max - model_min, glm::vec3(0.0f)) * 0.5f / snorm16_max, (model_min + model_max) * 0.5f };
+			std::fill(this->mesh_position_quantization.begin(), this->mesh_position_quantization.end(), model_quantization);
+			if (this->meshes.empty()) this->mesh_position_quantization.push_back(model_quantization);
+		}
+		// Vertices no mesh draws can go in any bounds
+		std::replace(vertex_meshes.begin(), vertex_meshes.end(), no_mesh, 0u);
+
+		gpu_layout = CompressedVertexLayout(has_tangents, has_joint_data);
+		const auto error = CompressVertices(this->vertices, layout, gpu_layout, vertex_meshes, this->mesh_position_quantization, compressed_vertices);
+		std::cout << "Compressed vertices of " << this->name << ": " << layout.size_bytes << " -> " << gpu_layout.size_bytes
+			<< " bytes per vertex (" << num_vertices * layout.size_bytes / 1024 << " -> " << compressed_vertices.size() / 1024 << " KB). "
+			<< "Max error: position " << error.position << ", normal " << error.normal_degrees << " deg, tangent " << error.tangent_degrees
+			<< " deg, uv " << error.uv << ", weight " << error.weight << (meshes_share_vertices ? " (meshes share vertices, model bounds)" : "") << '\n';
+	}
+	const auto gpu_vertex_data = compress_vertices ? compressed_vertices.data() : this->vertices.data();
+	this->gpu_vertex_bytes = (std::size_t)num_vertices * gpu_layout.size_bytes;
 
 	glGenVertexArrays(1, &VAO);
 	glBindVertexArray(VAO);
 
 	glGenBuffers(1, &VBO);
 	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, vertex_buffer_size_bytes, model_file_data.vertex_buffer.get(), GL_STATIC_DRAW);
-	
+	glBufferData(GL_ARRAY_BUFFER, this->gpu_vertex_bytes, gpu_vertex_data, GL_STATIC_DRAW);
+
 	glGenBuffers(1, &EBO);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * model_file_data.header.num_indices, model_file_data.indices.get(), GL_STATIC_DRAW);
-
-	const char* offset = 0;
-	std::uint32_t attribute_index = 0;
-
-	// default vertex data- every vertex buffer has at least position normal uv
-	// position
-	auto stride = (GLsizei)vertex_size_bytes;
-	glVertexAttribPointer(attribute_index, 3, GL_FLOAT, GL_FALSE, stride, offset);
-	glEnableVertexAttribArray(attribute_index);
-	offset += sizeof(glm::vec3);
-	attribute_index++;
-	
-	// normal
-	glVertexAttribPointer(attribute_index, 3, GL_FLOAT, GL_FALSE, stride, offset);
-	glEnableVertexAttribArray(attribute_index);
-	offset += sizeof(glm::vec3);
-	attribute_index++;
-
-	// uv
-	glVertexAttribPointer(attribute_index, 2, GL_FLOAT, GL_FALSE, stride, offset);
-	glEnableVertexAttribArray(attribute_index);
-	offset += sizeof(glm::vec2);
-	attribute_index++;
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, data.index_data.size(), data.index_data.data(), GL_STATIC_DRAW);
 
-	if (has_tangents)
+	// Both VAOs read the same vertex layout, the instanced one adds per-instance attributes after it. Shaders use
+	// fixed locations, joint data stays at 4 without tangents.
+	auto SetVertexAttributes = [&]()
+	{
+		auto stride = (GLsizei)gpu_layout.size_bytes;
+		auto Offset = [](std::uint32_t offset) { return (const void*)(std::uintptr_t)offset; };
+
+		// default vertex data- every vertex buffer has at least position normal uv. Compressed positions and
+		// directions go to the shader as the integer values of their snorm16 components, it decodes them.
+		// position
+		if (compress_vertices) glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, stride, Offset(0));
+		else glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, Offset(0));
+		glEnableVertexAttribArray(0);
+
+		// normal
+		if (compress_vertices) glVertexAttribPointer(1, 2, GL_SHORT, GL_FALSE, stride, Offset(gpu_layout.normal_offset));
+		else glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, Offset(gpu_layout.normal_offset));
+		glEnableVertexAttribArray(1);
+
+		// uv
+		glVertexAttribPointer(2, 2, compress_vertices ? GL_HALF_FLOAT : GL_FLOAT, GL_FALSE, stride, Offset(gpu_layout.uv_offset));
+		glEnableVertexAttribArray(2);
+
+		if (has_tangents)
+		{
+			// tangent
+			if (compress_vertices) glVertexAttribPointer(3, 2, GL_SHORT, GL_FALSE, stride, Offset(gpu_layout.tangent_offset));
+			else glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, Offset(gpu_layout.tangent_offset));
+			glEnableVertexAttribArray(3);
+		}
+		if (has_joint_data)
+		{
+			// joint indices
+			glVertexAttribIPointer(4, 1, GL_UNSIGNED_INT, stride, Offset(gpu_layout.joints_offset));
+			glEnableVertexAttribArray(4);
+
+			// joint weights
+			if (compress_vertices) glVertexAttribPointer(5, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, Offset(gpu_layout.weights_offset));
+			else glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, stride, Offset(gpu_layout.weights_offset));
+			glEnableVertexAttribArray(5);
+		}
+	};
+	SetVertexAttributes();
+
+	// Per-instance data comes from a stream the caller points the attributes at, see BindInstancedGeometry
+	glGenVertexArrays(1, &instanced_VAO);
+	glBindVertexArray(instanced_VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+	SetVertexAttributes();
+	for (auto i = 0u; i < instance_attribute_count; i++)
 	{
-		// tangent
-		glVertexAttribPointer(attribute_index, 3, GL_FLOAT, GL_FALSE, stride, offset);
-		glEnableVertexAttribArray(attribute_index);
-		offset += sizeof(glm::vec3);
-		attribute_index++;
+		glEnableVertexAttribArray(first_instance_attribute + i);
+		glVertexAttribDivisor(first_instance_attribute + i, 1);
 	}
-	if (has_joint_data)
+	glBindVertexArray(0);
+	for (auto& clip : this->clips)
 	{
-		// joint indices
-		glVertexAttribIPointer(attribute_index, 1, GL_UNSIGNED_INT, stride, offset);
-		glEnableVertexAttribArray(attribute_index);
-		offset += sizeof(std::uint32_t);
-		attribute_index++;
+		if (compression.enabled && clip.pose_count > max_compressed_pose_count)
+		{
+			std::cout << "LoadAnimatedModel::Clip '" << clip.name << "' has " << clip.pose_count << " poses, more than the "
+				<< max_compressed_pose_count << " compressed clips can index. Keeping it uncompressed\n";
+		}
+		else if (compression.enabled)
+		{
+			CompressClip(clip, this->skeleton, compression);
+			const auto& compressed = clip.compressed;
+			std::cout << "Clip '" << clip.name << "': compressed " << compressed.uncompressed_size_bytes << " -> " << compressed.SizeBytes()
+				<< " bytes (" << (float)compressed.uncompressed_size_bytes / compressed.SizeBytes() << "x), kept "
+				<< compressed.KeyCount() << '/' << compressed.uncompressed_key_count << " animated keys, max position error "
+				<< compressed.max_position_error << '\n';
+		}
+	}
 
-		// joint weights
-		glVertexAttribPointer(attribute_index, 4, GL_FLOAT, GL_FALSE, stride, offset);
-		glEnableVertexAttribArray(attribute_index);
-		offset += sizeof(glm::vec4);
-		attribute_index++;
+	// Compressed clips own their keys, so once every clip is compressed the pack is only still mapped for the float
+	// vertices. Copying those out lets the mapping go, along with the keyframe and index pages loading touched.
+	const bool clips_use_pack = std::any_of(this->clips.begin(), this->clips.end(), [](const AnimationClip& clip) { return !clip.is_compressed; });
+	if (this->pack_file && !clips_use_pack)
+	{
+		this->vertex_storage.assign(this->vertices.begin(), this->vertices.end());
+		this->vertices = this->vertex_storage;
+		this->pack_file.reset();
 	}
+}
+
+void AnimatedModel::LoadSourceFiles(const std::filesystem::path& model_file_path, const std::filesystem::path& skeleton_file_path,
+	const std::vector<std::filesystem::path>& animation_file_paths, LoadData& data)
+{
+	namespace fs = std::filesystem;
 
 	std::ifstream skeleton_file_stream(skeleton_file_path, std::ios::binary);
 	SkeletonFile skeleton_file_data;
@@ -192,10 +726,208 @@ void AnimatedModel::LoadAnimatedModel(const std::string& directory)
 		std::getline(skeleton_file_stream, joint_name, '\0');
 	}
 
-	std::copy(skeleton_file_data.joints.get(), skeleton_file_data.joints.get() + skeleton_file_data.header.num_joints, std::back_inserter(this->skeleton.joints));
-	std::copy(skeleton_file_data.joint_names.get(), skeleton_file_data.joint_names.get() + skeleton_file_data.header.num_joints, std::back_inserter(this->skeleton.joint_names));
+	const auto num_joints = skeleton_file_data.header.num_joints;
+	std::string skeleton_error;
+	if (!ValidateSkeleton(std::span(skeleton_file_data.joints.get(), num_joints), skeleton_error))
+	{
+		std::cout << "LoadAnimatedModel::Invalid skeleton in " << skeleton_file_path << ": " << skeleton_error << '\n';
+		std::exit(1);
+	}
+
+	// joint_order[new index] = index in the file
+	std::vector<std::uint16_t> joint_order;
+	BreadthFirstJointOrder(std::span(skeleton_file_data.joints.get(), num_joints), joint_order, this->skeleton.level_offsets);
+	std::vector<std::uint8_t> file_to_joint(num_joints);
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		file_to_joint[joint_order[i]] = (std::uint8_t)i;
+	}
+	this->skeleton.joints.resize(num_joints);
+	this->skeleton.joint_names.resize(num_joints);
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		auto& joint = this->skeleton.joints[i];
+		joint = skeleton_file_data.joints[joint_order[i]];
+		if (joint.parent >= 0) joint.parent = file_to_joint[joint.parent];
+		this->skeleton.joint_names[i] = std::move(skeleton_file_data.joint_names[joint_order[i]]);
+	}
+
+
+	std::ifstream model_file_stream(model_file_path, std::ios::binary);
+
+	ModelFile model_file_data;
+	model_file_stream.read((char*)&model_file_data.header, sizeof(model_file_data.header));
+	assert(model_file_data.header.magic_number == 'ldom');
+	model_file_data.meshes = std::make_unique<Mesh[]>(model_file_data.header.num_meshes);
+	model_file_stream.read((char*)model_file_data.meshes.get(), model_file_data.header.num_meshes * sizeof(Mesh));
+	if (HasFlag(model_file_data.header.vertex_flags, VertexFlags::COMPRESSED))
+	{
+		std::cout << "LoadAnimatedModel::Model " << model_file_path << " has compressed vertices, model files have to store float vertices\n";
+		std::exit(1);
+	}
+	data.file_vertex_flags = model_file_data.header.vertex_flags;
+	const auto has_joint_data = HasFlag(model_file_data.header.vertex_flags, VertexFlags::HAS_JOINT_DATA);
+	const auto& layout = this->vertex_layout = FloatVertexLayout(HasFlag(model_file_data.header.vertex_flags, VertexFlags::HAS_TANGENT), has_joint_data);
+	const std::size_t vertex_size_bytes = layout.size_bytes;
+	const auto vertex_buffer_size_bytes = model_file_data.header.num_vertices * vertex_size_bytes;
+	model_file_data.indices = std::make_unique<unsigned int[]>(model_file_data.header.num_indices);
+	if (model_file_data.header.num_materials > max_materials)
+	{
+		std::cout << "LoadAnimatedModel::Model " << model_file_path << " has " << model_file_data.header.num_materials
+			<< " materials, at most " << max_materials << " are supported\n";
+		std::exit(1);
+	}
+	// Read straight into the vertices the model keeps
+	this->vertex_storage.resize(vertex_buffer_size_bytes);
+	model_file_stream.read((char*)this->vertex_storage.data(), vertex_buffer_size_bytes);
+	const auto index_buffer_size_bytes = model_file_data.header.num_indices * sizeof(unsigned int);
+	model_file_stream.read((char*)model_file_data.indices.get(), index_buffer_size_bytes);
+	if (has_joint_data)
+	{
+		// Vertices reference joints by their index in the file, point them at the reordered joints
+		for (auto i = 0u; i < model_file_data.header.num_vertices; i++)
+		{
+			auto joint_indices = this->vertex_storage.data() + i * vertex_size_bytes + layout.joints_offset;
+			for (auto j = 0; j < 4; j++)
+			{
+				if (joint_indices[j] >= num_joints)
+				{
+					std::cout << "LoadAnimatedModel::Model " << model_file_path << " vertex " << i << " references joint "
+						<< (unsigned int)joint_indices[j] << ", the skeleton has " << num_joints << '\n';
+					std::exit(1);
+				}
+				joint_indices[j] = file_to_joint[joint_indices[j]];
+			}
+		}
+	}
+
+	// Duplicate vertices are welded and each mesh's triangles reordered for the post-transform cache and then for
+	// overdraw. Numbering vertices by first use afterwards makes fetches walk forward and leaves every mesh that
+	// doesn't share vertices with a compact vertex range.
+	const auto file_indices = std::span(model_file_data.indices.get(), model_file_data.header.num_indices);
+	const auto file_cache_stats = AnalyzeVertexCache(file_indices, model_file_data.header.num_vertices);
+	auto num_vertices = WeldVertices(this->vertex_storage, vertex_size_bytes, file_indices);
+	const auto welded_vertices = model_file_data.header.num_vertices - num_vertices;
+	for (auto i = 0u; i < model_file_data.header.num_meshes; i++)
+	{
+		const auto& mesh = model_file_data.meshes[i];
+		const auto mesh_indices = file_indices.subspan(mesh.indices_begin, mesh.indices_end - mesh.indices_begin);
+		OptimizeVertexCache(mesh_indices, num_vertices);
+		OptimizeOverdraw(mesh_indices, this->vertex_storage, vertex_size_bytes);
+	}
+	num_vertices = OptimizeVertexFetch(this->vertex_storage, vertex_size_bytes, file_indices);
+	this->vertices = this->vertex_storage;
+	const auto optimized_cache_stats = AnalyzeVertexCache(file_indices, num_vertices);
+	std::cout << "Optimized indices of " << this->name << ": " << welded_vertices << " vertices welded, ACMR " << file_cache_stats.acmr
+		<< " -> " << optimized_cache_stats.acmr << ", ATVR " << file_cache_stats.atvr << " -> " << optimized_cache_stats.atvr << '\n';
+
+	// Each LOD halves the triangles of the one before, as far as seams, borders and joint boundaries allow. The
+	// joint a vertex follows the most groups vertices for SimplifyMesh, merging across groups would smear the
+	// skinning between bones.
+	std::vector<std::uint8_t> joint_groups;
+	if (has_joint_data)
+	{
+		joint_groups.resize(num_vertices);
+		for (std::size_t i = 0; i < num_vertices; i++)
+		{
+			const auto vertex = this->vertices.data() + i * vertex_size_bytes;
+			std::uint8_t joints[4];
+			float weights[4];
+			std::memcpy(joints, vertex + layout.joints_offset, sizeof(joints));
+			std::memcpy(weights, vertex + layout.weights_offset, sizeof(weights));
+			joint_groups[i] = joints[std::max_element(weights, weights + 4) - weights];
+		}
+	}
+	// lod_indices[mesh * max_mesh_lods + lod]
+	std::vector<std::vector<std::uint32_t>> lod_indices(model_file_data.header.num_meshes * max_mesh_lods);
+	std::size_t lod_triangles[max_mesh_lods] = {};
+	for (auto i = 0u; i < model_file_data.header.num_meshes; i++)
+	{
+		const auto& mesh = model_file_data.meshes[i];
+		const auto mesh_indices = file_indices.subspan(mesh.indices_begin, mesh.indices_end - mesh.indices_begin);
+		lod_indices[i * max_mesh_lods].assign(mesh_indices.begin(), mesh_indices.end());
+		for (int lod = 1; lod < max_mesh_lods; lod++)
+		{
+			auto& indices = lod_indices[i * max_mesh_lods + lod];
+			indices = SimplifyMesh(lod_indices[i * max_mesh_lods + lod - 1], this->vertices, vertex_size_bytes, joint_groups, mesh_indices.size() >> lod);
+			OptimizeVertexCache(indices, num_vertices);
+		}
+		for (int lod = 0; lod < max_mesh_lods; lod++) lod_triangles[lod] += lod_indices[i * max_mesh_lods + lod].size() / 3;
+	}
+	std::cout << "Mesh LODs of " << this->name << ": " << lod_triangles[0];
+	for (int lod = 1; lod < max_mesh_lods; lod++) std::cout << " / " << lod_triangles[lod];
+	std::cout << " triangles\n";
+
+	data.material_map_names.resize(model_file_data.header.num_materials * 3);
+	for (auto i = 0u; i < model_file_data.header.num_materials; i++)
+	{
+		auto& material = this->materials.emplace_back();
+		model_file_stream.read((char*)&material.diffuse_coefficient, sizeof(material.diffuse_coefficient));
+		model_file_stream.read((char*)&material.specular_coefficient, sizeof(material.specular_coefficient));
+		model_file_stream.read((char*)&material.shininess, sizeof(material.shininess));
+		model_file_stream.read((char*)&material.flags, sizeof(material.flags));
+		for (int map = 0; map < 3; map++) std::getline(model_file_stream, data.material_map_names[i * 3 + map], '\0');
+	}
+
+	this->meshes.assign(model_file_data.meshes.get(), model_file_data.meshes.get() + model_file_data.header.num_meshes);
 
-	auto AddAnimation = [&clips = this->clips](const fs::path& path, int num_skeleton_joints)
+	// Meshes spanning fewer than 65536 vertices store 16 bit indices relative to their first vertex, which the draw
+	// adds back as its base vertex. LODs only use vertices of the full mesh, so they share its index type and base.
+	// Every index range starts on a 4 byte boundary.
+	auto& index_data = data.index_storage;
+	for (std::size_t mesh_index = 0; mesh_index < this->meshes.size(); mesh_index++)
+	{
+		const auto& full_indices = lod_indices[mesh_index * max_mesh_lods];
+		GLenum index_type = GL_UNSIGNED_INT;
+		std::uint32_t base_vertex = 0;
+		if (!full_indices.empty())
+		{
+			const auto [first_vertex, last_vertex] = std::minmax_element(full_indices.begin(), full_indices.end());
+			if (*last_vertex - *first_vertex <= std::numeric_limits<std::uint16_t>::max())
+			{
+				index_type = GL_UNSIGNED_SHORT;
+				base_vertex = *first_vertex;
+			}
+		}
+		const auto index_size = index_type == GL_UNSIGNED_SHORT ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+		for (int lod = 0; lod < max_mesh_lods; lod++)
+		{
+			const auto& indices = lod_indices[mesh_index * max_mesh_lods + lod];
+			MeshDraw draw{ index_type, (std::uint32_t)indices.size(), index_data.size(), (GLint)base_vertex };
+			index_data.resize(index_data.size() + (indices.size() * index_size + 3) / 4 * 4);
+			for (std::size_t i = 0; i < indices.size(); i++)
+			{
+				auto destination = index_data.data() + draw.first_index_byte + i * index_size;
+				if (index_type == GL_UNSIGNED_SHORT)
+				{
+					const auto index = (std::uint16_t)(indices[i] - base_vertex);
+					std::memcpy(destination, &index, sizeof(index));
+				}
+				else
+				{
+					std::memcpy(destination, &indices[i], sizeof(std::uint32_t));
+				}
+			}
+			this->mesh_draws.push_back(draw);
+		}
+	}
+	data.index_data = index_data;
+	std::cout << "Index buffer of " << this->name << ": " << file_indices.size_bytes() / 1024 << " KB in the file, " << index_data.size() / 1024
+		<< " KB with LODs\n";
+
+	auto IsUniformScale = [](const glm::vec3& scale)
+	{
+		constexpr float tolerance = 1e-3f;
+		return std::abs(scale.x - scale.y) <= tolerance * std::abs(scale.x) && std::abs(scale.x - scale.z) <= tolerance * std::abs(scale.x);
+	};
+	for (const auto& joint : this->skeleton.joints)
+	{
+		const glm::vec3 column_lengths(glm::length(joint.local_to_joint[0]), glm::length(joint.local_to_joint[1]), glm::length(joint.local_to_joint[2]));
+		this->uniform_joint_scale &= IsUniformScale(column_lengths);
+	}
+
+	auto AddAnimation = [&clips = this->clips, &joint_order, &IsUniformScale, &uniform_joint_scale = this->uniform_joint_scale]
+		(const fs::path& path, int num_skeleton_joints, std::vector<JointPose>& staging_pose)
 	{
 		std::ifstream animation_file_stream(path, std::ios::binary);
 		AnimationClipFile::Header clip_file_header;
@@ -206,117 +938,585 @@ void AnimatedModel::LoadAnimatedModel(const std::string& directory)
 		new_clip.frame_count = clip_file_header.frame_count;
 		new_clip.loops = clip_file_header.loops;
 		new_clip.name = path.stem().string();
-		const auto num_poses = clip_file_header.frame_count + (clip_file_header.loops ? 0 : 1);
-		new_clip.poses.resize(num_poses);
+		const auto num_file_poses = clip_file_header.frame_count + (clip_file_header.loops ? 0 : 1);
+		new_clip.Allocate(clip_file_header.frame_count + 1, num_skeleton_joints);
+		staging_pose.resize(num_skeleton_joints);
 		const auto pose_size_bytes = num_skeleton_joints * sizeof(JointPose);
-		for (auto& skeleton_pose : new_clip.poses)
+		for (auto pose_index = 0u; pose_index < num_file_poses; pose_index++)
+		{
+			animation_file_stream.read((char*)staging_pose.data(), pose_size_bytes);
+
+			const auto first_key = pose_index * num_skeleton_joints;
+			for (auto joint_index = 0; joint_index < num_skeleton_joints; joint_index++)
+			{
+				const auto& pose = staging_pose[joint_order[joint_index]];
+				// Quaternions are stored in the file in the order w, x, y, z. GLM stores them in the order
+				// x, y, z, w even though the glm::quat constructor takes them in the order w, x, y, z. This is fixing
+				// that ordering issue
+				new_clip.rotations[first_key + joint_index] = glm::quat(pose.rotation.x, pose.rotation.y, pose.rotation.z, pose.rotation.w);
+				new_clip.translations[first_key + joint_index] = pose.translation;
+				new_clip.scales[first_key + joint_index] = pose.scale;
+				uniform_joint_scale &= IsUniformScale(pose.scale);
+			}
+		}
+
+		// Duplicate the first pose at the end of looping clips so sampling never has to wrap around
+		if (new_clip.loops)
+		{
+			const auto last_key = clip_file_header.frame_count * num_skeleton_joints;
+			std::copy_n(new_clip.rotations.begin(), num_skeleton_joints, new_clip.rotations.begin() + last_key);
+			std::copy_n(new_clip.translations.begin(), num_skeleton_joints, new_clip.translations.begin() + last_key);
+			std::copy_n(new_clip.scales.begin(), num_skeleton_joints, new_clip.scales.begin() + last_key);
+		}
+
+		// q and -q are the same rotation but nlerp between them takes the long way around. Flipping keys into the
+		// hemisphere of the previous key here is what fixes the stutters the sampler used to need slerp for
+		for (auto pose_index = 1u; pose_index < new_clip.pose_count; pose_index++)
 		{
-			skeleton_pose.joint_poses.resize(num_skeleton_joints);
-			animation_file_stream.read((char*)skeleton_pose.joint_poses.data(), pose_size_bytes);
-
-			// Quaternions are stored in the file in the order w, x, y, z. GLM stores them in the order
-			// x, y, z, w even though the glm::quat constructor takes them in the order w, x, y, z. This is fixing
-			// that ordering issue
-			for (auto& pose : skeleton_pose.joint_poses) {
-				pose.rotation = glm::quat(pose.rotation.x, pose.rotation.y, pose.rotation.z, pose.rotation.w);
+			const auto previous = new_clip.PoseRotations(pose_index - 1);
+			auto current = new_clip.rotations.subspan(pose_index * num_skeleton_joints, num_skeleton_joints);
+			for (auto joint_index = 0; joint_index < num_skeleton_joints; joint_index++)
+			{
+				if (glm::dot(previous[joint_index], current[joint_index]) < 0.0f) current[joint_index] = -current[joint_index];
 			}
 		}
+
+		ExtractRootMotion(new_clip);
 	};
 
+	std::vector<JointPose> staging_pose;
 	for (auto& animation_file_path : animation_file_paths)
 	{
-		AddAnimation(animation_file_path, (int)skeleton.joints.size());
+		AddAnimation(animation_file_path, (int)skeleton.joints.size(), staging_pose);
+	}
+}
+
+bool AnimatedModel::LoadModelPack(const std::filesystem::path& pack_path, std::uint64_t source_stamp, LoadData& data)
+{
+	auto file = std::make_unique<MappedFile>(pack_path);
+	if (!file->IsOpen()) return false;
+	const auto bytes = file->Data();
+	ModelPackFile::Header header;
+	if (bytes.size() < sizeof(header)) return false;
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	if (header.magic_number != ModelPackFile::magic || header.version != ModelPackFile::version || header.source_stamp != source_stamp ||
+		header.max_mesh_lods != max_mesh_lods)
+	{
+		std::cout << "Model pack " << pack_path << " is out of date, loading the source files\n";
+		return false;
+	}
+	// A pack that was cut short or is damaged is rewritten
+	for (std::uint32_t section = 0; section < ModelPackFile::SECTION_COUNT; section++)
+	{
+		const auto offset = header.section_offsets[section], size = header.section_sizes[section];
+		if (offset % ModelPackFile::section_alignment != 0 || offset > bytes.size() || size > bytes.size() - offset)
+		{
+			std::cout << "Model pack " << pack_path << " is damaged, loading the source files\n";
+			return false;
+		}
+	}
+	const auto pack_joints = PackSection<const Joint>(bytes, header, ModelPackFile::JOINTS);
+	const auto level_offsets = PackSection<const std::uint16_t>(bytes, header, ModelPackFile::LEVEL_OFFSETS);
+	const auto strings = PackSection<const char>(bytes, header, ModelPackFile::STRINGS);
+	const auto pack_meshes = PackSection<const Mesh>(bytes, header, ModelPackFile::MESHES);
+	const auto pack_draws = PackSection<const ModelPackFile::Draw>(bytes, header, ModelPackFile::DRAWS);
+	const auto pack_materials = PackSection<const ModelPackFile::Material>(bytes, header, ModelPackFile::MATERIALS);
+	const auto pack_clips = PackSection<const ModelPackFile::Clip>(bytes, header, ModelPackFile::CLIPS);
+	const auto keyframes = PackSection<std::byte>(bytes, header, ModelPackFile::KEYFRAMES);
+	const auto root_motion = PackSection<const glm::vec2>(bytes, header, ModelPackFile::ROOT_MOTION);
+	const auto pack_vertices = PackSection<const std::uint8_t>(bytes, header, ModelPackFile::VERTICES);
+	const auto pack_indices = PackSection<const std::uint8_t>(bytes, header, ModelPackFile::INDICES);
+	const auto pack_layout = FloatVertexLayout(HasFlag(header.vertex_flags, VertexFlags::HAS_TANGENT), HasFlag(header.vertex_flags, VertexFlags::HAS_JOINT_DATA));
+	bool damaged = pack_draws.size() != pack_meshes.size() * max_mesh_lods || pack_materials.size() > max_materials || strings.empty() || strings.back() != '\0' ||
+		pack_vertices.size() % pack_layout.size_bytes != 0;
+	for (const auto& draw : pack_draws)
+	{
+		const std::size_t index_size = draw.index_type == GL_UNSIGNED_SHORT ? sizeof(std::uint16_t) : sizeof(std::uint32_t);
+		damaged |= (draw.index_type != GL_UNSIGNED_SHORT && draw.index_type != GL_UNSIGNED_INT) || draw.first_index_byte > pack_indices.size() ||
+			(std::size_t)draw.index_count * index_size > pack_indices.size() - draw.first_index_byte;
+	}
+	for (const auto& pack_clip : pack_clips)
+	{
+		const std::size_t num_keys = (std::size_t)pack_clip.pose_count * pack_clip.joint_count;
+		auto TrackFits = [&keyframes](std::uint64_t offset, std::size_t size_bytes)
+		{
+			return offset % ModelPackFile::section_alignment == 0 && offset <= keyframes.size() && size_bytes <= keyframes.size() - offset;
+		};
+		damaged |= pack_clip.joint_count != pack_joints.size() || pack_clip.pose_count == 0 || !TrackFits(pack_clip.rotations, num_keys * sizeof(glm::quat)) ||
+			!TrackFits(pack_clip.translations, num_keys * sizeof(glm::vec3)) || !TrackFits(pack_clip.scales, num_keys * sizeof(glm::vec3)) ||
+			pack_clip.first_root_motion > root_motion.size() || pack_clip.pose_count > root_motion.size() - pack_clip.first_root_motion;
+	}
+
+	// The values are used as indices too. The skeleton has to be the breadth first tree LoadSourceFiles writes, with
+	// every parent before its children and levels covering all joints, and every index and vertex joint index has to
+	// point at a vertex or joint that exists.
+	std::string skeleton_error;
+	damaged |= !ValidateSkeleton(pack_joints, skeleton_error);
+	for (std::size_t i = 0; i < pack_joints.size(); i++)
+	{
+		const auto parent = pack_joints[i].parent;
+		damaged |= i == 0 ? parent >= 0 : parent < 0 || parent >= (int)i;
+	}
+	damaged |= level_offsets.size() < 2 || level_offsets.front() != 0 || level_offsets.back() != pack_joints.size();
+	for (std::size_t level = 1; level < level_offsets.size(); level++)
+	{
+		damaged |= level_offsets[level] <= level_offsets[level - 1];
+	}
+	for (const auto& mesh : pack_meshes)
+	{
+		damaged |= mesh.material_index >= pack_materials.size();
+	}
+	const auto num_vertices = pack_vertices.size() / pack_layout.size_bytes;
+	for (std::size_t i = 0; i < pack_draws.size() && !damaged; i++)
+	{
+		// Read without the base vertex so a large index can't wrap around it
+		const auto& draw = pack_draws[i];
+		damaged |= draw.base_vertex < 0 || (std::size_t)draw.base_vertex > num_vertices;
+		const MeshDraw unbased_draw = { (GLenum)draw.index_type, draw.index_count, (std::size_t)draw.first_index_byte, 0 };
+		for (std::uint32_t index = 0; index < draw.index_count && !damaged; index++)
+		{
+			damaged |= ReadIndex(pack_indices, unbased_draw, index) >= num_vertices - (std::size_t)draw.base_vertex;
+		}
+	}
+	if (HasFlag(header.vertex_flags, VertexFlags::HAS_JOINT_DATA))
+	{
+		for (std::size_t vertex = 0; vertex < num_vertices && !damaged; vertex++)
+		{
+			std::uint8_t joint_indices[4];
+			std::memcpy(joint_indices, pack_vertices.data() + vertex * pack_layout.size_bytes + pack_layout.joints_offset, sizeof(joint_indices));
+			for (const auto joint : joint_indices) damaged |= joint >= pack_joints.size();
+		}
 	}
+	if (damaged)
+	{
+		std::cout << "Model pack " << pack_path << " is damaged, loading the source files\n";
+		return false;
+	}
+	auto String = [&strings](std::uint32_t offset) { return std::string(offset < strings.size() ? strings.data() + offset : ""); };
+
+	this->skeleton.joints.assign(pack_joints.begin(), pack_joints.end());
+	this->skeleton.level_offsets.assign(level_offsets.begin(), level_offsets.end());
+	std::size_t string_offset = 0;
+	for (std::size_t i = 0; i < pack_joints.size(); i++)
+	{
+		this->skeleton.joint_names.push_back(String((std::uint32_t)string_offset));
+		string_offset += this->skeleton.joint_names.back().size() + 1;
+	}
+
+	this->meshes.assign(pack_meshes.begin(), pack_meshes.end());
+	for (const auto& draw : pack_draws)
+	{
+		this->mesh_draws.push_back({ (GLenum)draw.index_type, draw.index_count, (std::size_t)draw.first_index_byte, draw.base_vertex });
+	}
+	for (const auto& pack_material : pack_materials)
+	{
+		auto& material = this->materials.emplace_back();
+		material.diffuse_coefficient = pack_material.diffuse_coefficient;
+		material.specular_coefficient = pack_material.specular_coefficient;
+		material.shininess = pack_material.shininess;
+		material.flags = pack_material.flags;
+		for (auto map_name : pack_material.map_names) data.material_map_names.push_back(String(map_name));
+	}
+
+	// Vertices, indices and keyframes stay in the mapping
+	data.file_vertex_flags = header.vertex_flags;
+	this->vertex_layout = pack_layout;
+	this->vertices = pack_vertices;
+	data.index_data = pack_indices;
+	this->uniform_joint_scale = header.uniform_joint_scale != 0;
+	for (const auto& pack_clip : pack_clips)
+	{
+		const std::size_t num_keys = (std::size_t)pack_clip.pose_count * pack_clip.joint_count;
+		auto& clip = this->clips.emplace_back();
+		clip.name = String(pack_clip.name);
+		clip.frame_count = pack_clip.frame_count;
+		clip.frames_per_second = pack_clip.frames_per_second;
+		clip.loops = pack_clip.loops != 0;
+		clip.pose_count = pack_clip.pose_count;
+		clip.joint_count = pack_clip.joint_count;
+		clip.rotations = { (glm::quat*)(keyframes.data() + pack_clip.rotations), num_keys };
+		clip.translations = { (glm::vec3*)(keyframes.data() + pack_clip.translations), num_keys };
+		clip.scales = { (glm::vec3*)(keyframes.data() + pack_clip.scales), num_keys };
+		const auto clip_root_motion = root_motion.subspan(pack_clip.first_root_motion, pack_clip.pose_count);
+		clip.root_motion.assign(clip_root_motion.begin(), clip_root_motion.end());
+		clip.root_motion_per_loop = pack_clip.root_motion_per_loop;
+	}
+	this->pack_file = std::move(file);
+	return true;
 }
 
-std::vector<glm::mat4> ComputeGlobalMatrices(const SkeletonPose& pose, const Skeleton& skeleton, bool apply_root_motion)
+void AnimatedModel::SaveModelPack(const std::filesystem::path& pack_path, std::uint64_t source_stamp, const LoadData& data) const
 {
-	assert(pose.joint_poses.size() == skeleton.joints.size());
+	// Laid out in memory first, the header's offsets are only known once every section is
+	ModelPackFile::Header header{};
+	header.magic_number = ModelPackFile::magic;
+	header.version = ModelPackFile::version;
+	header.source_stamp = source_stamp;
+	header.max_mesh_lods = max_mesh_lods;
+	header.vertex_flags = data.file_vertex_flags;
+	header.uniform_joint_scale = this->uniform_joint_scale;
+	std::vector<std::uint8_t> pack(AlignUp(sizeof(header), ModelPackFile::section_alignment));
+	auto AddSection = [&pack, &header](ModelPackFile::Section section, const void* section_data, std::size_t size_bytes)
+	{
+		const auto offset = AlignUp(pack.size(), ModelPackFile::section_alignment);
+		pack.resize(offset + size_bytes);
+		if (size_bytes > 0) std::memcpy(pack.data() + offset, section_data, size_bytes);
+		header.section_offsets[section] = offset;
+		header.section_sizes[section] = size_bytes;
+	};
+	std::string strings;
+	auto AddString = [&strings](const std::string& string)
+	{
+		const auto offset = (std::uint32_t)strings.size();
+		strings.append(string.c_str(), string.size() + 1);
+		return offset;
+	};
+	for (const auto& joint_name : this->skeleton.joint_names) AddString(joint_name);
+
+	std::vector<ModelPackFile::Draw> pack_draws;
+	for (const auto& draw : this->mesh_draws)
+	{
+		pack_draws.push_back({ draw.index_type, draw.index_count, draw.first_index_byte, draw.base_vertex, 0 });
+	}
+	std::vector<ModelPackFile::Material> pack_materials;
+	for (std::size_t i = 0; i < this->materials.size(); i++)
+	{
+		const auto& material = this->materials[i];
+		pack_materials.push_back({ material.diffuse_coefficient, material.specular_coefficient, material.shininess, material.flags,
+			{ AddString(data.material_map_names[i * 3]), AddString(data.material_map_names[i * 3 + 1]), AddString(data.material_map_names[i * 3 + 2]) } });
+	}
 
-	glm::mat4 local_mat = glm::identity<glm::mat4>();
-	if (apply_root_motion) local_mat = glm::translate(local_mat, pose.joint_poses[0].translation);
-	else local_mat = glm::translate(local_mat, glm::vec3(pose.joint_poses[0].translation.x, pose.joint_poses[0].translation.y, 0));
-	local_mat *= glm::mat4_cast(pose.joint_poses[0].rotation);
-	local_mat = glm::scale(local_mat, pose.joint_poses[0].scale);
+	// Tracks keep the section alignment so they're as aligned in the mapping as AnimationClip::Allocate makes them
+	std::vector<ModelPackFile::Clip> pack_clips;
+	std::vector<std::uint8_t> keyframes;
+	std::vector<glm::vec2> root_motion;
+	auto AddTrack = [&keyframes](const void* track, std::size_t size_bytes)
+	{
+		const auto offset = AlignUp(keyframes.size(), ModelPackFile::section_alignment);
+		keyframes.resize(offset + size_bytes);
+		std::memcpy(keyframes.data() + offset, track, size_bytes);
+		return (std::uint64_t)offset;
+	};
+	for (const auto& clip : this->clips)
+	{
+		assert(!clip.is_compressed);
+		ModelPackFile::Clip pack_clip{};
+		pack_clip.name = AddString(clip.name);
+		pack_clip.frame_count = clip.frame_count;
+		pack_clip.frames_per_second = clip.frames_per_second;
+		pack_clip.loops = clip.loops;
+		pack_clip.pose_count = clip.pose_count;
+		pack_clip.joint_count = clip.joint_count;
+		pack_clip.rotations = AddTrack(clip.rotations.data(), clip.rotations.size_bytes());
+		pack_clip.translations = AddTrack(clip.translations.data(), clip.translations.size_bytes());
+		pack_clip.scales = AddTrack(clip.scales.data(), clip.scales.size_bytes());
+		pack_clip.first_root_motion = root_motion.size();
+		pack_clip.root_motion_per_loop = clip.root_motion_per_loop;
+		root_motion.insert(root_motion.end(), clip.root_motion.begin(), clip.root_motion.end());
+		pack_clips.push_back(pack_clip);
+	}
 
-	std::vector<glm::mat4> global_joint_poses(pose.joint_poses.size());
-	global_joint_poses[0] = local_mat;
+	AddSection(ModelPackFile::JOINTS, this->skeleton.joints.data(), this->skeleton.joints.size() * sizeof(Joint));
+	AddSection(ModelPackFile::LEVEL_OFFSETS, this->skeleton.level_offsets.data(), this->skeleton.level_offsets.size() * sizeof(std::uint16_t));
+	AddSection(ModelPackFile::STRINGS, strings.data(), strings.size());
+	AddSection(ModelPackFile::MESHES, this->meshes.data(), this->meshes.size() * sizeof(Mesh));
+	AddSection(ModelPackFile::DRAWS, pack_draws.data(), pack_draws.size() * sizeof(ModelPackFile::Draw));
+	AddSection(ModelPackFile::MATERIALS, pack_materials.data(), pack_materials.size() * sizeof(ModelPackFile::Material));
+	AddSection(ModelPackFile::VERTICES, this->vertices.data(), this->vertices.size());
+	AddSection(ModelPackFile::INDICES, data.index_data.data(), data.index_data.size());
+	AddSection(ModelPackFile::CLIPS, pack_clips.data(), pack_clips.size() * sizeof(ModelPackFile::Clip));
+	AddSection(ModelPackFile::KEYFRAMES, keyframes.data(), keyframes.size());
+	AddSection(ModelPackFile::ROOT_MOTION, root_motion.data(), root_motion.size() * sizeof(glm::vec2));
+	std::memcpy(pack.data(), &header, sizeof(header));
 
-	for (int i = 1; i < global_joint_poses.size(); i++)
+	// Written under another name first so a pack cut short never replaces a good one
+	std::error_code error;
+	std::filesystem::create_directories(pack_path.parent_path(), error);
+	auto temporary_path = pack_path;
+	temporary_path += ".tmp";
 	{
-		auto& joint = skeleton.joints[i];
-		auto& parent_global = global_joint_poses[joint.parent];
+		std::ofstream out(temporary_path, std::ios::binary);
+		out.write((const char*)pack.data(), pack.size());
+	}
+	if (std::filesystem::file_size(temporary_path, error) == pack.size()) std::filesystem::rename(temporary_path, pack_path, error);
+	else error = std::make_error_code(std::errc::io_error);
+	if (error) std::cout << "Could not write model pack " << pack_path << ": " << error.message() << '\n';
+	else std::cout << "Wrote model pack " << pack_path << " (" << pack.size() / 1024 << " KB)\n";
+}
+
+glm::vec2 SampleRootMotion(const AnimationClip& clip, float clip_time)
+{
+	const float pose = std::clamp(clip_time * clip.frames_per_second, 0.0f, (float)(clip.pose_count - 1));
+	const auto pose_a = std::min((unsigned int)pose, clip.pose_count - 1);
+	const auto pose_b = std::min(pose_a + 1, clip.pose_count - 1);
+	return glm::mix(clip.root_motion[pose_a], clip.root_motion[pose_b], pose - (float)pose_a);
+}
 
-		local_mat = glm::identity<glm::mat4>();
-		local_mat = glm::translate(local_mat, pose.joint_poses[i].translation);
-		local_mat *= glm::mat4_cast(pose.joint_poses[i].rotation);
-		local_mat = glm::scale(local_mat, pose.joint_poses[i].scale);
-		global_joint_poses[i] = parent_global * local_mat;
+glm::vec2 AdvanceClipTime(const AnimationClip& clip, float& clip_time, float dt)
+{
+	// One-pose clips have no duration to wrap or clamp into
+	if (clip.frame_count == 0)
+	{
+		clip_time = 0.0f;
+		return glm::vec2(0.0f);
 	}
+	const float duration = clip.frame_count / clip.frames_per_second;
+	// Clips that don't loop hold their first and last poses
+	const float loops = clip.loops ? std::floor((clip_time + dt) / duration) : 0.0f;
+	const float new_time = std::clamp(clip_time + dt - loops * duration, 0.0f, duration);
+	const auto displacement = SampleRootMotion(clip, new_time) - SampleRootMotion(clip, clip_time) + clip.root_motion_per_loop * loops;
+	clip_time = new_time;
+	return displacement;
+}
 
-	return global_joint_poses;
+void ClipCursor::Resize(std::size_t num_joints)
+{
+	rotation_keys.resize(num_joints);
+	translation_keys.resize(num_joints);
+	scale_keys.resize(num_joints);
 }
 
-std::vector<glm::mat4> ComputeGlobalMatrices(const AnimationClip& clip, const Skeleton& skeleton, float clip_time, bool apply_root_motion)
+void ClipCursor::Reset(const AnimationClip& clip)
 {
-	float pose_index = clip_time * clip.frames_per_second;
-	auto a = (int)std::floor(pose_index);
-	auto b = a + 1;
-	auto pose = Interpolate(clip.poses[a], clip.poses[b], pose_index - a);
+	this->clip = &clip;
+	std::fill(rotation_keys.begin(), rotation_keys.end(), 0u);
+	std::fill(translation_keys.begin(), translation_keys.end(), 0u);
+	std::fill(scale_keys.begin(), scale_keys.end(), 0u);
+}
 
-	return ComputeGlobalMatrices(pose, skeleton, apply_root_motion);
+void PoseScratch::Resize(std::size_t num_joints)
+{
+	local_pose.Resize(num_joints);
+	global_matrices.resize(num_joints);
+	skinning_matrices.resize(num_joints);
+	cursor.Resize(num_joints);
 }
 
-std::vector<glm::mat4> ComputeSkinningMatrices(const AnimationClip& clip, const Skeleton& skeleton, float clip_time, bool apply_root_motion)
+void SampleClip(const AnimationClip& clip, float clip_time, PoseView out_local_pose, ClipCursor* cursor)
 {
-	auto global_joint_poses = ComputeGlobalMatrices(clip, skeleton, clip_time, apply_root_motion);
+	assert(out_local_pose.size() == clip.joint_count);
 
-	std::vector<glm::mat4> skinning_matrices(global_joint_poses.size());
-	for (int i = 0; i < global_joint_poses.size(); i++)
+	const float pose_index = std::clamp(clip_time * clip.frames_per_second, 0.0f, (float)(clip.pose_count - 1));
+	if (clip.is_compressed)
 	{
-		skinning_matrices[i] = global_joint_poses[i] * glm::mat4(skeleton.joints[i].local_to_joint);
+		SampleCompressedClip(clip, pose_index, out_local_pose, cursor);
+		return;
 	}
 
-	return skinning_matrices;
+	const auto a = std::min((unsigned int)pose_index, clip.pose_count - 1);
+	const auto b = std::min(a + 1, clip.pose_count - 1);
+	const float t = pose_index - (float)a;
+
+	const auto& kernels = GetAnimationKernels();
+	kernels.nlerp_quaternions((const float*)clip.PoseRotations(a).data(), (const float*)clip.PoseRotations(b).data(), t,
+		(float*)out_local_pose.rotations.data(), clip.joint_count);
+	kernels.lerp_floats((const float*)clip.PoseTranslations(a).data(), (const float*)clip.PoseTranslations(b).data(), t,
+		(float*)out_local_pose.translations.data(), clip.joint_count * 3);
+	kernels.lerp_floats((const float*)clip.PoseScales(a).data(), (const float*)clip.PoseScales(b).data(), t,
+		(float*)out_local_pose.scales.data(), clip.joint_count * 3);
 }
 
-std::vector<glm::mat4> ComputeSkinningMatrices(const SkeletonPose& pose, const Skeleton& skeleton, bool apply_root_motion)
+void SampleClipJoint(const AnimationClip& clip, float pose, unsigned int joint, ClipCursor* cursor,
+	glm::quat& out_rotation, glm::vec3& out_translation, glm::vec3& out_scale)
 {
-	auto global_joint_poses = ComputeGlobalMatrices(pose, skeleton, apply_root_motion);
+	if (clip.is_compressed)
+	{
+		SampleCompressedJoint(clip, pose, joint, cursor, out_rotation, out_translation, out_scale);
+		return;
+	}
 
-	std::vector<glm::mat4> skinning_matrices(global_joint_poses.size());
-	for (int i = 0; i < global_joint_poses.size(); i++)
+	const auto a = std::min((unsigned int)pose, clip.pose_count - 1);
+	const auto b = std::min(a + 1, clip.pose_count - 1);
+	const float t = pose - (float)a;
+	const auto a_key = a * clip.joint_count + joint, b_key = b * clip.joint_count + joint;
+	if (t == 0.0f)
 	{
-		skinning_matrices[i] = global_joint_poses[i] * glm::mat4(skeleton.joints[i].local_to_joint);
+		out_rotation = clip.rotations[a_key];
+		out_translation = clip.translations[a_key];
+		out_scale = clip.scales[a_key];
+		return;
 	}
+	// Neighbouring keys are already in the same hemisphere
+	out_rotation = glm::normalize(clip.rotations[a_key] * (1.0f - t) + clip.rotations[b_key] * t);
+	out_translation = clip.translations[a_key] * (1.0f - t) + clip.translations[b_key] * t;
+	out_scale = clip.scales[a_key] * (1.0f - t) + clip.scales[b_key] * t;
+}
 
-	return skinning_matrices;
+void SampleClipJoints(const AnimationClip& clip, float time, std::span<const std::uint16_t> joints, bool nearest_key,
+	PoseView out_local_pose, ClipCursor* cursor)
+{
+	float pose = std::clamp(time * clip.frames_per_second, 0.0f, (float)(clip.pose_count - 1));
+	if (nearest_key) pose = std::round(pose);
+	for (auto joint : joints)
+	{
+		assert(joint < out_local_pose.size());
+		SampleClipJoint(clip, pose, joint, cursor, out_local_pose.rotations[joint], out_local_pose.translations[joint], out_local_pose.scales[joint]);
+	}
 }
 
-static JointPose ToJointPose(const glm::mat4& mat)
+static inline glm::mat4x3 ComposeAffine(const glm::quat& r, const glm::vec3& t, const glm::vec3& s)
 {
-	JointPose pose;
-	pose.rotation = glm::quat(mat);
-	pose.translation = mat[3];
-	pose.scale = { mat[0][0], mat[1][1], mat[2][2] };
-	return pose;
+	// Same as translate * mat4_cast(r) * scale but without building and multiplying full 4x4 matrices
+	const float xx = r.x * r.x, yy = r.y * r.y, zz = r.z * r.z;
+	const float xy = r.x * r.y, xz = r.x * r.z, yz = r.y * r.z;
+	const float wx = r.w * r.x, wy = r.w * r.y, wz = r.w * r.z;
+	glm::mat4x3 m;
+	m[0] = glm::vec3(1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz), 2.0f * (xz - wy)) * s.x;
+	m[1] = glm::vec3(2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + wx)) * s.y;
+	m[2] = glm::vec3(2.0f * (xz + wy), 2.0f * (yz - wx), 1.0f - 2.0f * (xx + yy)) * s.z;
+	m[3] = t;
+	return m;
+}
+
+// a * b treating both as 4x4 matrices with an implicit (0, 0, 0, 1) bottom row
+static inline glm::mat4x3 MultiplyAffine(const glm::mat4x3& a, const glm::mat4x3& b)
+{
+	glm::mat4x3 m;
+	m[0] = a[0] * b[0].x + a[1] * b[0].y + a[2] * b[0].z;
+	m[1] = a[0] * b[1].x + a[1] * b[1].y + a[2] * b[1].z;
+	m[2] = a[0] * b[2].x + a[1] * b[2].y + a[2] * b[2].z;
+	m[3] = a[0] * b[3].x + a[1] * b[3].y + a[2] * b[3].z + a[3];
+	return m;
+}
+
+void ComputeJointMatrices(ConstPoseView local_pose, const Skeleton& skeleton, std::span<glm::mat4x3> out_global_matrices,
+	std::span<glm::mat4x3> out_skinning_matrices)
+{
+	assert(local_pose.size() == skeleton.joints.size());
+	assert(out_global_matrices.size() == skeleton.joints.size());
+	assert(out_skinning_matrices.size() == skeleton.joints.size());
+
+	out_global_matrices[0] = ComposeAffine(local_pose.rotations[0], local_pose.translations[0], local_pose.scales[0]);
+	out_skinning_matrices[0] = MultiplyAffine(out_global_matrices[0], skeleton.joints[0].local_to_joint);
+
+	const auto num_joints = local_pose.size();
+	for (auto i = 1u; i < num_joints; i++)
+	{
+		auto& joint = skeleton.joints[i];
+		assert(joint.parent >= 0 && joint.parent < (int)i);
+		const auto local_mat = ComposeAffine(local_pose.rotations[i], local_pose.translations[i], local_pose.scales[i]);
+		out_global_matrices[i] = MultiplyAffine(out_global_matrices[joint.parent], local_mat);
+		out_skinning_matrices[i] = MultiplyAffine(out_global_matrices[i], joint.local_to_joint);
+	}
+}
+
+void PoseCache::Resize(std::size_t num_joints)
+{
+	global_matrices.resize(num_joints);
+	skinning_matrices.resize(num_joints);
+	dirty.resize(num_joints);
+	recomputed.resize(num_joints);
+	MarkAllDirty();
+}
+
+void PoseCache::MarkDirty(std::size_t joint)
+{
+	dirty[joint] = 1;
+	any_dirty = true;
+}
+
+void PoseCache::MarkAllDirty()
+{
+	std::fill(dirty.begin(), dirty.end(), (std::uint8_t)1);
+	any_dirty = true;
+}
+
+bool PoseCache::Update(ConstPoseView local_pose, const Skeleton& skeleton)
+{
+	assert(local_pose.size() == skeleton.joints.size() && global_matrices.size() == skeleton.joints.size());
+
+	last_update_joint_count = 0;
+	if (!any_dirty) return false;
+
+	// Parents come before their children, so one forward pass sees a parent's flag before its subtree
+	const auto num_joints = local_pose.size();
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		const auto parent = skeleton.joints[i].parent;
+		recomputed[i] = dirty[i] || (i > 0 && recomputed[parent]);
+		dirty[i] = 0;
+		if (!recomputed[i]) continue;
+
+		const auto local_mat = ComposeAffine(local_pose.rotations[i], local_pose.translations[i], local_pose.scales[i]);
+		global_matrices[i] = i == 0 ? local_mat : MultiplyAffine(global_matrices[parent], local_mat);
+		skinning_matrices[i] = MultiplyAffine(global_matrices[i], skeleton.joints[i].local_to_joint);
+		last_update_joint_count++;
+	}
+	any_dirty = false;
+	return true;
+}
+
+void ComputeJointMatrices(const AnimationClip& clip, const Skeleton& skeleton, float clip_time, PoseScratch& scratch)
+{
+	if (scratch.cursor.clip != &clip) scratch.cursor.Reset(clip);
+	SampleClip(clip, clip_time, scratch.local_pose, &scratch.cursor);
+	ComputeJointMatrices(scratch.local_pose, skeleton, scratch);
+}
+
+void ComputeJointMatrices(const SkeletonPose& pose, const Skeleton& skeleton, PoseScratch& scratch)
+{
+	ComputeJointMatrices(pose, skeleton, scratch.global_matrices, scratch.skinning_matrices);
+}
+
+void ComputeSkinningDualQuaternions(std::span<const glm::mat4x3> skinning_matrices, std::span<glm::vec4> out_dual_quaternions)
+{
+	assert(out_dual_quaternions.size() == skinning_matrices.size() * 2);
+	for (std::size_t i = 0; i < skinning_matrices.size(); i++)
+	{
+		const auto& m = skinning_matrices[i];
+		const auto rotation = glm::normalize(glm::quat_cast(glm::mat3(glm::normalize(m[0]), glm::normalize(m[1]), glm::normalize(m[2]))));
+		const auto& t = m[3];
+		// dual = 0.5 * (0, t) * rotation
+		const glm::vec3 r(rotation.x, rotation.y, rotation.z);
+		const auto dual_vector = 0.5f * (rotation.w * t + glm::cross(t, r));
+		const float dual_scalar = -0.5f * glm::dot(t, r);
+		out_dual_quaternions[i * 2] = glm::vec4(r, rotation.w);
+		out_dual_quaternions[i * 2 + 1] = glm::vec4(dual_vector, dual_scalar);
+	}
+}
+
+static void ToJointPose(const glm::mat4& mat, SkeletonPose& pose, int joint_index)
+{
+	pose.rotations[joint_index] = glm::quat(mat);
+	pose.translations[joint_index] = mat[3];
+	pose.scales[joint_index] = { mat[0][0], mat[1][1], mat[2][2] };
 }
 
 SkeletonPose ComputeLocalMatrices(const std::vector<glm::mat4>& global_matrices, const Skeleton& skeleton)
 {
 	SkeletonPose pose;
-	auto num_joints = global_matrices.size();
-	pose.joint_poses.resize(num_joints);
+	auto num_joints = (int)global_matrices.size();
+	pose.Resize(num_joints);
 
-	pose.joint_poses[0] = ToJointPose(global_matrices[0]);
+	ToJointPose(global_matrices[0], pose, 0);
 
 	for (int i = 1; i < num_joints; i++)
 	{
 		auto parent_index = skeleton.joints[i].parent;
 		auto parent_global_inverse = glm::inverse(global_matrices[parent_index]);
 		auto local_mat = parent_global_inverse * global_matrices[i];
-		pose.joint_poses[i] = ToJointPose(local_mat);
+		ToJointPose(local_mat, pose, i);
 	}
 
 	return pose;
 }
+
+std::vector<float> ComputeTipDistances(const Skeleton& skeleton)
+{
+	const auto num_joints = skeleton.joints.size();
+	std::vector<glm::vec3> bind_positions(num_joints);
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		bind_positions[i] = glm::inverse(glm::mat4(skeleton.joints[i].local_to_joint))[3];
+	}
+
+	std::vector<float> tip_distances(num_joints, 0.0f);
+	for (auto i = num_joints - 1; i > 0; i--)
+	{
+		const auto parent = skeleton.joints[i].parent;
+		const float bone_length = glm::length(bind_positions[i] - bind_positions[parent]);
+		if (tip_distances[i] == 0.0f) tip_distances[i] = bone_length;
+		tip_distances[parent] = std::max(tip_distances[parent], bone_length + tip_distances[i]);
+	}
+	return tip_distances;
+}
@@ -1,12 +1,17 @@
 #ifndef ANIMATED_MODEL_H
 #define ANIMATED_MODEL_H
 
+#include <cstddef>
 #include <cstdint>
+#include <filesystem>
 #include <glm/glm.hpp>
+#include "MappedFile.h"
 #include "Material.h"
 #include "Shader.h"
 #include <string>
 #include <memory>
+#include <new>
+#include <span>
 #include <vector>
 
 struct Mesh
@@ -21,12 +26,19 @@ struct Joint
 	int parent;
 };
 
+// Joints are stored breadth first from the root, which LoadAnimatedModel enforces when it loads the skeleton. Parents
+// always come before their children and every depth of the hierarchy is a contiguous range of joints, so a whole
+// level can be processed at once given the levels before it.
 struct Skeleton
 {
 	std::vector<Joint> joints;
 	std::vector<std::string> joint_names;
+	std::vector<std::uint16_t> level_offsets; // joints at depth d are [level_offsets[d], level_offsets[d + 1])
+
+	std::size_t LevelCount() const { return level_offsets.empty() ? 0 : level_offsets.size() - 1; }
 };
 
+// Matches the per-joint layout of poses in .animation files
 struct JointPose
 {
 	glm::quat rotation;
@@ -36,31 +48,222 @@ struct JointPose
 
 struct SkeletonPose
 {
-	std::vector<JointPose> joint_poses; // relative to parent joint
+	// relative to parent joint, one entry per joint
+	std::vector<glm::quat> rotations;
+	std::vector<glm::vec3> translations;
+	std::vector<glm::vec3> scales;
 	// std::vector<glm::mat4> global_joint_poses; // relative to model
+
+	void Resize(std::size_t num_joints);
+};
+
+// Non-owning views over the component arrays of a pose, so poses can be sampled into any storage
+struct PoseView
+{
+	std::span<glm::quat> rotations;
+	std::span<glm::vec3> translations;
+	std::span<glm::vec3> scales;
+
+	PoseView(std::span<glm::quat> rotations, std::span<glm::vec3> translations, std::span<glm::vec3> scales)
+		: rotations(rotations), translations(translations), scales(scales) {}
+	PoseView(SkeletonPose& pose) : rotations(pose.rotations), translations(pose.translations), scales(pose.scales) {}
+	std::size_t size() const { return rotations.size(); }
+};
+
+struct ConstPoseView
+{
+	std::span<const glm::quat> rotations;
+	std::span<const glm::vec3> translations;
+	std::span<const glm::vec3> scales;
+
+	ConstPoseView(std::span<const glm::quat> rotations, std::span<const glm::vec3> translations, std::span<const glm::vec3> scales)
+		: rotations(rotations), translations(translations), scales(scales) {}
+	ConstPoseView(const SkeletonPose& pose) : rotations(pose.rotations), translations(pose.translations), scales(pose.scales) {}
+	ConstPoseView(const PoseView& pose) : rotations(pose.rotations), translations(pose.translations), scales(pose.scales) {}
+	std::size_t size() const { return rotations.size(); }
+};
+
+struct AlignedDelete
+{
+	std::size_t alignment;
+	void operator()(std::byte* ptr) const { ::operator delete(ptr, std::align_val_t(alignment)); }
+};
+
+// Quantized form of a clip's tracks, built at load time. Tracks that never change are stored once (or not at all
+// when they hold the identity), animated tracks are stored track-major with 48 bits per key. Key reduction may
+// leave an animated track with keys on only some poses, so each key also records the pose it belongs to.
+struct CompressedClip
+{
+	enum class TrackType : std::uint8_t
+	{
+		IDENTITY, // identity rotation, zero translation or unit scale
+		CONSTANT, // one full precision value
+		ANIMATED, // one quantized key per pose
+	};
+
+	struct Track
+	{
+		TrackType type = TrackType::IDENTITY;
+		std::uint32_t index = 0; // constant value for CONSTANT tracks, quantization range of ANIMATED translation/scale tracks
+		std::uint32_t first_key = 0; // ANIMATED tracks only
+		std::uint32_t key_count = 0; // ANIMATED tracks only, pose_count unless keys were removed
+	};
+
+	// Smallest three: the three smallest components in 15 bits each, the index of the dropped largest component
+	// in the top bits of the first two
+	struct QuantizedRotation { std::uint16_t packed[3]; };
+	// Each component normalized to the track's range and stored as 16 bits
+	struct QuantizedVec3 { std::uint16_t packed[3]; };
+	struct Range { glm::vec3 min, extent; };
+
+	std::vector<Track> rotation_tracks, translation_tracks, scale_tracks; // one per joint
+	std::vector<glm::quat> constant_rotations;
+	std::vector<glm::vec3> constant_translations, constant_scales;
+	std::vector<Range> translation_ranges, scale_ranges;
+	std::vector<QuantizedRotation> rotation_keys;
+	std::vector<QuantizedVec3> translation_keys, scale_keys;
+	std::vector<std::uint16_t> rotation_key_poses, translation_key_poses, scale_key_poses; // parallel to the key arrays
+
+	// Filled in by the compressor for reporting
+	std::size_t uncompressed_size_bytes = 0;
+	std::size_t uncompressed_key_count = 0; // keys across all animated tracks before reduction
+	float max_position_error = 0.0f; // largest model space joint position error over all keys, in model units
+
+	std::size_t SizeBytes() const;
+	std::size_t KeyCount() const { return rotation_keys.size() + translation_keys.size() + scale_keys.size(); }
 };
 
 struct AnimationClip
 {
+	static constexpr std::size_t track_alignment = 64;
+
 	//Skeleton* skeleton;
-	std::vector<SkeletonPose> poses;
+	// Keyframes live in a single aligned block holding one array per track type. Each array is indexed
+	// [pose * joint_count + joint], so sampling between two poses streams through two contiguous runs per track.
+	// Rotations of neighbouring poses are kept in the same hemisphere so they can be blended with nlerp.
+	std::unique_ptr<std::byte[], AlignedDelete> keyframe_data;
+	std::span<glm::quat> rotations;
+	std::span<glm::vec3> translations;
+	std::span<glm::vec3> scales;
+	// When set, the raw tracks above have been released and sampling decodes these instead
+	CompressedClip compressed;
+	bool is_compressed = false;
+	// Ground plane (x, z) displacement of the root from the first pose, one per pose. It's taken out of the root's
+	// translation track at load so sampled poses always play in place, see AdvanceClipTime.
+	std::vector<glm::vec2> root_motion;
+	glm::vec2 root_motion_per_loop = glm::vec2(0.0f); // displacement over one play through of the clip
+	// Skinning palettes for every pose, see BakeClipPalettes. 0 if the clip isn't baked.
+	unsigned int baked_palette_texture = 0;
+	unsigned int pose_count = 0; // frame_count + 1, looping clips get a copy of the first pose appended
+	unsigned int joint_count = 0;
 	std::string name;
 	float frames_per_second;
 	unsigned int frame_count;
 	bool loops;
+
+	void Allocate(unsigned int pose_count, unsigned int joint_count);
+	std::span<const glm::quat> PoseRotations(unsigned int pose) const { return rotations.subspan(pose * joint_count, joint_count); }
+	std::span<const glm::vec3> PoseTranslations(unsigned int pose) const { return translations.subspan(pose * joint_count, joint_count); }
+	std::span<const glm::vec3> PoseScales(unsigned int pose) const { return scales.subspan(pose * joint_count, joint_count); }
+};
+
+struct ClipCompressionSettings
+{
+	bool enabled = true;
+	// Keys are removed from animated tracks as long as every joint stays within this model space distance of the
+	// raw clip (cm for Mixamo rigs). Measured at each joint's furthest descendant. 0 keeps every key.
+	float max_position_error = 0.1f;
+};
+
+// Remembers which key pair each key-reduced track was last sampled between. Playing forward only ever moves a
+// track to the next pair, so finding keys is O(1) per track instead of a search. Jumping backwards (scrubbing,
+// looping) falls back to a binary search.
+struct ClipCursor
+{
+	const AnimationClip* clip = nullptr;
+	std::vector<std::uint32_t> rotation_keys, translation_keys, scale_keys; // per joint, left key within the track
+
+	void Resize(std::size_t num_joints);
+	void Reset(const AnimationClip& clip);
+};
+
+// Per-instance buffers reused by the sampling functions below. Sized once for a skeleton so steady-state
+// playback doesn't touch the heap.
+struct PoseScratch
+{
+	SkeletonPose local_pose;
+	std::vector<glm::mat4x3> global_matrices;
+	std::vector<glm::mat4x3> skinning_matrices;
+	ClipCursor cursor;
+
+	void Resize(std::size_t num_joints);
+};
+
+// Global and skinning matrices kept between frames for poses that rarely change. Joints marked dirty have their
+// subtree recomputed by the next Update, an Update with nothing dirty does no work at all.
+struct PoseCache
+{
+	std::vector<glm::mat4x3> global_matrices;
+	std::vector<glm::mat4x3> skinning_matrices;
+	std::vector<std::uint8_t> dirty; // per joint, set when the joint's local transform changed
+	std::vector<std::uint8_t> recomputed; // per joint, scratch for propagating dirty flags down the hierarchy
+	bool any_dirty = true;
+	std::uint32_t last_update_joint_count = 0; // joints recomputed by the last Update
+
+	void Resize(std::size_t num_joints);
+	void MarkDirty(std::size_t joint);
+	void MarkAllDirty();
+	// Returns whether any matrix changed
+	bool Update(ConstPoseView local_pose, const Skeleton& skeleton);
 };
 
-std::vector<glm::mat4> ComputeGlobalMatrices(const SkeletonPose& pose, const Skeleton& skeleton, bool apply_root_motion = true);
-std::vector<glm::mat4> ComputeGlobalMatrices(const AnimationClip& clip, const Skeleton& skeleton, float time, bool apply_root_motion = true);
-std::vector<glm::mat4> ComputeSkinningMatrices(const AnimationClip& clip, const Skeleton& skeleton, float time, bool apply_root_motion = true);
-std::vector<glm::mat4> ComputeSkinningMatrices(const SkeletonPose& pose, const Skeleton& skeleton, bool apply_root_motion = true);
+// Root displacement at time, interpolated between poses
+glm::vec2 SampleRootMotion(const AnimationClip& clip, float time);
+// Advances time by dt and returns how far the root moved on the ground plane. Looping clips wrap time into the clip,
+// and whole loops played in between add root_motion_per_loop each, so callers can accumulate it without drifting
+// back. Other clips clamp time to their ends, and clips with a single pose stay at time 0.
+glm::vec2 AdvanceClipTime(const AnimationClip& clip, float& time, float dt);
+
+// Allocation-free core. Output spans must have one element per skeleton joint.
+void SampleClip(const AnimationClip& clip, float time, PoseView out_local_pose, ClipCursor* cursor = nullptr);
+// Samples one joint at a fractional pose index (time * frames_per_second), for callers that walk joints in their own order
+void SampleClipJoint(const AnimationClip& clip, float pose, unsigned int joint, ClipCursor* cursor,
+	glm::quat& out_rotation, glm::vec3& out_translation, glm::vec3& out_scale);
+// Reduced sampling for animation LOD. Only the listed joints are written, the rest of out_local_pose is left alone.
+// nearest_key snaps to the closest key instead of interpolating.
+void SampleClipJoints(const AnimationClip& clip, float time, std::span<const std::uint16_t> joints, bool nearest_key,
+	PoseView out_local_pose, ClipCursor* cursor = nullptr);
+// Single pass over the hierarchy. Each joint's TRS is composed straight into affine 4x3 form, concatenated with
+// its parent and multiplied by the inverse bind matrix, writing model space and skinning matrices together.
+void ComputeJointMatrices(ConstPoseView local_pose, const Skeleton& skeleton, std::span<glm::mat4x3> out_global_matrices,
+	std::span<glm::mat4x3> out_skinning_matrices);
+
+// Convenience wrappers that evaluate into scratch's local pose and matrix buffers
+void ComputeJointMatrices(const AnimationClip& clip, const Skeleton& skeleton, float time, PoseScratch& scratch);
+void ComputeJointMatrices(const SkeletonPose& pose, const Skeleton& skeleton, PoseScratch& scratch);
+
+enum class SkinningMode : std::uint8_t
+{
+	LINEAR_BLEND,    // 4x3 matrix per joint, blended per vertex (Shaders/anim.vert)
+	DUAL_QUATERNION, // two vec4 per joint, blended per vertex (Shaders/anim_dq.vert)
+};
+// Rigid part of each skinning matrix as a unit dual quaternion, two vec4s per joint: the rotation (x, y, z, w) and
+// then the dual part. Scale is dropped, which is fine for rigs that only animate rotation and translation.
+void ComputeSkinningDualQuaternions(std::span<const glm::mat4x3> skinning_matrices, std::span<glm::vec4> out_dual_quaternions);
+
 SkeletonPose ComputeLocalMatrices(const std::vector<glm::mat4>& global_matrices, const Skeleton& skeleton);
+// Distance from each joint to its furthest descendant in the bind pose, how far out a change to the joint shows up.
+// Leaf joints use the length of their own bone.
+std::vector<float> ComputeTipDistances(const Skeleton& skeleton);
 
 enum class VertexFlags : std::uint32_t
 {
 	DEFAULT = 0, // vec3 position vec3 normal vec2 uv
 	HAS_TANGENT = 1, // vec3 tangent
 	HAS_JOINT_DATA = 2, // uint32 joint indices vec4 joint weights
+	// GPU vertices only, requested when loading: snorm16 position within the mesh's bounds (see
+	// PositionQuantization), octahedral snorm16 normal and tangent, half float uv, unorm8 joint weights
+	COMPRESSED = 4,
 };
 
 inline VertexFlags operator | (VertexFlags lhs, VertexFlags rhs)
@@ -77,9 +280,37 @@ inline VertexFlags& operator |= (VertexFlags& lhs, VertexFlags rhs)
 
 inline bool HasFlag(VertexFlags flags, VertexFlags flag_to_check)
 {
-	return (std::underlying_type_t<VertexFlags>)(flags | flag_to_check) != 0;
+	using T = std::underlying_type_t<VertexFlags>;
+	return ((T)flags & (T)flag_to_check) != 0;
 }
 
+// Byte offsets of the attributes within one interleaved vertex
+struct VertexLayout
+{
+	std::uint32_t size_bytes = 0;
+	std::uint32_t normal_offset = 0;
+	std::uint32_t uv_offset = 0;
+	std::uint32_t tangent_offset = 0; // 0 without VertexFlags::HAS_TANGENT
+	std::uint32_t joints_offset = 0;  // 0 without VertexFlags::HAS_JOINT_DATA
+	std::uint32_t weights_offset = 0; // 0 without VertexFlags::HAS_JOINT_DATA
+};
+
+// Where a mesh's indices are in its model's element buffer
+struct MeshDraw
+{
+	GLenum index_type; // GL_UNSIGNED_SHORT for meshes spanning fewer than 65536 vertices, else GL_UNSIGNED_INT
+	std::uint32_t index_count;
+	std::size_t first_index_byte;
+	GLint base_vertex; // added to every index of the mesh
+};
+
+// Maps a mesh's VertexFlags::COMPRESSED positions back to model space: position = offset + scale * stored value
+struct PositionQuantization
+{
+	glm::vec3 scale{ 1.0f };
+	glm::vec3 offset{ 0.0f };
+};
+
 struct ModelFile
 {
 	struct Header
@@ -124,23 +355,153 @@ struct AnimationClipFile
 		// add padding if needed
 	};
 	Header header;
-	std::unique_ptr<SkeletonPose[]> skeleton_poses; // number of poses = frame_count + 1 or frame_count if loops
+	// The header is followed by frame_count + 1 (frame_count if loops) poses of num_joints JointPoses each
 	std::string name;
 };
 
+// Version 2 of the model data: everything LoadAnimatedModel derives from the .model, .skeleton and .animation files
+// of a directory, stored in the layout it has in memory so vertices, indices and keyframes are used straight from a
+// mapping of the file. Joints are breadth first, quaternions x, y, z, w and keys in the same hemisphere as the pose
+// before, vertices welded and reordered and the indices the final GPU index buffer with every mesh LOD. There's no
+// offline converter, the loader writes a pack the first time it loads a directory and uses it while the source
+// files are unchanged.
+//
+// The header is followed by sections at the offsets in its offset table, each starting on a section_alignment
+// boundary. The element count of a section follows from its size.
+struct ModelPackFile
+{
+	static constexpr std::uint32_t magic = 0x6B636170; // "pack" as little-endian bytes, what 'kcap' evaluates to
+	static constexpr std::uint32_t version = 2;
+	static constexpr std::size_t section_alignment = AnimationClip::track_alignment; // keyframe tracks are used in place
+
+	enum Section : std::uint32_t
+	{
+		JOINTS,        // Joint
+		LEVEL_OFFSETS, // std::uint16_t, Skeleton::level_offsets
+		STRINGS,       // NUL terminated names, starting with one per joint, referenced by offset
+		MESHES,        // Mesh
+		DRAWS,         // Draw, max_mesh_lods per mesh
+		MATERIALS,     // Material
+		VERTICES,      // float vertices of the layout vertex_flags describes
+		INDICES,       // GPU index buffer, Draw::first_index_byte is relative to the section
+		CLIPS,         // Clip
+		KEYFRAMES,     // rotation, translation and scale tracks of every clip, each track section aligned
+		ROOT_MOTION,   // glm::vec2, AnimationClip::root_motion of every clip
+		SECTION_COUNT
+	};
+
+	struct Header
+	{
+		std::uint32_t magic_number;
+		std::uint32_t version;
+		std::uint64_t source_stamp; // hash of the source files' names, sizes and write times
+		std::uint32_t max_mesh_lods;
+		VertexFlags vertex_flags;
+		std::uint32_t uniform_joint_scale;
+		std::uint32_t padding;
+		std::uint64_t section_offsets[SECTION_COUNT];
+		std::uint64_t section_sizes[SECTION_COUNT];
+	};
+	struct Draw
+	{
+		std::uint32_t index_type;
+		std::uint32_t index_count;
+		std::uint64_t first_index_byte;
+		std::int32_t base_vertex;
+		std::uint32_t padding;
+	};
+	struct Material
+	{
+		glm::vec3 diffuse_coefficient;
+		glm::vec3 specular_coefficient;
+		float shininess;
+		PhongMaterialFlags flags;
+		std::uint32_t map_names[3]; // diffuse, specular and normal map file names in STRINGS, empty if unused
+	};
+	struct Clip
+	{
+		std::uint32_t name;
+		std::uint32_t frame_count;
+		float frames_per_second;
+		std::uint32_t loops;
+		std::uint32_t pose_count;
+		std::uint32_t joint_count;
+		std::uint64_t rotations, translations, scales; // offsets into KEYFRAMES
+		std::uint64_t first_root_motion; // into ROOT_MOTION, pose_count entries
+		glm::vec2 root_motion_per_loop;
+	};
+};
+
+// Per-instance vertex data of instanced skinned draws, see AnimatedModel::BindInstancedGeometry
+struct SkinnedInstance
+{
+	glm::mat4 world_matrix;
+	std::int32_t palette_offset; // texel offset of the instance's skinning palette
+	std::int32_t padding[3];
+};
+
+// Uniform block binding point of the Materials block in Shaders/anim.frag
+constexpr unsigned int materials_block_binding = 2;
+
 struct AnimatedModel
 {
+	// Must match MAX_MATERIALS in Shaders/anim.frag
+	static constexpr std::size_t max_materials = 256;
+	// Must match the instance attribute locations in Shaders/anim_instanced.vert
+	static constexpr unsigned int first_instance_attribute = 6;
+	static constexpr unsigned int instance_attribute_count = 5; // four world matrix columns and the palette offset
+	// Every mesh has this many LODs, each with at most half the triangles of the one before (generated by SimplifyMesh)
+	static constexpr int max_mesh_lods = 4;
+
 	std::vector<Mesh> meshes;
+	std::vector<MeshDraw> mesh_draws; // max_mesh_lods per mesh, mesh_draws[mesh_index * max_mesh_lods + lod]
+	std::vector<glm::vec3> mesh_centers; // bind pose bounding box center of each mesh, for depth sorting
+	std::vector<std::uint8_t> mesh_joint_influences; // per mesh, leading joint weights any of its vertices use (1, 2 or 4)
+	std::vector<PositionQuantization> mesh_position_quantization; // per mesh, only used with VertexFlags::COMPRESSED
 	std::vector<PhongMaterial> materials;
+	std::vector<TextureArray> texture_arrays; // every material map, one array per texture size
+	// Interleaved float vertices as read from the file, kept for CPU skinning. The GPU copy is packed into a smaller
+	// layout when vertex_flags has VertexFlags::COMPRESSED. Points into vertex_storage, or into pack_file while a
+	// model loaded from a model pack has uncompressed clips keeping the pack mapped.
+	std::span<const std::uint8_t> vertices;
+	VertexLayout vertex_layout;
+	VertexFlags vertex_flags = VertexFlags::DEFAULT; // of the GPU vertices
+	std::size_t gpu_vertex_bytes = 0;
+	// Every clip and inverse bind matrix scales joints uniformly, so skinning matrices transform normals as is
+	bool uniform_joint_scale = true;
 	Skeleton skeleton;
 	std::vector<AnimationClip> clips;
 	std::string name;
-	AnimatedModel(const std::string& directory);
+	bool loaded_from_pack = false; // see ModelPackFile
+	// vertex_options may request VertexFlags::COMPRESSED for the GPU vertices
+	AnimatedModel(const std::string& directory, const ClipCompressionSettings& compression = {}, VertexFlags vertex_options = VertexFlags::DEFAULT);
 	//void Draw() const;
 	void BindGeometry() const { glBindVertexArray(VAO); }
+	// Binds a second VAO over the same vertices that also reads one SkinnedInstance per instance from
+	// instance_buffer, starting at offset bytes
+	void BindInstancedGeometry(unsigned int instance_buffer, std::size_t offset) const;
+	// Binds the model's material uniform buffer, shaders select a material with the material_index uniform
+	void BindMaterials() const { glBindBufferBase(GL_UNIFORM_BUFFER, materials_block_binding, material_ubo); }
+	// Binds the texture arrays of the material's texture set to units 0 (diffuse), 1 (specular) and 2 (normal)
+	void BindMaterialTextures(std::uint32_t material_index) const;
+	// Draws one mesh of the bound geometry, lod 0 being the full mesh
+	void DrawMesh(std::uint32_t mesh_index, int lod = 0) const;
+	void DrawMeshInstanced(std::uint32_t mesh_index, int instance_count, int lod = 0) const;
+	std::uint32_t MeshTriangleCount(std::uint32_t mesh_index, int lod = 0) const { return mesh_draws[mesh_index * max_mesh_lods + lod].index_count / 3; }
+	// Per mesh uniforms of the skinned shaders: material_index and, for compressed vertices, the position decode
+	void SetMeshUniforms(Shader& shader, std::uint32_t mesh_index) const;
 private:
-	void LoadAnimatedModel(const std::string& path);
+	struct LoadData;
+	void LoadAnimatedModel(const std::string& path, const ClipCompressionSettings& compression, VertexFlags vertex_options);
+	void LoadSourceFiles(const std::filesystem::path& model_file_path, const std::filesystem::path& skeleton_file_path,
+		const std::vector<std::filesystem::path>& animation_file_paths, LoadData& data);
+	bool LoadModelPack(const std::filesystem::path& pack_path, std::uint64_t source_stamp, LoadData& data);
+	void SaveModelPack(const std::filesystem::path& pack_path, std::uint64_t source_stamp, const LoadData& data) const;
+	std::vector<std::uint8_t> vertex_storage;
+	std::unique_ptr<MappedFile> pack_file; // vertices and uncompressed clip keyframes point into it, released when no clip does
 	unsigned int VAO, VBO, EBO;
+	unsigned int instanced_VAO;
+	unsigned int material_ubo;
 	Shader* shader;
 };
 
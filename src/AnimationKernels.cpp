@@ -0,0 +1,416 @@
+#include "AnimationKernels.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ANIMATION_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#else
+#define ANIMATION_KERNELS_X86 0
+#endif
+
+static void NlerpQuaternionsScalar(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const float s = 1.0f - t;
+	for (std::size_t i = 0; i < count; i++, a += 4, b += 4, out += 4)
+	{
+		const float x = a[0] * s + b[0] * t;
+		const float y = a[1] * s + b[1] * t;
+		const float z = a[2] * s + b[2] * t;
+		const float w = a[3] * s + b[3] * t;
+		const float inv_length = 1.0f / std::sqrt(x * x + y * y + z * z + w * w);
+		out[0] = x * inv_length;
+		out[1] = y * inv_length;
+		out[2] = z * inv_length;
+		out[3] = w * inv_length;
+	}
+}
+
+static void LerpFloatsScalar(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const float s = 1.0f - t;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		out[i] = a[i] * s + b[i] * t;
+	}
+}
+
+// Normals and tangents go through the blended matrix as is rather than its inverse transpose, which is the same for
+// the rotations and uniform scales skeletons use, and are renormalized afterwards
+static void SkinVerticesScalar(const SkinningBatch& batch, std::size_t begin, std::size_t end)
+{
+	for (std::size_t i = begin; i < end; i++)
+	{
+		const unsigned char* vertex = batch.vertices + i * batch.vertex_stride;
+		float position[3], normal[3], tangent[3] = {}, weights[4];
+		std::uint32_t joints;
+		std::memcpy(position, vertex, sizeof(position));
+		std::memcpy(normal, vertex + batch.normal_offset, sizeof(normal));
+		if (batch.tangent_offset) std::memcpy(tangent, vertex + batch.tangent_offset, sizeof(tangent));
+		std::memcpy(&joints, vertex + batch.joints_offset, sizeof(joints));
+		std::memcpy(weights, vertex + batch.weights_offset, sizeof(weights));
+
+		float m[12] = {};
+		for (int k = 0; k < 4; k++)
+		{
+			const float* joint_matrix = batch.palette + ((joints >> (8 * k)) & 0xFF) * 12;
+			for (int j = 0; j < 12; j++) m[j] += weights[k] * joint_matrix[j];
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			batch.out_positions[i * 3 + c] = m[c] * position[0] + m[3 + c] * position[1] + m[6 + c] * position[2] + m[9 + c];
+		}
+		auto TransformDirection = [&m](const float* direction, float* out)
+		{
+			float length_squared = 0.0f;
+			for (int c = 0; c < 3; c++)
+			{
+				out[c] = m[c] * direction[0] + m[3 + c] * direction[1] + m[6 + c] * direction[2];
+				length_squared += out[c] * out[c];
+			}
+			const float inv_length = 1.0f / std::sqrt(length_squared);
+			for (int c = 0; c < 3; c++) out[c] *= inv_length;
+		};
+		TransformDirection(normal, batch.out_normals + i * 3);
+		if (batch.tangent_offset) TransformDirection(tangent, batch.out_tangents + i * 3);
+	}
+}
+
+#if ANIMATION_KERNELS_X86
+
+TARGET_SSE41 static inline __m128 ReciprocalSqrtSse(__m128 x)
+{
+	// rsqrt is only good to ~12 bits, one Newton-Raphson step brings it close to full precision
+	const __m128 estimate = _mm_rsqrt_ps(x);
+	const __m128 half_x = _mm_mul_ps(_mm_set1_ps(0.5f), x);
+	return _mm_mul_ps(estimate, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(half_x, _mm_mul_ps(estimate, estimate))));
+}
+
+TARGET_SSE41 static void NlerpQuaternionsSse41(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const __m128 wa = _mm_set1_ps(1.0f - t);
+	const __m128 wb = _mm_set1_ps(t);
+	std::size_t i = 0;
+	for (; i + 4 <= count; i += 4, a += 16, b += 16, out += 16)
+	{
+		// Blend four quaternions as they are laid out in memory, then transpose so each register holds
+		// one component of all four and the length can be computed without horizontal adds
+		__m128 q0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + 0), wa), _mm_mul_ps(_mm_loadu_ps(b + 0), wb));
+		__m128 q1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + 4), wa), _mm_mul_ps(_mm_loadu_ps(b + 4), wb));
+		__m128 q2 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + 8), wa), _mm_mul_ps(_mm_loadu_ps(b + 8), wb));
+		__m128 q3 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + 12), wa), _mm_mul_ps(_mm_loadu_ps(b + 12), wb));
+		_MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+		__m128 length_squared = _mm_mul_ps(q0, q0);
+		length_squared = _mm_add_ps(length_squared, _mm_mul_ps(q1, q1));
+		length_squared = _mm_add_ps(length_squared, _mm_mul_ps(q2, q2));
+		length_squared = _mm_add_ps(length_squared, _mm_mul_ps(q3, q3));
+		const __m128 inv_length = ReciprocalSqrtSse(length_squared);
+		q0 = _mm_mul_ps(q0, inv_length);
+		q1 = _mm_mul_ps(q1, inv_length);
+		q2 = _mm_mul_ps(q2, inv_length);
+		q3 = _mm_mul_ps(q3, inv_length);
+		_MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+		_mm_storeu_ps(out + 0, q0);
+		_mm_storeu_ps(out + 4, q1);
+		_mm_storeu_ps(out + 8, q2);
+		_mm_storeu_ps(out + 12, q3);
+	}
+	NlerpQuaternionsScalar(a, b, t, out, count - i);
+}
+
+TARGET_SSE41 static void LerpFloatsSse41(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const __m128 wa = _mm_set1_ps(1.0f - t);
+	const __m128 wb = _mm_set1_ps(t);
+	std::size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + i), wa), _mm_mul_ps(_mm_loadu_ps(b + i), wb)));
+	}
+	LerpFloatsScalar(a + i, b + i, t, out + i, count - i);
+}
+
+// Skinning matrices blended for four vertices, one register per matrix element
+struct BlendedMatricesSse
+{
+	__m128 m[12];
+};
+
+TARGET_SSE41 static inline __m128 LoadLanesSse(const unsigned char* vertex, std::size_t stride, std::size_t offset)
+{
+	float lanes[4];
+	for (int lane = 0; lane < 4; lane++) std::memcpy(&lanes[lane], vertex + lane * stride + offset, sizeof(float));
+	return _mm_loadu_ps(lanes);
+}
+
+TARGET_SSE41 static inline void TransformDirectionsSse(const BlendedMatricesSse& blended, __m128 x, __m128 y, __m128 z, float* out)
+{
+	__m128 components[3];
+	for (int c = 0; c < 3; c++)
+	{
+		components[c] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(blended.m[c], x), _mm_mul_ps(blended.m[3 + c], y)), _mm_mul_ps(blended.m[6 + c], z));
+	}
+	const __m128 length_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(components[0], components[0]), _mm_mul_ps(components[1], components[1])),
+		_mm_mul_ps(components[2], components[2]));
+	const __m128 inv_length = ReciprocalSqrtSse(length_squared);
+	alignas(16) float lanes[3][4];
+	for (int c = 0; c < 3; c++) _mm_store_ps(lanes[c], _mm_mul_ps(components[c], inv_length));
+	for (int lane = 0; lane < 4; lane++)
+	{
+		for (int c = 0; c < 3; c++) out[lane * 3 + c] = lanes[c][lane];
+	}
+}
+
+TARGET_SSE41 static void SkinVerticesSse41(const SkinningBatch& batch, std::size_t begin, std::size_t end)
+{
+	const auto stride = batch.vertex_stride;
+	std::size_t i = begin;
+	for (; i + 4 <= end; i += 4)
+	{
+		const unsigned char* vertex = batch.vertices + i * stride;
+		std::uint32_t joints[4];
+		for (int lane = 0; lane < 4; lane++) std::memcpy(&joints[lane], vertex + lane * stride + batch.joints_offset, sizeof(std::uint32_t));
+
+		BlendedMatricesSse blended;
+		for (int k = 0; k < 4; k++)
+		{
+			const __m128 weight = LoadLanesSse(vertex, stride, batch.weights_offset + k * sizeof(float));
+			const float* joint_matrices[4];
+			for (int lane = 0; lane < 4; lane++) joint_matrices[lane] = batch.palette + ((joints[lane] >> (8 * k)) & 0xFF) * 12;
+			for (int j = 0; j < 12; j++)
+			{
+				const __m128 element = _mm_setr_ps(joint_matrices[0][j], joint_matrices[1][j], joint_matrices[2][j], joint_matrices[3][j]);
+				blended.m[j] = k == 0 ? _mm_mul_ps(weight, element) : _mm_add_ps(blended.m[j], _mm_mul_ps(weight, element));
+			}
+		}
+
+		const __m128 x = LoadLanesSse(vertex, stride, 0);
+		const __m128 y = LoadLanesSse(vertex, stride, sizeof(float));
+		const __m128 z = LoadLanesSse(vertex, stride, 2 * sizeof(float));
+		alignas(16) float positions[3][4];
+		for (int c = 0; c < 3; c++)
+		{
+			const __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(blended.m[c], x), _mm_mul_ps(blended.m[3 + c], y)),
+				_mm_add_ps(_mm_mul_ps(blended.m[6 + c], z), blended.m[9 + c]));
+			_mm_store_ps(positions[c], p);
+		}
+		for (int lane = 0; lane < 4; lane++)
+		{
+			for (int c = 0; c < 3; c++) batch.out_positions[(i + lane) * 3 + c] = positions[c][lane];
+		}
+		TransformDirectionsSse(blended, LoadLanesSse(vertex, stride, batch.normal_offset), LoadLanesSse(vertex, stride, batch.normal_offset + 4),
+			LoadLanesSse(vertex, stride, batch.normal_offset + 8), batch.out_normals + i * 3);
+		if (batch.tangent_offset)
+		{
+			TransformDirectionsSse(blended, LoadLanesSse(vertex, stride, batch.tangent_offset), LoadLanesSse(vertex, stride, batch.tangent_offset + 4),
+				LoadLanesSse(vertex, stride, batch.tangent_offset + 8), batch.out_tangents + i * 3);
+		}
+	}
+	SkinVerticesScalar(batch, i, end);
+}
+
+// Transposes the 4x4 block held in each 128-bit lane of r0..r3
+TARGET_AVX2 static inline void TransposeLanes(__m256& r0, __m256& r1, __m256& r2, __m256& r3)
+{
+	const __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+	const __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+	const __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+	const __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+	r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+	r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+	r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+	r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+TARGET_AVX2 static void NlerpQuaternionsAvx2(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const __m256 wa = _mm256_set1_ps(1.0f - t);
+	const __m256 wb = _mm256_set1_ps(t);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three_halves = _mm256_set1_ps(1.5f);
+	std::size_t i = 0;
+	for (; i + 8 <= count; i += 8, a += 32, b += 32, out += 32)
+	{
+		// Each register holds two quaternions, the lane transpose gathers components of eight
+		__m256 q0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + 0), wa, _mm256_mul_ps(_mm256_loadu_ps(b + 0), wb));
+		__m256 q1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + 8), wa, _mm256_mul_ps(_mm256_loadu_ps(b + 8), wb));
+		__m256 q2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + 16), wa, _mm256_mul_ps(_mm256_loadu_ps(b + 16), wb));
+		__m256 q3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + 24), wa, _mm256_mul_ps(_mm256_loadu_ps(b + 24), wb));
+		TransposeLanes(q0, q1, q2, q3);
+		__m256 length_squared = _mm256_mul_ps(q0, q0);
+		length_squared = _mm256_fmadd_ps(q1, q1, length_squared);
+		length_squared = _mm256_fmadd_ps(q2, q2, length_squared);
+		length_squared = _mm256_fmadd_ps(q3, q3, length_squared);
+		const __m256 estimate = _mm256_rsqrt_ps(length_squared);
+		const __m256 inv_length = _mm256_mul_ps(estimate,
+			_mm256_fnmadd_ps(_mm256_mul_ps(half, length_squared), _mm256_mul_ps(estimate, estimate), three_halves));
+		q0 = _mm256_mul_ps(q0, inv_length);
+		q1 = _mm256_mul_ps(q1, inv_length);
+		q2 = _mm256_mul_ps(q2, inv_length);
+		q3 = _mm256_mul_ps(q3, inv_length);
+		TransposeLanes(q0, q1, q2, q3);
+		_mm256_storeu_ps(out + 0, q0);
+		_mm256_storeu_ps(out + 8, q1);
+		_mm256_storeu_ps(out + 16, q2);
+		_mm256_storeu_ps(out + 24, q3);
+	}
+	// The tail runs non-VEX SSE code, which stalls on dirty upper halves of the ymm registers. Compilers don't
+	// always clear them before a tail call.
+	_mm256_zeroupper();
+	NlerpQuaternionsSse41(a, b, t, out, count - i);
+}
+
+TARGET_AVX2 static void LerpFloatsAvx2(const float* a, const float* b, float t, float* out, std::size_t count)
+{
+	const __m256 wa = _mm256_set1_ps(1.0f - t);
+	const __m256 wb = _mm256_set1_ps(t);
+	std::size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		_mm256_storeu_ps(out + i, _mm256_fmadd_ps(_mm256_loadu_ps(a + i), wa, _mm256_mul_ps(_mm256_loadu_ps(b + i), wb)));
+	}
+	_mm256_zeroupper(); // see NlerpQuaternionsAvx2
+	LerpFloatsSse41(a + i, b + i, t, out + i, count - i);
+}
+
+// Skinning matrices blended for eight vertices, one register per matrix element
+struct BlendedMatricesAvx2
+{
+	__m256 m[12];
+};
+
+TARGET_AVX2 static inline void TransformDirectionsAvx2(const BlendedMatricesAvx2& blended, __m256 x, __m256 y, __m256 z, float* out)
+{
+	__m256 components[3];
+	for (int c = 0; c < 3; c++)
+	{
+		components[c] = _mm256_fmadd_ps(blended.m[c], x, _mm256_fmadd_ps(blended.m[3 + c], y, _mm256_mul_ps(blended.m[6 + c], z)));
+	}
+	__m256 length_squared = _mm256_mul_ps(components[0], components[0]);
+	length_squared = _mm256_fmadd_ps(components[1], components[1], length_squared);
+	length_squared = _mm256_fmadd_ps(components[2], components[2], length_squared);
+	const __m256 estimate = _mm256_rsqrt_ps(length_squared);
+	const __m256 inv_length = _mm256_mul_ps(estimate,
+		_mm256_fnmadd_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), length_squared), _mm256_mul_ps(estimate, estimate), _mm256_set1_ps(1.5f)));
+	alignas(32) float lanes[3][8];
+	for (int c = 0; c < 3; c++) _mm256_store_ps(lanes[c], _mm256_mul_ps(components[c], inv_length));
+	for (int lane = 0; lane < 8; lane++)
+	{
+		for (int c = 0; c < 3; c++) out[lane * 3 + c] = lanes[c][lane];
+	}
+}
+
+TARGET_AVX2 static void SkinVerticesAvx2(const SkinningBatch& batch, std::size_t begin, std::size_t end)
+{
+	// Attributes of eight consecutive vertices are gathered into one register each, lane offsets are in floats
+	const __m256i lane_offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)(batch.vertex_stride / sizeof(float))));
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	const __m256i joint_floats = _mm256_set1_epi32(12);
+	std::size_t i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		const unsigned char* vertex = batch.vertices + i * batch.vertex_stride;
+		const __m256i joints = _mm256_i32gather_epi32((const int*)(vertex + batch.joints_offset), lane_offsets, 4);
+
+		BlendedMatricesAvx2 blended;
+		for (int k = 0; k < 4; k++)
+		{
+			const __m256 weight = _mm256_i32gather_ps((const float*)(vertex + batch.weights_offset) + k, lane_offsets, 4);
+			const __m256i joint = _mm256_and_si256(_mm256_srli_epi32(joints, 8 * k), byte_mask);
+			const __m256i palette_offsets = _mm256_mullo_epi32(joint, joint_floats);
+			for (int j = 0; j < 12; j++)
+			{
+				const __m256 element = _mm256_i32gather_ps(batch.palette + j, palette_offsets, 4);
+				blended.m[j] = k == 0 ? _mm256_mul_ps(weight, element) : _mm256_fmadd_ps(weight, element, blended.m[j]);
+			}
+		}
+
+		const float* position = (const float*)vertex;
+		const __m256 x = _mm256_i32gather_ps(position, lane_offsets, 4);
+		const __m256 y = _mm256_i32gather_ps(position + 1, lane_offsets, 4);
+		const __m256 z = _mm256_i32gather_ps(position + 2, lane_offsets, 4);
+		alignas(32) float positions[3][8];
+		for (int c = 0; c < 3; c++)
+		{
+			const __m256 p = _mm256_fmadd_ps(blended.m[c], x, _mm256_fmadd_ps(blended.m[3 + c], y, _mm256_fmadd_ps(blended.m[6 + c], z, blended.m[9 + c])));
+			_mm256_store_ps(positions[c], p);
+		}
+		for (int lane = 0; lane < 8; lane++)
+		{
+			for (int c = 0; c < 3; c++) batch.out_positions[(i + lane) * 3 + c] = positions[c][lane];
+		}
+		const float* normal = (const float*)(vertex + batch.normal_offset);
+		TransformDirectionsAvx2(blended, _mm256_i32gather_ps(normal, lane_offsets, 4), _mm256_i32gather_ps(normal + 1, lane_offsets, 4),
+			_mm256_i32gather_ps(normal + 2, lane_offsets, 4), batch.out_normals + i * 3);
+		if (batch.tangent_offset)
+		{
+			const float* tangent = (const float*)(vertex + batch.tangent_offset);
+			TransformDirectionsAvx2(blended, _mm256_i32gather_ps(tangent, lane_offsets, 4), _mm256_i32gather_ps(tangent + 1, lane_offsets, 4),
+				_mm256_i32gather_ps(tangent + 2, lane_offsets, 4), batch.out_tangents + i * 3);
+		}
+	}
+	SkinVerticesSse41(batch, i, end);
+}
+
+struct CpuFeatures
+{
+	bool sse41 = false;
+	bool avx2 = false;
+};
+
+static CpuFeatures DetectCpuFeatures()
+{
+	CpuFeatures features;
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	const int max_leaf = regs[0];
+	__cpuid(regs, 1);
+	const bool has_fma = (regs[2] & (1 << 12)) != 0;
+	const bool has_osxsave = (regs[2] & (1 << 27)) != 0;
+	const bool has_avx = (regs[2] & (1 << 28)) != 0;
+	features.sse41 = (regs[2] & (1 << 19)) != 0;
+	// The OS has to save the upper halves of the ymm registers on context switches
+	const bool os_saves_ymm = has_osxsave && (_xgetbv(0) & 0x6) == 0x6;
+	if (max_leaf >= 7 && has_avx && has_fma && os_saves_ymm)
+	{
+		__cpuidex(regs, 7, 0);
+		features.avx2 = (regs[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	features.sse41 = __builtin_cpu_supports("sse4.1");
+	features.avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+	return features;
+}
+
+#endif // ANIMATION_KERNELS_X86
+
+std::vector<AnimationKernels> GetSupportedAnimationKernels()
+{
+	std::vector<AnimationKernels> supported;
+#if ANIMATION_KERNELS_X86
+	const auto features = DetectCpuFeatures();
+	if (features.avx2) supported.push_back({ "AVX2", NlerpQuaternionsAvx2, LerpFloatsAvx2, SkinVerticesAvx2 });
+	if (features.sse41) supported.push_back({ "SSE4.1", NlerpQuaternionsSse41, LerpFloatsSse41, SkinVerticesSse41 });
+#endif
+	supported.push_back({ "Scalar", NlerpQuaternionsScalar, LerpFloatsScalar, SkinVerticesScalar });
+	return supported;
+}
+
+const AnimationKernels& GetAnimationKernels()
+{
+	static const AnimationKernels kernels = GetSupportedAnimationKernels().front();
+	return kernels;
+}
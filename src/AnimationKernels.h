@@ -0,0 +1,40 @@
+#ifndef ANIMATION_KERNELS_H
+#define ANIMATION_KERNELS_H
+
+#include <cstddef>
+#include <vector>
+
+// Vertices and palette for skin_vertices. Vertex attributes are read at byte offsets into each vertex.
+struct SkinningBatch
+{
+	const unsigned char* vertices; // interleaved, vertex_stride bytes apart
+	std::size_t vertex_stride;     // multiple of 4
+	std::size_t normal_offset;
+	std::size_t tangent_offset;    // 0 when vertices have no tangent
+	std::size_t joints_offset;     // four joint indices packed into a uint32
+	std::size_t weights_offset;    // four float weights
+	const float* palette;          // 12 floats per joint, column major 4x3 matrices
+	float* out_positions;          // xyz per vertex
+	float* out_normals;            // xyz per vertex, normalized
+	float* out_tangents;           // xyz per vertex, normalized. Unused when there are no tangents
+};
+
+// Batched kernels used by the pose sampler and CPU skinning. The best implementation the CPU supports
+// (AVX2, SSE4.1 or scalar) is picked once at startup.
+struct AnimationKernels
+{
+	const char* name;
+	// Normalized lerp of count quaternions (4 floats each). Expects a and b to already be in the same
+	// hemisphere, which the clip loader guarantees for neighbouring keyframes.
+	void (*nlerp_quaternions)(const float* a, const float* b, float t, float* out, std::size_t count);
+	// Lerp of count floats, used for translation and scale tracks
+	void (*lerp_floats)(const float* a, const float* b, float t, float* out, std::size_t count);
+	// Linear blend skinning of vertices [begin, end), several vertices per instruction
+	void (*skin_vertices)(const SkinningBatch& batch, std::size_t begin, std::size_t end);
+};
+
+const AnimationKernels& GetAnimationKernels();
+// Every implementation this CPU can run, best first. For checking the kernels against each other.
+std::vector<AnimationKernels> GetSupportedAnimationKernels();
+
+#endif // !ANIMATION_KERNELS_H
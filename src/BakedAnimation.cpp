@@ -0,0 +1,95 @@
+#include "BakedAnimation.h"
+
+#include <glad/glad.h>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+static constexpr std::size_t texels_per_joint = 3;
+
+#ifndef NDEBUG
+// Reads the palette texture bound to GL_TEXTURE_2D back from the GL and compares the matrix of one joint in one pose
+// with ComputeJointMatrices at that pose's time. Returns the largest difference between matrix elements.
+static float MaxBakedTexelError(const AnimationClip& clip, const Skeleton& skeleton, unsigned int pose, std::size_t joint, PoseScratch& scratch)
+{
+	const auto width = skeleton.joints.size() * texels_per_joint;
+	std::vector<glm::vec4> texels(width * clip.pose_count);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, texels.data());
+	ComputeJointMatrices(clip, skeleton, pose / clip.frames_per_second, scratch);
+	const auto& expected = scratch.skinning_matrices[joint];
+	const auto* baked = texels.data() + pose * width + joint * texels_per_joint;
+	float max_error = 0.0f;
+	for (std::size_t r = 0; r < texels_per_joint; r++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			max_error = std::max(max_error, std::abs(baked[r][c] - expected[c][(int)r]));
+		}
+	}
+	return max_error;
+}
+#endif
+
+std::size_t BakeClipPalettes(AnimatedModel& model, std::size_t budget_bytes)
+{
+	GLint max_texture_size;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+
+	const auto num_joints = model.skeleton.joints.size();
+	PoseScratch scratch;
+	scratch.Resize(num_joints);
+	std::vector<glm::vec4> texels;
+	std::size_t used_bytes = 0;
+	for (auto& clip : model.clips)
+	{
+		const auto width = num_joints * texels_per_joint;
+		const auto height = (std::size_t)clip.pose_count;
+		const auto size_bytes = width * height * sizeof(glm::vec4);
+		if (used_bytes + size_bytes > budget_bytes || width > (std::size_t)max_texture_size || height > (std::size_t)max_texture_size)
+		{
+			std::cout << "Clip '" << clip.name << "': not baked, " << size_bytes / 1024 << " KB palette texture doesn't fit\n";
+			continue;
+		}
+
+		texels.resize(width * height);
+		for (auto pose = 0u; pose < clip.pose_count; pose++)
+		{
+			ComputeJointMatrices(clip, model.skeleton, pose / clip.frames_per_second, scratch);
+			auto* row = texels.data() + pose * width;
+			for (std::size_t joint = 0; joint < num_joints; joint++)
+			{
+				const auto& m = scratch.skinning_matrices[joint];
+				for (std::size_t r = 0; r < texels_per_joint; r++)
+				{
+					row[joint * texels_per_joint + r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+				}
+			}
+		}
+
+		glGenTextures(1, &clip.baked_palette_texture);
+		glBindTexture(GL_TEXTURE_2D, clip.baked_palette_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (GLsizei)width, (GLsizei)height, 0, GL_RGBA, GL_FLOAT, texels.data());
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		used_bytes += size_bytes;
+
+#ifndef NDEBUG
+		// Catches the texture layout drifting from what anim_baked.vert fetches. A pose and joint away from the
+		// texture edges, where a transposed or offset layout would still look right.
+		const auto check_pose = clip.pose_count / 2;
+		const auto check_joint = num_joints / 2;
+		const float baked_error = MaxBakedTexelError(clip, model.skeleton, check_pose, check_joint, scratch);
+		if (baked_error > 1e-4f)
+		{
+			std::cout << "Clip '" << clip.name << "': baked palette of joint " << check_joint << " at pose " << check_pose
+				<< " is off by " << baked_error << " from ComputeJointMatrices\n";
+		}
+		assert(baked_error <= 1e-4f);
+#endif
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return used_bytes;
+}
@@ -0,0 +1,16 @@
+#ifndef BAKED_ANIMATION_H
+#define BAKED_ANIMATION_H
+
+#include "AnimatedModel.h"
+
+#include <cstddef>
+
+// Bakes the skinning palette of every pose of a model's clips into a GL_RGBA32F texture so the vertex shader can
+// play them back without any CPU sampling (Shaders/anim_baked.vert). Each row is one pose, each joint takes three
+// texels holding the rows of its 4x3 matrix. Clips play in place like on the CPU, root motion is applied per
+// instance.
+//
+// Clips are baked in order while they fit in budget_bytes, the rest keep using the CPU path. Returns the bytes used.
+std::size_t BakeClipPalettes(AnimatedModel& model, std::size_t budget_bytes);
+
+#endif // !BAKED_ANIMATION_H
@@ -0,0 +1,404 @@
+#include "BlendGraph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+static inline float ClipDuration(const AnimationClip& clip)
+{
+	return clip.frame_count / clip.frames_per_second;
+}
+
+static inline float WrapTime(float time, float duration)
+{
+	time = std::fmod(time, duration);
+	return time < 0.0f ? time + duration : time;
+}
+
+BlendGraph::BlendGraph(const std::vector<AnimationClip>& clips, std::size_t num_joints)
+	: clips(&clips), num_joints(num_joints)
+{
+}
+
+BlendGraph::NodeIndex BlendGraph::AddClip(std::uint32_t clip_index, float speed)
+{
+	assert(clip_index < clips->size());
+	Node node;
+	node.type = NodeType::CLIP;
+	node.clip_index = clip_index;
+	node.speed = speed;
+	node.cursor.Resize(num_joints);
+	node.cursor.Reset((*clips)[clip_index]);
+	nodes.push_back(std::move(node));
+	return (NodeIndex)(nodes.size() - 1);
+}
+
+BlendGraph::NodeIndex BlendGraph::AddBlend(NodeIndex from, NodeIndex to, float alpha)
+{
+	Node node;
+	node.type = NodeType::BLEND;
+	node.inputs = { from, to };
+	node.alpha = alpha;
+	nodes.push_back(std::move(node));
+	return (NodeIndex)(nodes.size() - 1);
+}
+
+BlendGraph::NodeIndex BlendGraph::AddBlendSpace1D(std::span<const NodeIndex> clip_nodes, std::span<const float> sample_positions)
+{
+	assert(std::is_sorted(sample_positions.begin(), sample_positions.end()));
+	std::vector<glm::vec2> positions(sample_positions.size());
+	std::transform(sample_positions.begin(), sample_positions.end(), positions.begin(), [](float x) { return glm::vec2(x, 0.0f); });
+	auto index = AddBlendSpace2D(clip_nodes, positions);
+	nodes[index].type = NodeType::BLEND_SPACE_1D;
+	nodes[index].parameter = positions.front();
+	UpdateBlendSpaceWeights(nodes[index]);
+	return index;
+}
+
+BlendGraph::NodeIndex BlendGraph::AddBlendSpace2D(std::span<const NodeIndex> clip_nodes, std::span<const glm::vec2> sample_positions)
+{
+	assert(!clip_nodes.empty() && clip_nodes.size() == sample_positions.size());
+	Node node;
+	node.type = NodeType::BLEND_SPACE_2D;
+	node.inputs.assign(clip_nodes.begin(), clip_nodes.end());
+	node.sample_positions.assign(sample_positions.begin(), sample_positions.end());
+	node.sample_weights.resize(clip_nodes.size());
+	node.parameter = sample_positions.front();
+	for (auto input : clip_nodes)
+	{
+		assert(nodes[input].type == NodeType::CLIP && "Blend space inputs must be clips so they can play in sync");
+		nodes[input].synced = true;
+	}
+	UpdateBlendSpaceWeights(node);
+	nodes.push_back(std::move(node));
+	return (NodeIndex)(nodes.size() - 1);
+}
+
+BlendGraph::NodeIndex BlendGraph::AddLayer(NodeIndex base, NodeIndex layer, float alpha, std::uint16_t mask)
+{
+	auto index = AddBlend(base, layer, alpha);
+	nodes[index].type = NodeType::LAYER;
+	nodes[index].mask = mask;
+	return index;
+}
+
+BlendGraph::NodeIndex BlendGraph::AddAdditive(NodeIndex base, NodeIndex additive, float alpha, std::uint16_t mask)
+{
+	auto index = AddLayer(base, additive, alpha, mask);
+	nodes[index].type = NodeType::ADDITIVE;
+	return index;
+}
+
+std::uint16_t BlendGraph::AddMask(std::span<const float> joint_weights)
+{
+	assert(joint_weights.size() == num_joints);
+	const auto mask = (std::uint16_t)(masks.size() / num_joints);
+	masks.insert(masks.end(), joint_weights.begin(), joint_weights.end());
+	return mask;
+}
+
+void BlendGraph::SetMask(std::uint16_t mask, std::span<const float> joint_weights)
+{
+	assert(joint_weights.size() == num_joints && (mask + 1) * num_joints <= masks.size());
+	std::copy(joint_weights.begin(), joint_weights.end(), masks.begin() + mask * num_joints);
+}
+
+void BlendGraph::SetClip(NodeIndex index, std::uint32_t clip_index, float time)
+{
+	auto& node = nodes[index];
+	assert(node.type == NodeType::CLIP && clip_index < clips->size());
+	node.clip_index = clip_index;
+	node.time = time;
+	node.cursor.Reset((*clips)[clip_index]);
+}
+
+void BlendGraph::StartCrossfade(NodeIndex index, float duration)
+{
+	auto& node = nodes[index];
+	assert(node.type == NodeType::BLEND);
+	if (duration > 0.0f)
+	{
+		node.alpha = 0.0f;
+		node.fade_speed = 1.0f / duration;
+	}
+	else
+	{
+		node.alpha = 1.0f;
+		node.fade_speed = 0.0f;
+	}
+}
+
+void BlendGraph::UpdateBlendSpaceWeights(Node& node)
+{
+	const auto& positions = node.sample_positions;
+	auto& weights = node.sample_weights;
+	const auto num_samples = positions.size();
+	std::fill(weights.begin(), weights.end(), 0.0f);
+
+	if (node.type == NodeType::BLEND_SPACE_1D)
+	{
+		const float x = std::clamp(node.parameter.x, positions.front().x, positions.back().x);
+		auto i = 0u;
+		while (i + 2 < num_samples && positions[i + 1].x < x) i++;
+		if (num_samples == 1 || positions[i + 1].x <= positions[i].x)
+		{
+			weights[i] = 1.0f;
+			return;
+		}
+		const float t = std::clamp((x - positions[i].x) / (positions[i + 1].x - positions[i].x), 0.0f, 1.0f);
+		weights[i] = 1.0f - t;
+		weights[i + 1] = t;
+		return;
+	}
+
+	// Gradient band interpolation: each sample's weight falls off linearly along the direction to every other sample
+	float total_weight = 0.0f;
+	for (auto i = 0u; i < num_samples; i++)
+	{
+		float weight = 1.0f;
+		for (auto j = 0u; j < num_samples && weight > 0.0f; j++)
+		{
+			if (i == j) continue;
+			const auto sample_to_sample = positions[j] - positions[i];
+			const float length_squared = glm::dot(sample_to_sample, sample_to_sample);
+			if (length_squared <= 0.0f) continue;
+			weight = std::min(weight, std::clamp(1.0f - glm::dot(node.parameter - positions[i], sample_to_sample) / length_squared, 0.0f, 1.0f));
+		}
+		weights[i] = weight;
+		total_weight += weight;
+	}
+
+	if (total_weight > 0.0f)
+	{
+		for (auto& weight : weights) weight /= total_weight;
+	}
+	else
+	{
+		weights[0] = 1.0f;
+	}
+}
+
+void BlendGraph::Update(float dt)
+{
+	for (auto& node : nodes)
+	{
+		switch (node.type)
+		{
+		case NodeType::CLIP:
+			if (!node.synced) node.root_motion = AdvanceClipTime((*clips)[node.clip_index], node.time, node.speed * dt);
+			break;
+		case NodeType::BLEND:
+		case NodeType::LAYER:
+		case NodeType::ADDITIVE:
+			if (node.fade_speed > 0.0f)
+			{
+				node.alpha = std::min(node.alpha + node.fade_speed * dt, 1.0f);
+				if (node.alpha == 1.0f) node.fade_speed = 0.0f;
+			}
+			break;
+		case NodeType::BLEND_SPACE_1D:
+		case NodeType::BLEND_SPACE_2D:
+		{
+			// Synced clips finish a cycle together, taking the weighted average of their durations
+			UpdateBlendSpaceWeights(node);
+			float duration = 0.0f;
+			for (std::size_t i = 0; i < node.inputs.size(); i++)
+			{
+				const auto& input = nodes[node.inputs[i]];
+				duration += node.sample_weights[i] * ClipDuration((*clips)[input.clip_index]) / std::max(input.speed, 0.0001f);
+			}
+			const float phase = duration > 0.0f ? node.phase + dt / duration : node.phase;
+			const float loops = std::floor(phase);
+			node.phase = WrapTime(phase, 1.0f);
+			for (auto input_index : node.inputs)
+			{
+				auto& input = nodes[input_index];
+				const auto& clip = (*clips)[input.clip_index];
+				const float time = node.phase * ClipDuration(clip);
+				input.root_motion = SampleRootMotion(clip, time) - SampleRootMotion(clip, input.time) + clip.root_motion_per_loop * loops;
+				input.time = time;
+			}
+			break;
+		}
+		}
+	}
+}
+
+std::int32_t BlendGraph::AllocateWeightRow()
+{
+	const auto row = (std::int32_t)weight_rows_used;
+	weight_rows_used += num_joints;
+	if (weight_rows.size() < weight_rows_used) weight_rows.resize(weight_rows_used);
+	return row;
+}
+
+void BlendGraph::Flatten(NodeIndex index, float weight, std::int32_t joint_weights, bool additive)
+{
+	static constexpr float min_weight = 0.0001f;
+	if (weight < min_weight) return;
+
+	auto& node = nodes[index];
+	switch (node.type)
+	{
+	case NodeType::CLIP:
+	{
+		const auto& clip = (*clips)[node.clip_index];
+		const float pose = std::clamp(node.time * clip.frames_per_second, 0.0f, (float)(clip.pose_count - 1));
+		contributions.push_back({ &clip, &node.cursor, node.time, pose, weight, node.root_motion, joint_weights, additive });
+		break;
+	}
+	case NodeType::BLEND:
+		Flatten(node.inputs[0], weight * (1.0f - node.alpha), joint_weights, additive);
+		Flatten(node.inputs[1], weight * node.alpha, joint_weights, additive);
+		break;
+	case NodeType::BLEND_SPACE_1D:
+	case NodeType::BLEND_SPACE_2D:
+		for (std::size_t i = 0; i < node.inputs.size(); i++)
+		{
+			Flatten(node.inputs[i], weight * node.sample_weights[i], joint_weights, additive);
+		}
+		break;
+	case NodeType::LAYER:
+	{
+		if (node.mask == no_mask)
+		{
+			Flatten(node.inputs[0], weight * (1.0f - node.alpha), joint_weights, additive);
+			Flatten(node.inputs[1], weight * node.alpha, joint_weights, additive);
+			break;
+		}
+		// Weight rows are addressed by offset since the vector can grow while flattening
+		const auto base_weights = AllocateWeightRow();
+		const auto layer_weights = AllocateWeightRow();
+		const float* mask = masks.data() + node.mask * num_joints;
+		for (std::size_t i = 0; i < num_joints; i++)
+		{
+			const float parent_weight = joint_weights >= 0 ? weight_rows[joint_weights + i] : 1.0f;
+			const float layer_weight = node.alpha * mask[i];
+			weight_rows[base_weights + i] = parent_weight * (1.0f - layer_weight);
+			weight_rows[layer_weights + i] = parent_weight * layer_weight;
+		}
+		Flatten(node.inputs[0], weight, base_weights, additive);
+		Flatten(node.inputs[1], weight, layer_weights, additive);
+		break;
+	}
+	case NodeType::ADDITIVE:
+	{
+		Flatten(node.inputs[0], weight, joint_weights, additive);
+		auto additive_weights = joint_weights;
+		if (node.mask != no_mask)
+		{
+			additive_weights = AllocateWeightRow();
+			const float* mask = masks.data() + node.mask * num_joints;
+			for (std::size_t i = 0; i < num_joints; i++)
+			{
+				weight_rows[additive_weights + i] = (joint_weights >= 0 ? weight_rows[joint_weights + i] : 1.0f) * mask[i];
+			}
+		}
+		Flatten(node.inputs[1], weight * node.alpha, additive_weights, true);
+		break;
+	}
+	}
+}
+
+void BlendGraph::Evaluate(PoseView out_local_pose)
+{
+	assert(out_local_pose.size() == num_joints && !nodes.empty());
+
+	contributions.clear();
+	weight_rows_used = 0;
+	Flatten(root, 1.0f, -1, false);
+
+	// Additive clips only add to the pose, the root moves like the blended base clips
+	root_motion = glm::vec2(0.0f);
+	float root_weight = 0.0f;
+	for (const auto& contribution : contributions)
+	{
+		if (contribution.additive) continue;
+		const float weight = contribution.weight * (contribution.joint_weights >= 0 ? weight_rows[contribution.joint_weights] : 1.0f);
+		root_motion += contribution.root_motion * weight;
+		root_weight += weight;
+	}
+	if (root_weight > 0.0f) root_motion /= root_weight;
+
+	// A single clip doesn't need accumulating, hand it to the batched sampler
+	if (contributions.size() == 1 && !contributions[0].additive && contributions[0].joint_weights < 0)
+	{
+		const auto& contribution = contributions[0];
+		SampleClip(*contribution.clip, contribution.time, out_local_pose, contribution.cursor);
+		return;
+	}
+
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		glm::quat rotation(0.0f, 0.0f, 0.0f, 0.0f);
+		glm::vec3 translation(0.0f), scale(0.0f);
+		float total_weight = 0.0f;
+		for (const auto& contribution : contributions)
+		{
+			if (contribution.additive) continue;
+			const float weight = contribution.weight * (contribution.joint_weights >= 0 ? weight_rows[contribution.joint_weights + i] : 1.0f);
+			if (weight <= 0.0f) continue;
+
+			glm::quat sample_rotation;
+			glm::vec3 sample_translation, sample_scale;
+			SampleClipJoint(*contribution.clip, contribution.pose, i, contribution.cursor, sample_rotation, sample_translation, sample_scale);
+			if (glm::dot(rotation, sample_rotation) < 0.0f) sample_rotation = -sample_rotation;
+			rotation = rotation + sample_rotation * weight;
+			translation += sample_translation * weight;
+			scale += sample_scale * weight;
+			total_weight += weight;
+		}
+
+		if (total_weight > 0.0f)
+		{
+			rotation = glm::normalize(rotation);
+			translation /= total_weight;
+			scale /= total_weight;
+		}
+		else
+		{
+			rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+			scale = glm::vec3(1.0f);
+		}
+
+		for (const auto& contribution : contributions)
+		{
+			if (!contribution.additive) continue;
+			const float weight = contribution.weight * (contribution.joint_weights >= 0 ? weight_rows[contribution.joint_weights + i] : 1.0f);
+			if (weight <= 0.0f) continue;
+
+			// The additive clip's first pose is its reference, only the difference to it is applied
+			glm::quat sample_rotation, reference_rotation;
+			glm::vec3 sample_translation, sample_scale, reference_translation, reference_scale;
+			SampleClipJoint(*contribution.clip, contribution.pose, i, contribution.cursor, sample_rotation, sample_translation, sample_scale);
+			SampleClipJoint(*contribution.clip, 0.0f, i, nullptr, reference_rotation, reference_translation, reference_scale);
+
+			auto delta_rotation = sample_rotation * glm::conjugate(reference_rotation);
+			if (delta_rotation.w < 0.0f) delta_rotation = -delta_rotation;
+			delta_rotation = glm::normalize(glm::quat(1.0f, 0.0f, 0.0f, 0.0f) * (1.0f - weight) + delta_rotation * weight);
+			rotation = glm::normalize(delta_rotation * rotation);
+			translation += (sample_translation - reference_translation) * weight;
+			scale *= glm::vec3(1.0f) + (sample_scale / reference_scale - glm::vec3(1.0f)) * weight;
+		}
+
+		out_local_pose.rotations[i] = rotation;
+		out_local_pose.translations[i] = translation;
+		out_local_pose.scales[i] = scale;
+	}
+}
+
+std::vector<float> BuildJointMask(const Skeleton& skeleton, int root_joint)
+{
+	const auto num_joints = skeleton.joints.size();
+	std::vector<float> mask(num_joints, 0.0f);
+	if (root_joint < 0 || root_joint >= (int)num_joints) return mask;
+
+	// Parents always come before their children
+	mask[root_joint] = 1.0f;
+	for (auto i = (std::size_t)root_joint + 1; i < num_joints; i++)
+	{
+		const auto parent = skeleton.joints[i].parent;
+		if (parent >= 0 && mask[parent] > 0.0f) mask[i] = 1.0f;
+	}
+	return mask;
+}
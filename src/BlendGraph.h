@@ -0,0 +1,119 @@
+#ifndef BLEND_GRAPH_H
+#define BLEND_GRAPH_H
+
+#include "AnimatedModel.h"
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <span>
+#include <vector>
+
+// Tree of blend nodes over the clips of one model. Evaluate() flattens the tree into a list of weighted clip samples
+// and then makes a single pass over the joints, sampling every clip for a joint and accumulating it straight into
+// the output pose. No intermediate pose is ever stored. With one clip active it falls back to plain SampleClip.
+class BlendGraph
+{
+public:
+	using NodeIndex = std::uint16_t;
+	static constexpr std::uint16_t no_mask = 0xFFFF;
+
+	enum class NodeType : std::uint8_t
+	{
+		CLIP,
+		BLEND,          // inputs[0] to inputs[1] by alpha, fade_speed turns it into a cross-fade
+		BLEND_SPACE_1D, // inputs weighted by where parameter.x falls between their sample positions
+		BLEND_SPACE_2D, // inputs weighted by gradient band interpolation of parameter between sample positions
+		LAYER,          // inputs[1] overrides inputs[0] by alpha, on the joints of mask
+		ADDITIVE,       // inputs[1] minus its first pose is added on top of inputs[0], scaled by alpha and mask
+	};
+
+	struct Node
+	{
+		NodeType type;
+		std::vector<NodeIndex> inputs;
+
+		// CLIP
+		std::uint32_t clip_index = 0;
+		float time = 0.0f; // seconds
+		float speed = 1.0f;
+		bool synced = false; // time is driven by the parent blend space
+		glm::vec2 root_motion = glm::vec2(0.0f); // root displacement over the last Update
+		ClipCursor cursor;
+
+		// BLEND, LAYER and ADDITIVE
+		float alpha = 0.0f;
+		float fade_speed = 0.0f; // alpha per second
+		std::uint16_t mask = no_mask;
+
+		// Blend spaces. Inputs are clips playing in sync, phase is their shared normalized time.
+		std::vector<glm::vec2> sample_positions;
+		std::vector<float> sample_weights;
+		glm::vec2 parameter = glm::vec2(0.0f);
+		float phase = 0.0f;
+	};
+
+	BlendGraph() = default;
+	BlendGraph(const std::vector<AnimationClip>& clips, std::size_t num_joints);
+
+	NodeIndex AddClip(std::uint32_t clip_index, float speed = 1.0f);
+	NodeIndex AddBlend(NodeIndex from, NodeIndex to, float alpha);
+	// sample_positions must be in ascending order
+	NodeIndex AddBlendSpace1D(std::span<const NodeIndex> clip_nodes, std::span<const float> sample_positions);
+	NodeIndex AddBlendSpace2D(std::span<const NodeIndex> clip_nodes, std::span<const glm::vec2> sample_positions);
+	NodeIndex AddLayer(NodeIndex base, NodeIndex layer, float alpha, std::uint16_t mask = no_mask);
+	NodeIndex AddAdditive(NodeIndex base, NodeIndex additive, float alpha, std::uint16_t mask = no_mask);
+
+	// Per-joint weights in [0, 1], one per skeleton joint
+	std::uint16_t AddMask(std::span<const float> joint_weights);
+	void SetMask(std::uint16_t mask, std::span<const float> joint_weights);
+
+	Node& GetNode(NodeIndex index) { return nodes[index]; }
+	const Node& GetNode(NodeIndex index) const { return nodes[index]; }
+	void SetRoot(NodeIndex index) { root = index; }
+	// Points a clip node at another clip, restarting it at time
+	void SetClip(NodeIndex index, std::uint32_t clip_index, float time = 0.0f);
+	// Starts fading a BLEND node from its first input to its second over duration seconds
+	void StartCrossfade(NodeIndex index, float duration);
+
+	// Advances clip times, blend space phases and cross-fades
+	void Update(float dt);
+	void Evaluate(PoseView out_local_pose);
+
+	std::size_t LastContributionCount() const { return contributions.size(); }
+	// Root displacement over the last Update, blended with the weights the root joint got in the last Evaluate
+	glm::vec2 LastRootMotion() const { return root_motion; }
+
+private:
+	struct Contribution
+	{
+		const AnimationClip* clip;
+		ClipCursor* cursor;
+		float time;
+		float pose;
+		float weight;
+		glm::vec2 root_motion;
+		std::int32_t joint_weights; // offset into weight_rows, -1 if the weight is the same for every joint
+		bool additive;
+	};
+
+	void UpdateBlendSpaceWeights(Node& node);
+	void Flatten(NodeIndex index, float weight, std::int32_t joint_weights, bool additive);
+	std::int32_t AllocateWeightRow();
+
+	const std::vector<AnimationClip>* clips = nullptr;
+	std::size_t num_joints = 0;
+	std::vector<Node> nodes;
+	NodeIndex root = 0;
+	std::vector<float> masks; // num_joints weights per mask
+
+	// Rebuilt by every Evaluate, capacity is kept so steady state doesn't allocate
+	std::vector<Contribution> contributions;
+	std::vector<float> weight_rows;
+	std::size_t weight_rows_used = 0;
+	glm::vec2 root_motion = glm::vec2(0.0f);
+};
+
+// 1 for root_joint and all of its descendants, 0 elsewhere
+std::vector<float> BuildJointMask(const Skeleton& skeleton, int root_joint);
+
+#endif // !BLEND_GRAPH_H
@@ -0,0 +1,460 @@
+#include "ClipCompression.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+using TrackType = CompressedClip::TrackType;
+
+// Largest per-component difference for a track to still count as constant
+static constexpr float rotation_tolerance = 0.00001f;
+static constexpr float translation_tolerance = 0.0001f;
+static constexpr float scale_tolerance = 0.00001f;
+
+static constexpr float max_smallest_three = 0.70710678f; // 1 / sqrt(2), bound of the three smallest components
+static constexpr float max_15_bits = 32767.0f;
+static constexpr float max_16_bits = 65535.0f;
+
+static inline glm::vec3 Lerp(const glm::vec3& a, const glm::vec3& b, float t)
+{
+	return a * (1.0f - t) + b * t;
+}
+
+static inline glm::quat IdentityRotation()
+{
+	return glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+}
+
+static bool NearlyEqual(const glm::quat& a, const glm::quat& b, float tolerance)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		if (std::abs(a[i] - b[i]) > tolerance) return false;
+	}
+	return true;
+}
+
+static bool NearlyEqual(const glm::vec3& a, const glm::vec3& b, float tolerance)
+{
+	return std::abs(a.x - b.x) <= tolerance && std::abs(a.y - b.y) <= tolerance && std::abs(a.z - b.z) <= tolerance;
+}
+
+static CompressedClip::QuantizedRotation QuantizeRotation(glm::quat q)
+{
+	int largest = 0;
+	for (int i = 1; i < 4; i++)
+	{
+		if (std::abs(q[i]) > std::abs(q[largest])) largest = i;
+	}
+	// The dropped component is rebuilt as a positive square root so flip q to make it positive
+	if (q[largest] < 0.0f) q = -q;
+
+	std::uint16_t smallest[3];
+	for (int i = 0, j = 0; i < 4; i++)
+	{
+		if (i == largest) continue;
+		const float normalized = std::clamp(q[i] / max_smallest_three * 0.5f + 0.5f, 0.0f, 1.0f);
+		smallest[j++] = (std::uint16_t)std::lround(normalized * max_15_bits);
+	}
+
+	CompressedClip::QuantizedRotation quantized;
+	quantized.packed[0] = (std::uint16_t)(smallest[0] | ((largest & 1) << 15));
+	quantized.packed[1] = (std::uint16_t)(smallest[1] | ((largest >> 1) << 15));
+	quantized.packed[2] = smallest[2];
+	return quantized;
+}
+
+static inline glm::quat DequantizeRotation(const CompressedClip::QuantizedRotation& quantized)
+{
+	const int largest = (quantized.packed[0] >> 15) | ((quantized.packed[1] >> 15) << 1);
+	glm::quat q;
+	float sum_of_squares = 0.0f;
+	for (int i = 0, j = 0; i < 4; i++)
+	{
+		if (i == largest) continue;
+		const float component = ((quantized.packed[j++] & 0x7FFF) / max_15_bits * 2.0f - 1.0f) * max_smallest_three;
+		q[i] = component;
+		sum_of_squares += component * component;
+	}
+	q[largest] = std::sqrt(std::max(0.0f, 1.0f - sum_of_squares));
+	return q;
+}
+
+static CompressedClip::QuantizedVec3 QuantizeVec3(const glm::vec3& v, const CompressedClip::Range& range)
+{
+	CompressedClip::QuantizedVec3 quantized;
+	for (int i = 0; i < 3; i++)
+	{
+		const float normalized = range.extent[i] > 0.0f ? std::clamp((v[i] - range.min[i]) / range.extent[i], 0.0f, 1.0f) : 0.0f;
+		quantized.packed[i] = (std::uint16_t)std::lround(normalized * max_16_bits);
+	}
+	return quantized;
+}
+
+static inline glm::vec3 DequantizeVec3(const CompressedClip::QuantizedVec3& quantized, const CompressedClip::Range& range)
+{
+	const glm::vec3 normalized(quantized.packed[0] / max_16_bits, quantized.packed[1] / max_16_bits, quantized.packed[2] / max_16_bits);
+	return range.min + normalized * range.extent;
+}
+
+static inline glm::quat Nlerp(const glm::quat& a, const glm::quat& b, float t)
+{
+	return glm::normalize(a * (1.0f - t) + b * t);
+}
+
+// Error functions return the distance a point tip_distance away from the joint moves when value is replaced by
+// approximation
+static inline float RotationError(const glm::quat& value, const glm::quat& approximation, float tip_distance)
+{
+	const float cos_half_angle = std::min(std::abs(glm::dot(value, approximation)), 1.0f);
+	return 2.0f * tip_distance * std::sqrt(1.0f - cos_half_angle * cos_half_angle);
+}
+
+static inline float TranslationError(const glm::vec3& value, const glm::vec3& approximation, float)
+{
+	return glm::length(value - approximation);
+}
+
+static inline float ScaleError(const glm::vec3& value, const glm::vec3& approximation, float tip_distance)
+{
+	return glm::length(value - approximation) * tip_distance;
+}
+
+// Picks the poses of a track to keep so that interpolating between kept keys stays within tolerance of every
+// removed key. Greedy: each segment is grown from the last kept key for as long as it stays within tolerance.
+template<typename T, typename InterpolateFn, typename ErrorFn>
+static void ReduceTrack(std::span<const T> keys, float tolerance, float tip_distance, InterpolateFn interpolate, ErrorFn error, std::vector<std::uint16_t>& out_kept_poses)
+{
+	out_kept_poses.clear();
+	const auto num_keys = (unsigned int)keys.size();
+	out_kept_poses.push_back(0);
+	auto segment_start = 0u;
+	for (auto candidate_end = 2u; candidate_end < num_keys; candidate_end++)
+	{
+		bool within_tolerance = true;
+		for (auto i = segment_start + 1; i < candidate_end && within_tolerance; i++)
+		{
+			const float t = (float)(i - segment_start) / (float)(candidate_end - segment_start);
+			within_tolerance = error(keys[i], interpolate(keys[segment_start], keys[candidate_end], t), tip_distance) <= tolerance;
+		}
+		if (!within_tolerance)
+		{
+			segment_start = candidate_end - 1;
+			out_kept_poses.push_back((std::uint16_t)segment_start);
+		}
+	}
+	out_kept_poses.push_back((std::uint16_t)(num_keys - 1));
+}
+
+// Copies one joint's track out of the pose-major raw data so it can be reduced as a contiguous array
+template<typename T>
+static void GatherTrack(std::span<const T> raw, unsigned int pose_count, unsigned int joint_count, unsigned int joint, std::vector<T>& out_track)
+{
+	out_track.resize(pose_count);
+	for (auto pose = 0u; pose < pose_count; pose++)
+	{
+		out_track[pose] = raw[pose * joint_count + joint];
+	}
+}
+
+struct ReductionContext
+{
+	float tolerance = 0.0f; // 0 keeps every key
+	float tip_distance = 0.0f;
+	std::vector<std::uint16_t> kept_poses;
+};
+
+static void KeepAllPoses(unsigned int pose_count, std::vector<std::uint16_t>& out_kept_poses)
+{
+	out_kept_poses.resize(pose_count);
+	for (auto pose = 0u; pose < pose_count; pose++) out_kept_poses[pose] = (std::uint16_t)pose;
+}
+
+static CompressedClip::Track CompressRotationTrack(std::span<const glm::quat> track_keys, ReductionContext& reduction, CompressedClip& compressed)
+{
+	const auto first = track_keys[0];
+	bool is_constant = true;
+	for (auto pose = 1u; pose < track_keys.size() && is_constant; pose++)
+	{
+		is_constant = NearlyEqual(track_keys[pose], first, rotation_tolerance);
+	}
+
+	CompressedClip::Track track;
+	if (is_constant && (NearlyEqual(first, IdentityRotation(), rotation_tolerance) || NearlyEqual(-first, IdentityRotation(), rotation_tolerance)))
+	{
+		track.type = TrackType::IDENTITY;
+	}
+	else if (is_constant)
+	{
+		track.type = TrackType::CONSTANT;
+		track.index = (std::uint32_t)compressed.constant_rotations.size();
+		compressed.constant_rotations.push_back(first);
+	}
+	else
+	{
+		if (reduction.tolerance > 0.0f) ReduceTrack(track_keys, reduction.tolerance, reduction.tip_distance, Nlerp, RotationError, reduction.kept_poses);
+		else KeepAllPoses((unsigned int)track_keys.size(), reduction.kept_poses);
+
+		track.type = TrackType::ANIMATED;
+		track.first_key = (std::uint32_t)compressed.rotation_keys.size();
+		track.key_count = (std::uint32_t)reduction.kept_poses.size();
+		for (auto pose : reduction.kept_poses)
+		{
+			compressed.rotation_keys.push_back(QuantizeRotation(track_keys[pose]));
+			compressed.rotation_key_poses.push_back(pose);
+		}
+		compressed.uncompressed_key_count += track_keys.size();
+	}
+	return track;
+}
+
+template<typename ErrorFn>
+static CompressedClip::Track CompressVec3Track(std::span<const glm::vec3> track_keys, const glm::vec3& identity, float tolerance, ReductionContext& reduction, ErrorFn error,
+	std::vector<glm::vec3>& constants, std::vector<CompressedClip::Range>& ranges, std::vector<CompressedClip::QuantizedVec3>& quantized_keys,
+	std::vector<std::uint16_t>& key_poses, CompressedClip& compressed)
+{
+	const auto first = track_keys[0];
+	glm::vec3 min = first, max = first;
+	for (const auto& key : track_keys)
+	{
+		min = glm::min(min, key);
+		max = glm::max(max, key);
+	}
+
+	CompressedClip::Track track;
+	const bool is_constant = NearlyEqual(min, max, tolerance);
+	if (is_constant && NearlyEqual(first, identity, tolerance))
+	{
+		track.type = TrackType::IDENTITY;
+	}
+	else if (is_constant)
+	{
+		track.type = TrackType::CONSTANT;
+		track.index = (std::uint32_t)constants.size();
+		constants.push_back(first);
+	}
+	else
+	{
+		if (reduction.tolerance > 0.0f) ReduceTrack(track_keys, reduction.tolerance, reduction.tip_distance, Lerp, error, reduction.kept_poses);
+		else KeepAllPoses((unsigned int)track_keys.size(), reduction.kept_poses);
+
+		track.type = TrackType::ANIMATED;
+		track.index = (std::uint32_t)ranges.size();
+		ranges.push_back({ min, max - min });
+		track.first_key = (std::uint32_t)quantized_keys.size();
+		track.key_count = (std::uint32_t)reduction.kept_poses.size();
+		for (auto pose : reduction.kept_poses)
+		{
+			quantized_keys.push_back(QuantizeVec3(track_keys[pose], ranges.back()));
+			key_poses.push_back(pose);
+		}
+		compressed.uncompressed_key_count += track_keys.size();
+	}
+	return track;
+}
+
+std::size_t CompressedClip::SizeBytes() const
+{
+	return (rotation_tracks.size() + translation_tracks.size() + scale_tracks.size()) * sizeof(Track) +
+		constant_rotations.size() * sizeof(glm::quat) +
+		(constant_translations.size() + constant_scales.size()) * sizeof(glm::vec3) +
+		(translation_ranges.size() + scale_ranges.size()) * sizeof(Range) +
+		rotation_keys.size() * sizeof(QuantizedRotation) +
+		(translation_keys.size() + scale_keys.size()) * sizeof(QuantizedVec3) +
+		(rotation_key_poses.size() + translation_key_poses.size() + scale_key_poses.size()) * sizeof(std::uint16_t);
+}
+
+static CompressedClip BuildCompressedClip(const AnimationClip& clip, std::span<const float> tip_distances, float tolerance)
+{
+	CompressedClip compressed;
+	compressed.rotation_tracks.resize(clip.joint_count);
+	compressed.translation_tracks.resize(clip.joint_count);
+	compressed.scale_tracks.resize(clip.joint_count);
+
+	std::vector<glm::quat> rotation_track;
+	std::vector<glm::vec3> vec3_track;
+	ReductionContext reduction;
+	reduction.tolerance = tolerance;
+	for (auto joint = 0u; joint < clip.joint_count; joint++)
+	{
+		reduction.tip_distance = tip_distances[joint];
+
+		GatherTrack<glm::quat>(clip.rotations, clip.pose_count, clip.joint_count, joint, rotation_track);
+		compressed.rotation_tracks[joint] = CompressRotationTrack(rotation_track, reduction, compressed);
+
+		GatherTrack<glm::vec3>(clip.translations, clip.pose_count, clip.joint_count, joint, vec3_track);
+		compressed.translation_tracks[joint] = CompressVec3Track(vec3_track, glm::vec3(0.0f), translation_tolerance, reduction, TranslationError,
+			compressed.constant_translations, compressed.translation_ranges, compressed.translation_keys, compressed.translation_key_poses, compressed);
+
+		GatherTrack<glm::vec3>(clip.scales, clip.pose_count, clip.joint_count, joint, vec3_track);
+		compressed.scale_tracks[joint] = CompressVec3Track(vec3_track, glm::vec3(1.0f), scale_tolerance, reduction, ScaleError,
+			compressed.constant_scales, compressed.scale_ranges, compressed.scale_keys, compressed.scale_key_poses, compressed);
+	}
+	return compressed;
+}
+
+// Largest distance between joint positions of the raw tracks and clip.compressed, over every pose
+static float MeasureMaxPositionError(const AnimationClip& clip, const Skeleton& skeleton)
+{
+	SkeletonPose decoded;
+	decoded.Resize(clip.joint_count);
+	std::vector<glm::mat4x3> raw_global(clip.joint_count), decoded_global(clip.joint_count), skinning(clip.joint_count);
+	float max_error = 0.0f;
+	for (auto pose = 0u; pose < clip.pose_count; pose++)
+	{
+		const ConstPoseView raw(clip.PoseRotations(pose), clip.PoseTranslations(pose), clip.PoseScales(pose));
+		ComputeJointMatrices(raw, skeleton, raw_global, skinning);
+		SampleCompressedClip(clip, (float)pose, decoded);
+		ComputeJointMatrices(decoded, skeleton, decoded_global, skinning);
+		for (auto i = 0u; i < clip.joint_count; i++)
+		{
+			max_error = std::max(max_error, glm::length(raw_global[i][3] - decoded_global[i][3]));
+		}
+	}
+	return max_error;
+}
+
+void CompressClip(AnimationClip& clip, const Skeleton& skeleton, const ClipCompressionSettings& settings)
+{
+	assert(!clip.is_compressed);
+	assert(clip.pose_count <= max_compressed_pose_count);
+
+	// Track errors add up along the hierarchy, so the per-track tolerance starts at the full budget and is
+	// tightened until the measured model space error fits. The last attempt keeps every key.
+	static constexpr int max_reduction_attempts = 4;
+	const auto tip_distances = ComputeTipDistances(skeleton);
+	float tolerance = settings.max_position_error;
+	for (int attempt = 0; ; attempt++)
+	{
+		if (attempt == max_reduction_attempts) tolerance = 0.0f;
+		clip.compressed = BuildCompressedClip(clip, tip_distances, tolerance);
+		clip.compressed.max_position_error = MeasureMaxPositionError(clip, skeleton);
+		if (tolerance == 0.0f || clip.compressed.max_position_error <= settings.max_position_error) break;
+		tolerance *= 0.5f;
+	}
+
+	clip.compressed.uncompressed_size_bytes = clip.rotations.size_bytes() + clip.translations.size_bytes() + clip.scales.size_bytes();
+	clip.is_compressed = true;
+	clip.keyframe_data.reset();
+	clip.rotations = {};
+	clip.translations = {};
+	clip.scales = {};
+}
+
+// Finds the pair of keys around pose in a track, returning the offset of the left key within the track
+static inline std::uint32_t FindKey(std::span<const std::uint16_t> key_poses, float pose, std::uint32_t* cursor)
+{
+	const auto last_pair = (std::uint32_t)key_poses.size() - 2;
+	if (cursor && *cursor <= last_pair && key_poses[*cursor] <= pose)
+	{
+		auto key = *cursor;
+		while (key < last_pair && key_poses[key + 1] <= pose) key++;
+		*cursor = key;
+		return key;
+	}
+
+	const auto next = std::upper_bound(key_poses.begin(), key_poses.end(), pose, [](float p, std::uint16_t key_pose) { return p < (float)key_pose; });
+	const auto key = std::min((std::uint32_t)std::max<std::ptrdiff_t>(next - key_poses.begin() - 1, 0), last_pair);
+	if (cursor) *cursor = key;
+	return key;
+}
+
+struct KeyPair
+{
+	std::uint32_t a, b; // absolute key indices
+	float t;
+};
+
+// Uniform tracks index keys by pose directly, reduced tracks look the pose up in their key poses
+static inline KeyPair FindKeyPair(const CompressedClip::Track& track, const std::vector<std::uint16_t>& all_key_poses, unsigned int pose_count,
+	const KeyPair& uniform, float pose, std::uint32_t* cursor)
+{
+	if (track.key_count == pose_count) return { track.first_key + uniform.a, track.first_key + uniform.b, uniform.t };
+
+	const std::span<const std::uint16_t> key_poses(all_key_poses.data() + track.first_key, track.key_count);
+	const auto key = FindKey(key_poses, pose, cursor);
+	const float a_pose = key_poses[key], b_pose = key_poses[key + 1];
+	const float t = std::clamp((pose - a_pose) / (b_pose - a_pose), 0.0f, 1.0f);
+	return { track.first_key + key, track.first_key + key + 1, t };
+}
+
+static inline glm::vec3 SampleVec3Track(const CompressedClip::Track& track, const glm::vec3& identity, const std::vector<glm::vec3>& constants,
+	const std::vector<CompressedClip::Range>& ranges, const std::vector<CompressedClip::QuantizedVec3>& keys, const std::vector<std::uint16_t>& key_poses,
+	unsigned int pose_count, const KeyPair& uniform, float pose, std::uint32_t* cursor)
+{
+	switch (track.type)
+	{
+	case TrackType::IDENTITY: return identity;
+	case TrackType::CONSTANT: return constants[track.index];
+	default:
+	{
+		const auto& range = ranges[track.index];
+		const auto pair = FindKeyPair(track, key_poses, pose_count, uniform, pose, cursor);
+		if (pair.t == 0.0f) return DequantizeVec3(keys[pair.a], range);
+		return Lerp(DequantizeVec3(keys[pair.a], range), DequantizeVec3(keys[pair.b], range), pair.t);
+	}
+	}
+}
+
+static inline KeyPair UniformKeyPair(const AnimationClip& clip, float pose)
+{
+	KeyPair uniform;
+	uniform.a = std::min((unsigned int)pose, clip.pose_count - 1);
+	uniform.b = std::min(uniform.a + 1, clip.pose_count - 1);
+	uniform.t = pose - (float)uniform.a;
+	return uniform;
+}
+
+static inline void SampleJoint(const AnimationClip& clip, const KeyPair& uniform, float pose, unsigned int joint, ClipCursor* cursor,
+	glm::quat& out_rotation, glm::vec3& out_translation, glm::vec3& out_scale)
+{
+	const auto& compressed = clip.compressed;
+	const auto& rotation_track = compressed.rotation_tracks[joint];
+	switch (rotation_track.type)
+	{
+	case TrackType::IDENTITY: out_rotation = IdentityRotation(); break;
+	case TrackType::CONSTANT: out_rotation = compressed.constant_rotations[rotation_track.index]; break;
+	case TrackType::ANIMATED:
+	{
+		const auto pair = FindKeyPair(rotation_track, compressed.rotation_key_poses, clip.pose_count, uniform, pose, cursor ? &cursor->rotation_keys[joint] : nullptr);
+		const auto a_rotation = DequantizeRotation(compressed.rotation_keys[pair.a]);
+		if (pair.t == 0.0f)
+		{
+			out_rotation = a_rotation;
+			break;
+		}
+		auto b_rotation = DequantizeRotation(compressed.rotation_keys[pair.b]);
+		// Smallest three forces the dropped component positive, which can undo the load time hemisphere fix-up
+		if (glm::dot(a_rotation, b_rotation) < 0.0f) b_rotation = -b_rotation;
+		out_rotation = Nlerp(a_rotation, b_rotation, pair.t);
+		break;
+	}
+	}
+
+	out_translation = SampleVec3Track(compressed.translation_tracks[joint], glm::vec3(0.0f), compressed.constant_translations,
+		compressed.translation_ranges, compressed.translation_keys, compressed.translation_key_poses, clip.pose_count, uniform, pose,
+		cursor ? &cursor->translation_keys[joint] : nullptr);
+	out_scale = SampleVec3Track(compressed.scale_tracks[joint], glm::vec3(1.0f), compressed.constant_scales,
+		compressed.scale_ranges, compressed.scale_keys, compressed.scale_key_poses, clip.pose_count, uniform, pose,
+		cursor ? &cursor->scale_keys[joint] : nullptr);
+}
+
+void SampleCompressedClip(const AnimationClip& clip, float pose, PoseView out_local_pose, ClipCursor* cursor)
+{
+	const auto num_joints = out_local_pose.size();
+	assert(clip.compressed.rotation_tracks.size() == num_joints);
+	assert(!cursor || cursor->clip == &clip);
+
+	const auto uniform = UniformKeyPair(clip, pose);
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		SampleJoint(clip, uniform, pose, i, cursor, out_local_pose.rotations[i], out_local_pose.translations[i], out_local_pose.scales[i]);
+	}
+}
+
+void SampleCompressedJoint(const AnimationClip& clip, float pose, unsigned int joint, ClipCursor* cursor,
+	glm::quat& out_rotation, glm::vec3& out_translation, glm::vec3& out_scale)
+{
+	assert(!cursor || cursor->clip == &clip);
+	SampleJoint(clip, UniformKeyPair(clip, pose), pose, joint, cursor, out_rotation, out_translation, out_scale);
+}
@@ -0,0 +1,20 @@
+#ifndef CLIP_COMPRESSION_H
+#define CLIP_COMPRESSION_H
+
+#include "AnimatedModel.h"
+
+// Key poses are stored as 16 bit indices, longer clips have to stay uncompressed
+inline constexpr unsigned int max_compressed_pose_count = 0xFFFF;
+
+// Reduces and quantizes the raw tracks of clip into clip.compressed, measures the error against the raw keys and
+// then releases the raw tracks. clip.pose_count must not exceed max_compressed_pose_count.
+void CompressClip(AnimationClip& clip, const Skeleton& skeleton, const ClipCompressionSettings& settings);
+
+// Decodes the keys around pose (a fractional pose index) in every track and blends them straight into
+// out_local_pose. cursor is optional and speeds up finding keys in reduced tracks during forward playback.
+void SampleCompressedClip(const AnimationClip& clip, float pose, PoseView out_local_pose, ClipCursor* cursor = nullptr);
+// Same as SampleCompressedClip for a single joint, for callers that walk joints in their own order
+void SampleCompressedJoint(const AnimationClip& clip, float pose, unsigned int joint, ClipCursor* cursor,
+	glm::quat& out_rotation, glm::vec3& out_translation, glm::vec3& out_scale);
+
+#endif // !CLIP_COMPRESSION_H
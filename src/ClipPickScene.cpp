@@ -1,14 +1,41 @@
 #include "ClipPickScene.h"
 
+#include "AllocationCounter.h"
+#include "AnimationKernels.h"
+#include <chrono>
 #include "imgui.h"
 
-ClipPickScene::ClipPickScene(const std::vector<AnimatedModel>& models, unsigned int proj_view_ubo, unsigned int lights_ubo, Shader& shader)
-    :Scene(models, proj_view_ubo, lights_ubo, shader), model_states(models.size()), model_names(models.size())
+ClipPickScene::ClipPickScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders)
+    :Scene(models, lights_ubo, skinned_shaders), model_states(models.size()), model_names(models.size())
 {
     const int num_models = (int)models.size();
     for (int i = 0; i < num_models; i++)
     {
         model_names[i] = models[i].name;
+        const auto& skeleton = models[i].skeleton;
+        auto& state = model_states[i];
+        state.local_pose.Resize(skeleton.joints.size());
+        state.cache.Resize(skeleton.joints.size());
+        state.dual_quaternions.resize(skeleton.joints.size() * 2);
+
+        auto& graph = state.graph;
+        graph = BlendGraph(models[i].clips, skeleton.joints.size());
+        state.previous_clip_node = graph.AddClip(0);
+        state.current_clip_node = graph.AddClip(0);
+        state.crossfade_node = graph.AddBlend(state.previous_clip_node, state.current_clip_node, 1.0f);
+        state.layer_clip_node = graph.AddClip(0);
+        // Layers default to the upper body
+        for (std::size_t joint = 0; joint < skeleton.joint_names.size(); joint++)
+        {
+            if (skeleton.joint_names[joint].find("Spine") != std::string::npos)
+            {
+                state.layer_mask_joint = (int)joint;
+                break;
+            }
+        }
+        state.layer_mask = graph.AddMask(BuildJointMask(skeleton, state.layer_mask_joint));
+        state.layer_node = graph.AddLayer(state.crossfade_node, state.layer_clip_node, 0.0f, state.layer_mask);
+        graph.SetRoot(state.layer_node);
 
         std::transform(models[i].clips.begin(), models[i].clips.end(), std::back_inserter(model_states[i].clip_names),
             [](const AnimationClip& clip)
@@ -16,6 +43,20 @@ ClipPickScene::ClipPickScene(const std::vector<AnimatedModel>& models, unsigned
                 return clip.name;
             });
     }
+    glGenQueries(1, &draw_time_query);
+}
+
+ClipPickScene::~ClipPickScene()
+{
+    glDeleteQueries(1, &draw_time_query);
+}
+
+void ClipPickScene::SetSkinningMode(SkinningMode mode)
+{
+    for (auto& state : model_states)
+    {
+        state.skinning_mode = mode;
+    }
 }
 
 void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
@@ -42,7 +83,10 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
                 {
                     if (current_model_idx != n)
                     {
-                        model_states[current_model_idx].clip_time = 0.0f;
+                        auto& state = model_states[current_model_idx];
+                        state.graph.SetClip(state.current_clip_node, state.current_clip);
+                        state.graph.StartCrossfade(state.crossfade_node, 0.0f);
+                        state.pose_dirty = true;
                     }
                     current_model_idx = n;
                 }
@@ -65,9 +109,15 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
                 const bool is_selected = (model_states[current_model_idx].current_clip == n);
                 if (ImGui::Selectable(model_states[current_model_idx].clip_names[n].c_str(), is_selected))
                 {
-                    if (model_states[current_model_idx].current_clip != n)
+                    auto& state = model_states[current_model_idx];
+                    if (state.current_clip != n)
                     {
-                        model_states[current_model_idx].clip_time = 0.0f;
+                        // Fade out from wherever the old clip was instead of snapping
+                        const auto& current = state.graph.GetNode(state.current_clip_node);
+                        state.graph.SetClip(state.previous_clip_node, current.clip_index, current.time);
+                        state.graph.SetClip(state.current_clip_node, n);
+                        state.graph.StartCrossfade(state.crossfade_node, state.crossfade_duration);
+                        state.pose_dirty = true;
                     }
                     model_states[current_model_idx].current_clip = n;
                 }
@@ -83,37 +133,131 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
 
         ImGui::Checkbox("Pause", &model_states[current_model_idx].paused);
         ImGui::InputFloat("Speed", &model_states[current_model_idx].clip_speed, 0.1f);
-        ImGui::Text("Clip time: %f", model_states[current_model_idx].clip_time);
+        ImGui::DragFloat("Cross-fade time", &model_states[current_model_idx].crossfade_duration, 0.01f, 0.0f, 2.0f);
+        auto& clip_time = model_states[current_model_idx].graph.GetNode(model_states[current_model_idx].current_clip_node).time;
+        ImGui::Text("Clip time: %f", clip_time);
 
         auto& current_clip = models[current_model_idx].clips[model_states[current_model_idx].current_clip];
-        if (ImGui::SliderFloat("Clip time", &model_states[current_model_idx].clip_time, 0.0f, current_clip.frame_count / current_clip.frames_per_second))
+        const float clip_duration = current_clip.frame_count / current_clip.frames_per_second;
+        if (ImGui::SliderFloat("Clip time", &clip_time, 0.0f, clip_duration))
         {
             model_states[current_model_idx].paused = true;
+            model_states[current_model_idx].pose_dirty = true;
+        }
+        ImGui::ProgressBar(clip_duration > 0.0f ? clip_time / clip_duration : 0.0f);
+        if (current_clip.is_compressed)
+        {
+            const auto& compressed = current_clip.compressed;
+            ImGui::Text("Clip memory: %.1f KB -> %.1f KB (%.1fx), max position error %.4f", compressed.uncompressed_size_bytes / 1024.0f,
+                compressed.SizeBytes() / 1024.0f, (float)compressed.uncompressed_size_bytes / compressed.SizeBytes(), compressed.max_position_error);
+            ImGui::Text("Animated keys: %zu / %zu", compressed.KeyCount(), compressed.uncompressed_key_count);
+        }
+
+        {
+            auto& state = model_states[current_model_idx];
+            const auto& skeleton = models[current_model_idx].skeleton;
+            const char* layer_preview = state.layer_clip >= 0 ? state.clip_names[state.layer_clip].c_str() : "None";
+            if (ImGui::BeginCombo("Layer", layer_preview, flags))
+            {
+                if (ImGui::Selectable("None", state.layer_clip < 0))
+                {
+                    state.layer_clip = -1;
+                    state.pose_dirty = true;
+                }
+                for (int n = 0; n < num_animations; n++)
+                {
+                    if (ImGui::Selectable(state.clip_names[n].c_str(), state.layer_clip == n) && state.layer_clip != n)
+                    {
+                        state.layer_clip = n;
+                        state.graph.SetClip(state.layer_clip_node, n);
+                        state.pose_dirty = true;
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            if (state.layer_clip >= 0)
+            {
+                state.pose_dirty |= ImGui::SliderFloat("Layer weight", &state.layer_weight, 0.0f, 1.0f);
+                state.pose_dirty |= ImGui::Checkbox("Additive layer", &state.layer_additive);
+                if (ImGui::BeginCombo("Layer mask root", skeleton.joint_names[state.layer_mask_joint].c_str(), flags))
+                {
+                    for (int n = 0; n < (int)skeleton.joint_names.size(); n++)
+                    {
+                        if (ImGui::Selectable(skeleton.joint_names[n].c_str(), state.layer_mask_joint == n))
+                        {
+                            state.layer_mask_joint = n;
+                            state.graph.SetMask(state.layer_mask, BuildJointMask(skeleton, n));
+                            state.pose_dirty = true;
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+            }
         }
-        ImGui::ProgressBar(model_states[current_model_idx].clip_time / (current_clip.frame_count / current_clip.frames_per_second));
+
         ImGui::InputFloat3("Position", &model_states[current_model_idx].position.x);
         ImGui::DragFloat("Scale", &model_states[current_model_idx].scale, 0.001f);
         ImGui::Checkbox("Apply root motion", &model_states[current_model_idx].apply_root_motion);
+        if (model_states[current_model_idx].apply_root_motion)
+        {
+            ImGui::SameLine();
+            if (ImGui::Button("Reset position")) model_states[current_model_idx].root_offset = glm::vec2(0.0f);
+        }
+        else
+        {
+            model_states[current_model_idx].root_offset = glm::vec2(0.0f);
+        }
         ImGui::Checkbox("Render skeleton", &model_states[current_model_idx].render_skeleton);
         ImGui::Checkbox("Render model", &model_states[current_model_idx].render_model);
+        static const char* skinning_mode_names[] = { "Linear blend", "Dual quaternion" };
+        int skinning_mode = (int)model_states[current_model_idx].skinning_mode;
+        if (ImGui::Combo("Skinning", &skinning_mode, skinning_mode_names, IM_ARRAYSIZE(skinning_mode_names)))
+        {
+            model_states[current_model_idx].skinning_mode = (SkinningMode)skinning_mode;
+        }
         ImGui::DragFloat("Axis scale", &model_states[current_model_idx].axis_scale, 0.01f);
 
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+        ImGui::Text("Heap allocations in update: %llu", (unsigned long long)last_update_allocations);
+        const auto num_joints = models[current_model_idx].skeleton.joints.size();
+        ImGui::Text("Pose evaluation: %.2f us, %.1f M joints/s (%s kernels)", last_pose_evaluation_us,
+            last_pose_evaluation_us > 0.0f ? num_joints / last_pose_evaluation_us : 0.0f, GetAnimationKernels().name);
+        ImGui::Text("Joints recomputed: %u / %zu", model_states[current_model_idx].cache.last_update_joint_count, num_joints);
+        ImGui::Text("Clips blended: %zu", model_states[current_model_idx].graph.LastContributionCount());
+        ImGui::Text("Skinning palette upload: %zu bytes, skinned draw: %.1f us GPU", last_palette_upload_bytes, last_draw_gpu_us);
+        ImGui::Text("Shader permutations compiled: %zu", skinned_shaders.CompiledCount());
 
         ImGui::End();
     }
 
+    const auto allocations_before_update = HeapAllocationCount();
+
     const auto& current_model = models[current_model_idx];
     auto& current_model_state = model_states[current_model_idx];
-    const auto& current_clip = current_model.clips[current_model_state.current_clip];
+    auto& graph = current_model_state.graph;
 
-    if (!current_model_state.paused)
+    graph.GetNode(current_model_state.previous_clip_node).speed = current_model_state.clip_speed;
+    graph.GetNode(current_model_state.current_clip_node).speed = current_model_state.clip_speed;
+    graph.GetNode(current_model_state.layer_clip_node).speed = current_model_state.clip_speed;
+    auto& layer_node = graph.GetNode(current_model_state.layer_node);
+    layer_node.type = current_model_state.layer_additive ? BlendGraph::NodeType::ADDITIVE : BlendGraph::NodeType::LAYER;
+    layer_node.alpha = current_model_state.layer_clip >= 0 ? current_model_state.layer_weight : 0.0f;
+    graph.Update(current_model_state.paused ? 0.0f : dt);
+
+    // One hierarchy evaluation feeds both the skinned mesh and the skeleton axes
+    const auto evaluation_start = std::chrono::steady_clock::now();
+    // A paused pose only changes through the UI, otherwise the cached matrices are reused without sampling
+    if (!current_model_state.paused || current_model_state.pose_dirty)
     {
-        current_model_state.clip_time += (current_model_state.clip_speed * dt);
-        const float clip_duration = current_clip.frame_count / current_clip.frames_per_second;
-        current_model_state.clip_time = std::fmod(current_model_state.clip_time, clip_duration);
-        if (current_model_state.clip_time < 0) current_model_state.clip_time = clip_duration + current_model_state.clip_time;
+        graph.Evaluate(current_model_state.local_pose);
+        current_model_state.cache.MarkAllDirty();
+        current_model_state.pose_dirty = false;
+        // Clips are sampled in place, moving the model is all root motion takes
+        if (current_model_state.apply_root_motion) current_model_state.root_offset += graph.LastRootMotion();
     }
+    current_model_state.cache.Update(current_model_state.local_pose, current_model.skeleton);
+    const auto root_offset = glm::vec3(current_model_state.root_offset.x, 0.0f, current_model_state.root_offset.y);
+    last_pose_evaluation_us = std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - evaluation_start).count();
 
     if (current_model_state.render_model)
     {
@@ -121,34 +265,52 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
         auto world_matrix = glm::identity<glm::mat4>();
         world_matrix = glm::translate(world_matrix, current_model_state.position);
         world_matrix = glm::scale(world_matrix, glm::vec3(current_model_state.scale));
-        auto normal_matrix = glm::mat3(glm::transpose(glm::inverse(view_matrix * world_matrix)));
+        world_matrix = glm::translate(world_matrix, root_offset);
 
-        current_model.BindGeometry();
-        model_shader->use();
-        auto skinning_matrices = ComputeSkinningMatrices(current_clip, current_model.skeleton, current_model_state.clip_time, current_model_state.apply_root_motion);
-        model_shader->SetMat4("skinning_matrices", glm::value_ptr(skinning_matrices.front()), (int)skinning_matrices.size());
-        model_shader->SetMat4("model", glm::value_ptr(world_matrix));
-        model_shader->SetMat3("normalMatrix", glm::value_ptr(normal_matrix));
+        // Reading the query back in the frame it was issued would stall on the GPU
+        if (draw_time_query_pending)
+        {
+            GLint available = 0;
+            glGetQueryObjectiv(draw_time_query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                GLuint64 elapsed_ns = 0;
+                glGetQueryObjectui64v(draw_time_query, GL_QUERY_RESULT, &elapsed_ns);
+                last_draw_gpu_us = elapsed_ns / 1000.0f;
+                draw_time_query_pending = false;
+            }
+        }
+        const bool time_draw = !draw_time_query_pending;
+        if (time_draw) glBeginQuery(GL_TIME_ELAPSED, draw_time_query);
 
-        const auto& materials = current_model.materials;
-        for (auto& mesh : current_model.meshes)
+        const auto& skinning_matrices = current_model_state.cache.skinning_matrices;
+        render_queue.Begin(view_matrix);
+        if (current_model_state.skinning_mode == SkinningMode::DUAL_QUATERNION)
+        {
+            auto& dual_quaternions = current_model_state.dual_quaternions;
+            ComputeSkinningDualQuaternions(skinning_matrices, dual_quaternions);
+            const auto palette_offset = StreamSkinningPalette(dual_quaternions.data(), dual_quaternions.size() * sizeof(glm::vec4));
+            last_palette_upload_bytes = dual_quaternions.size() * sizeof(glm::vec4);
+            dual_quaternion_shader.use();
+            BindSkinningPalette(dual_quaternion_shader, palette_offset);
+            dual_quaternion_shader.SetInt("diffuse_maps", 0);
+            dual_quaternion_shader.SetInt("specular_maps", 1);
+            dual_quaternion_shader.SetInt("normal_maps", 2);
+            render_queue.Submit(dual_quaternion_shader, current_model, world_matrix, palette_offset);
+        }
+        else
         {
-            auto& material = materials[mesh.material_index];
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, material.diffuse_map.id);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, material.specular_map.id);
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, material.normal_map.id);
-            model_shader->SetInt("material.diffuse", 0);
-            model_shader->SetInt("material.specular", 1);
-            model_shader->SetInt("material.normal", 2);
-            model_shader->SetFloat("material.shininess", material.shininess);
-            model_shader->SetVec3("material.diffuse_coeff", material.diffuse_coefficient);
-            model_shader->SetVec3("material.specular_coeff", material.specular_coefficient);
-            static_assert(std::is_same_v<std::uint32_t, std::underlying_type<PhongMaterialFlags>::type>);
-            model_shader->SetUint("material.flags", (std::uint32_t)material.flags);
-            glDrawElements(GL_TRIANGLES, mesh.indices_end - mesh.indices_begin + 1, GL_UNSIGNED_INT, (void*)(mesh.indices_begin * sizeof(GLuint)));
+            const auto palette_offset = StreamSkinningPalette(skinning_matrices);
+            last_palette_upload_bytes = skinning_matrices.size() * sizeof(glm::mat4x3);
+            BindSkinningPaletteTexture();
+            // Clips can't scale joints non uniformly when the model says so, the pose here is always sampled from them
+            render_queue.Submit(skinned_shaders, current_model, world_matrix, palette_offset, current_model.uniform_joint_scale);
+        }
+        render_queue.Flush();
+        if (time_draw)
+        {
+            glEndQuery(GL_TIME_ELAPSED);
+            draw_time_query_pending = true;
         }
     }
     if (current_model_state.render_skeleton)
@@ -160,16 +322,17 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
         auto world_matrix = glm::identity<glm::mat4>();
         world_matrix = glm::translate(world_matrix, current_model_state.position);
         world_matrix = glm::scale(world_matrix, glm::vec3(current_model_state.scale));
+        world_matrix = glm::translate(world_matrix, root_offset);
         static constexpr glm::vec3 red(1.0f, 0.0f, 0.0f);
         static constexpr glm::vec3 green(0.0f, 1.0f, 0.0f);
         static constexpr glm::vec3 blue(0.0f, 0.0f, 1.0f);
 
-        auto global_matrices = ComputeGlobalMatrices(current_clip, current_model.skeleton, current_model_state.clip_time, current_model_state.apply_root_motion);
+        const auto& global_matrices = current_model_state.cache.global_matrices;
         auto scale_matrix = glm::scale(glm::identity<glm::mat4>(), glm::vec3(current_model_state.axis_scale));
         glDisable(GL_DEPTH_TEST);
         for (auto& mat : global_matrices)
         {
-            auto joint_world_matrix = world_matrix * mat * scale_matrix;
+            auto joint_world_matrix = world_matrix * glm::mat4(mat) * scale_matrix;
             axis_shader.SetMat4("model", glm::value_ptr(joint_world_matrix));
             axis_shader.SetVec3("color", red);
             glDrawArrays(GL_LINES, 0, 2);
@@ -180,6 +343,8 @@ void ClipPickScene::UpdateAndRenderImpl(const Input& input, float dt)
         }
         glEnable(GL_DEPTH_TEST);
     }
+
+    last_update_allocations = HeapAllocationCount() - allocations_before_update;
 }
 
 ClipPickScene::Axis::Axis()
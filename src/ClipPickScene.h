@@ -1,12 +1,18 @@
 #include "Scene.h"
 
 #include <algorithm>
+#include "BlendGraph.h"
+#include <cstdint>
 #include <vector>
 
 class ClipPickScene : public Scene
 {
 public:
-	ClipPickScene(const std::vector<AnimatedModel>& models, unsigned int proj_view_ubo, unsigned int lights_ubo, Shader& model_shader);
+	ClipPickScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders);
+	~ClipPickScene() override;
+
+	// Skinning mode of every model, for RunRenderChecks
+	void SetSkinningMode(SkinningMode mode);
 
 private:
 	virtual void UpdateAndRenderImpl(const Input& input, float dt) override;
@@ -14,16 +20,31 @@ private:
 	struct ModelState
 	{
 		std::vector<std::string> clip_names;
+		SkeletonPose local_pose;
+		PoseCache cache; // reused as is while paused until something changes the pose
+		bool pose_dirty = true;
+		// Previous and current clip cross-fade into each other, with an optional layer on top:
+		// layer(crossfade(previous clip, current clip), layer clip)
+		BlendGraph graph;
+		BlendGraph::NodeIndex previous_clip_node, current_clip_node, crossfade_node, layer_clip_node, layer_node;
+		std::uint16_t layer_mask;
 		glm::vec3 position = { 0.0f, -1.0f, 0.0f };
 		float scale = 0.01f; // Mixamo models are using cm so converting to m
 		float axis_scale = 10.0f;
 		int current_clip = 0;
+		int layer_clip = -1; // -1 is no layer
+		int layer_mask_joint = 0;
+		float layer_weight = 1.0f;
+		bool layer_additive = false;
+		float crossfade_duration = 0.25f;
 		float clip_speed = 1.0f;
-		float clip_time = 0.0f;
 		bool paused = false;
 		bool apply_root_motion = false;
+		glm::vec2 root_offset = glm::vec2(0.0f); // accumulated root motion on the ground plane, in model units
 		bool render_skeleton = false;
 		bool render_model = true;
+		SkinningMode skinning_mode = SkinningMode::LINEAR_BLEND;
+		std::vector<glm::vec4> dual_quaternions; // two per joint, only filled in DUAL_QUATERNION mode
 	};
 
 	struct Axis
@@ -42,9 +63,34 @@ private:
 		Axis();
 	};
 
+	Shader dual_quaternion_shader{ "Shaders/anim_dq.vert", "Shaders/anim.frag", nullptr,
+		{
+			{
+				.uniform_block_name = "Matrices",
+				.uniform_block_binding = 0
+			},
+			{
+				.uniform_block_name = "Lights",
+				.uniform_block_binding = 1
+			},
+			{
+				.uniform_block_name = "Materials",
+				.uniform_block_binding = materials_block_binding
+			}
+		},
+		VertexFormatDefines()
+	};
+
 	std::vector<ModelState> model_states;
 	std::vector<std::string> model_names;
 	int current_model_idx = 0;
+	std::uint64_t last_update_allocations = 0;
+	float last_pose_evaluation_us = 0.0f;
+	// Skinning cost comparison between the modes
+	std::size_t last_palette_upload_bytes = 0;
+	unsigned int draw_time_query = 0; // GL_TIME_ELAPSED around the skinned draw, read back a frame later
+	bool draw_time_query_pending = false;
+	float last_draw_gpu_us = 0.0f;
 	static Axis& GetAxis()
 	{
 		static Axis axis;
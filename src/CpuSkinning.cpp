@@ -0,0 +1,47 @@
+#include "CpuSkinning.h"
+
+#include "AnimationKernels.h"
+#include <cassert>
+
+static_assert(sizeof(glm::mat4x3) == 12 * sizeof(float) && sizeof(glm::vec3) == 3 * sizeof(float), "Kernels treat matrices and vectors as float arrays");
+
+void SkinnedVertices::Resize(std::size_t vertex_count, bool has_tangents)
+{
+	positions.resize(vertex_count);
+	normals.resize(vertex_count);
+	tangents.resize(has_tangents ? vertex_count : 0);
+}
+
+void SkinVertices(const AnimatedModel& model, std::span<const glm::mat4x3> skinning_matrices, SkinnedVertices& out,
+	JobSystem* job_system, std::uint32_t grain_size)
+{
+	const auto& layout = model.vertex_layout;
+	assert(layout.joints_offset != 0 && "Model has no joint data");
+	assert(skinning_matrices.size() == model.skeleton.joints.size());
+	const auto vertex_count = (std::uint32_t)(model.vertices.size() / layout.size_bytes);
+	out.Resize(vertex_count, layout.tangent_offset != 0);
+
+	const SkinningBatch batch
+	{
+		.vertices = model.vertices.data(),
+		.vertex_stride = layout.size_bytes,
+		.normal_offset = layout.normal_offset,
+		.tangent_offset = layout.tangent_offset,
+		.joints_offset = layout.joints_offset,
+		.weights_offset = layout.weights_offset,
+		.palette = &skinning_matrices[0][0][0],
+		.out_positions = &out.positions[0].x,
+		.out_normals = &out.normals[0].x,
+		.out_tangents = out.tangents.empty() ? nullptr : &out.tangents[0].x,
+	};
+	const auto skin_vertices = GetAnimationKernels().skin_vertices;
+	if (!job_system)
+	{
+		skin_vertices(batch, 0, vertex_count);
+		return;
+	}
+	job_system->ParallelFor(vertex_count, grain_size, [&batch, skin_vertices](std::uint32_t begin, std::uint32_t end, unsigned int)
+	{
+		skin_vertices(batch, begin, end);
+	});
+}
@@ -0,0 +1,28 @@
+#ifndef CPU_SKINNING_H
+#define CPU_SKINNING_H
+
+#include "AnimatedModel.h"
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "JobSystem.h"
+#include <span>
+#include <vector>
+
+// Skinned vertex attributes, one element per model vertex
+struct SkinnedVertices
+{
+	std::vector<glm::vec3> positions;
+	std::vector<glm::vec3> normals;
+	std::vector<glm::vec3> tangents; // empty for models without tangents
+
+	void Resize(std::size_t vertex_count, bool has_tangents);
+};
+
+// Linear blend skinning on the CPU, the transform Shaders/anim.vert applies, for code that needs skinned vertices
+// without a GL context (picking, bounds, export, headless checks). skinning_matrices holds one matrix per joint as
+// computed by ComputeJointMatrices. Each kernel call handles several vertices per SIMD instruction; with a job
+// system the vertices are split into chunks of grain_size spread over its threads.
+void SkinVertices(const AnimatedModel& model, std::span<const glm::mat4x3> skinning_matrices, SkinnedVertices& out,
+	JobSystem* job_system = nullptr, std::uint32_t grain_size = 4096);
+
+#endif // !CPU_SKINNING_H
@@ -0,0 +1,610 @@
+#include "CrowdScene.h"
+
+#include "AllocationCounter.h"
+#include "AnimationKernels.h"
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include "CpuSkinning.h"
+#include <cstring>
+#include "imgui.h"
+#include <iostream>
+#include <numeric>
+#include <random>
+
+CrowdScene::CrowdScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders)
+    :Scene(models, lights_ubo, skinned_shaders), active_threads((int)job_system.ThreadCount())
+{
+    std::size_t max_joints = 0;
+    for (const auto& model : models)
+    {
+        max_joints = std::max(max_joints, model.skeleton.joints.size());
+    }
+    thread_scratch.resize(job_system.ThreadCount());
+    for (auto& scratch : thread_scratch)
+    {
+        scratch.Resize(max_joints);
+    }
+    thread_lod_stats.resize(job_system.ThreadCount());
+    glGenBuffers(1, &palette_buffer);
+    glGenTextures(1, &palette_texture);
+
+    BuildModelLods();
+
+    camera.position = glm::vec3(0.0f, 1.5f, 10.0f);
+    SpawnInstances(instance_count);
+}
+
+CrowdScene::~CrowdScene()
+{
+    glDeleteTextures(1, &palette_texture);
+    glDeleteBuffers(1, &palette_buffer);
+}
+
+void CrowdScene::BuildModelLods()
+{
+    model_lods.resize(models.size());
+    for (std::size_t i = 0; i < models.size(); i++)
+    {
+        const auto& skeleton = models[i].skeleton;
+        auto& model_lod = model_lods[i];
+        const auto num_joints = skeleton.joints.size();
+
+        std::vector<glm::mat4> bind_global_matrices(num_joints);
+        float min_y = 0.0f, max_y = 0.0f;
+        for (std::size_t joint = 0; joint < num_joints; joint++)
+        {
+            bind_global_matrices[joint] = glm::inverse(glm::mat4(skeleton.joints[joint].local_to_joint));
+            min_y = std::min(min_y, bind_global_matrices[joint][3].y);
+            max_y = std::max(max_y, bind_global_matrices[joint][3].y);
+        }
+        model_lod.bind_pose = ComputeLocalMatrices(bind_global_matrices, skeleton);
+        model_lod.height = max_y - min_y;
+
+        // Joints that reach only a short way, like fingers and the face, are frozen. A joint always reaches further
+        // than its children so whole subtrees get frozen together.
+        const auto tip_distances = ComputeTipDistances(skeleton);
+        model_lod.all_joints.resize(num_joints);
+        model_lod.animated_joints.clear();
+        for (std::size_t joint = 0; joint < num_joints; joint++)
+        {
+            model_lod.all_joints[joint] = (std::uint16_t)joint;
+            if (joint == 0 || tip_distances[joint] >= freeze_tip_distance * model_lod.height)
+            {
+                model_lod.animated_joints.push_back((std::uint16_t)joint);
+            }
+        }
+    }
+    std::fill(instances.lods.begin(), instances.lods.end(), 0xFF);
+}
+
+void CrowdScene::SetInstanceCount(int count)
+{
+    instance_count = count;
+    SpawnInstances(instance_count);
+}
+
+void CrowdScene::SpawnInstances(int count)
+{
+    std::vector<std::uint16_t> animated_models;
+    for (std::size_t i = 0; i < models.size(); i++)
+    {
+        if (!models[i].clips.empty()) animated_models.push_back((std::uint16_t)i);
+    }
+    if (animated_models.empty()) count = 0;
+
+    instances.positions.resize(count);
+    instances.root_offsets.assign(count, glm::vec2(0.0f));
+    instances.model_indices.resize(count);
+    instances.clip_indices.resize(count);
+    instances.clip_times.resize(count);
+    instances.clip_speeds.resize(count);
+    instances.cursors.resize(count);
+    instances.lods.assign(count, 0xFF); // evaluate everything on the first frame
+    instances.mesh_lods.assign(count, 0);
+    instances.first_matrices.resize(count);
+
+    // Fixed seed so the same instance count always gives the same crowd
+    std::mt19937 random(1234);
+    const int columns = (int)std::ceil(std::sqrt((float)count));
+    std::uint32_t num_matrices = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const auto model_index = animated_models[random() % animated_models.size()];
+        const auto& model = models[model_index];
+        const auto clip_index = (std::uint16_t)(random() % model.clips.size());
+        const auto& clip = model.clips[clip_index];
+        const float clip_duration = clip.frame_count / clip.frames_per_second;
+
+        const float x = ((i % columns) - (columns - 1) * 0.5f) * spacing;
+        const float z = -(float)(i / columns) * spacing;
+        instances.positions[i] = glm::vec3(x, -1.0f, z);
+        instances.model_indices[i] = model_index;
+        instances.clip_indices[i] = clip_index;
+        instances.clip_times[i] = clip_duration > 0.0f ? std::uniform_real_distribution<float>(0.0f, clip_duration)(random) : 0.0f;
+        instances.clip_speeds[i] = std::uniform_real_distribution<float>(0.8f, 1.2f)(random);
+        instances.cursors[i].Resize(model.skeleton.joints.size());
+        instances.cursors[i].Reset(clip);
+        instances.first_matrices[i] = num_matrices;
+        num_matrices += (std::uint32_t)model.skeleton.joints.size();
+    }
+    instances.skinning_matrices.resize(num_matrices);
+    // Every instance is evaluated on the first frame, which uploads all of it
+    instances.palette_dirty.assign(count, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, palette_buffer);
+    glBufferData(GL_TEXTURE_BUFFER, num_matrices * sizeof(glm::mat4x3), nullptr, GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, palette_buffer);
+    instance_data.reserve(count);
+
+    instances.draw_order.resize(count);
+    std::iota(instances.draw_order.begin(), instances.draw_order.end(), 0u);
+    std::sort(instances.draw_order.begin(), instances.draw_order.end(), [this](std::uint32_t a, std::uint32_t b)
+        {
+            return std::make_pair(instances.model_indices[a], instances.clip_indices[a]) < std::make_pair(instances.model_indices[b], instances.clip_indices[b]);
+        });
+}
+
+void CrowdScene::EvaluateInstances(float dt)
+{
+    // Each instance only reads shared model data and writes its own time, cursor and palette, so the results
+    // don't depend on how the instances are split between threads
+    // LODs are picked from how much of the viewport height an instance covers. projection[1][1] is the same for
+    // every aspect ratio.
+    const auto view_matrix = camera.GetViewMatrix();
+    const float projection_scale = camera.GetProjectionMatrix(1.0f)[1][1] * 0.5f;
+    for (auto& stats : thread_lod_stats)
+    {
+        stats = LodStats{};
+    }
+
+    job_system.ParallelFor((std::uint32_t)instances.size(), (std::uint32_t)instances_per_job,
+        [this, dt, &view_matrix, projection_scale](std::uint32_t begin, std::uint32_t end, unsigned int thread_index)
+        {
+            auto& scratch = thread_scratch[thread_index];
+            auto& stats = thread_lod_stats[thread_index];
+            for (auto i = begin; i < end; i++)
+            {
+                const auto model_index = instances.model_indices[i];
+                const auto& model = models[model_index];
+                const auto& model_lod = model_lods[model_index];
+                const auto& clip = model.clips[instances.clip_indices[i]];
+                const auto num_joints = model.skeleton.joints.size();
+
+                float clip_time = instances.clip_times[i];
+                const auto root_motion = AdvanceClipTime(clip, clip_time, instances.clip_speeds[i] * dt);
+                instances.clip_times[i] = clip_time;
+                if (apply_root_motion) instances.root_offsets[i] += root_motion;
+
+                const float depth = -(view_matrix * glm::vec4(WorldPosition(i), 1.0f)).z;
+                const float screen_height = depth > 0.0f ? model_lod.height * scale * projection_scale / depth : 1.0f;
+                int mesh_lod = 0;
+                if (use_mesh_lods)
+                {
+                    while (mesh_lod + 1 < AnimatedModel::max_mesh_lods && screen_height < mesh_lod_min_screen_heights[mesh_lod]) mesh_lod++;
+                }
+                instances.mesh_lods[i] = (std::uint8_t)mesh_lod;
+                if (use_baked_palettes && clip.baked_palette_texture != 0) continue;
+
+                int lod = 0;
+                if (use_lods)
+                {
+                    while (lod + 1 < num_lods && screen_height < lods[lod].min_screen_height) lod++;
+                }
+                stats.instances[lod]++;
+
+                // Instances sharing an update interval take turns so the cost is the same every frame. Moving to
+                // another LOD updates straight away.
+                const auto& settings = lods[lod];
+                if (instances.lods[i] == lod && (frame_index + i) % settings.update_interval != 0) continue;
+                instances.lods[i] = (std::uint8_t)lod;
+
+                const auto update_start = std::chrono::steady_clock::now();
+                const PoseView local_pose(std::span(scratch.local_pose.rotations).first(num_joints),
+                    std::span(scratch.local_pose.translations).first(num_joints), std::span(scratch.local_pose.scales).first(num_joints));
+                if (settings.freeze_leaf_joints)
+                {
+                    std::copy(model_lod.bind_pose.rotations.begin(), model_lod.bind_pose.rotations.end(), local_pose.rotations.begin());
+                    std::copy(model_lod.bind_pose.translations.begin(), model_lod.bind_pose.translations.end(), local_pose.translations.begin());
+                    std::copy(model_lod.bind_pose.scales.begin(), model_lod.bind_pose.scales.end(), local_pose.scales.begin());
+                    SampleClipJoints(clip, clip_time, model_lod.animated_joints, settings.nearest_key, local_pose, &instances.cursors[i]);
+                }
+                else if (settings.nearest_key)
+                {
+                    SampleClipJoints(clip, clip_time, model_lod.all_joints, true, local_pose, &instances.cursors[i]);
+                }
+                else
+                {
+                    SampleClip(clip, clip_time, local_pose, &instances.cursors[i]);
+                }
+                ComputeJointMatrices(local_pose, model.skeleton, std::span(scratch.global_matrices).first(num_joints),
+                    std::span(instances.skinning_matrices).subspan(instances.first_matrices[i], num_joints));
+                instances.palette_dirty[i] = 1;
+
+                stats.updated[lod]++;
+                stats.update_us[lod] += std::chrono::duration<float, std::micro>(std::chrono::steady_clock::now() - update_start).count();
+            }
+        });
+
+    lod_stats = LodStats{};
+    for (const auto& stats : thread_lod_stats)
+    {
+        for (int lod = 0; lod < num_lods; lod++)
+        {
+            lod_stats.instances[lod] += stats.instances[lod];
+            lod_stats.updated[lod] += stats.updated[lod];
+            lod_stats.update_us[lod] += stats.update_us[lod];
+        }
+    }
+}
+
+void CrowdScene::MeasureThreadScaling()
+{
+    static constexpr int num_runs = 16;
+    const auto thread_count = job_system.ThreadCount();
+    thread_scaling_ms.resize(thread_count);
+#ifndef NDEBUG
+    std::vector<glm::mat4x3> single_thread_matrices;
+#endif
+    for (auto num_threads = 1u; num_threads <= thread_count; num_threads++)
+    {
+        job_system.SetActiveThreadCount(num_threads);
+        EvaluateInstances(0.0f); // warm up caches
+        const auto start = std::chrono::steady_clock::now();
+        for (int run = 0; run < num_runs; run++)
+        {
+            EvaluateInstances(0.0f);
+        }
+        thread_scaling_ms[num_threads - 1] = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / num_runs;
+        std::cout << "Crowd of " << instances.size() << ": " << num_threads << " threads " << thread_scaling_ms[num_threads - 1] << " ms ("
+            << thread_scaling_ms[0] / thread_scaling_ms[num_threads - 1] << "x)\n";
+
+#ifndef NDEBUG
+        if (num_threads == 1) single_thread_matrices = instances.skinning_matrices;
+        assert(std::memcmp(single_thread_matrices.data(), instances.skinning_matrices.data(),
+            single_thread_matrices.size() * sizeof(glm::mat4x3)) == 0 && "Crowd evaluation depends on the thread count");
+#endif
+    }
+    job_system.SetActiveThreadCount(active_threads);
+}
+
+void CrowdScene::MeasureCpuSkinning()
+{
+    static constexpr int num_runs = 16;
+    SkinnedVertices skinned;
+    cpu_skinning_results.clear();
+    for (const auto& model : models)
+    {
+        if (model.clips.empty()) continue;
+        // Any pose does, the work doesn't depend on it
+        PoseScratch scratch;
+        scratch.Resize(model.skeleton.joints.size());
+        ComputeJointMatrices(model.clips[0], model.skeleton, 0.0f, scratch);
+        const auto& skinning_matrices = scratch.skinning_matrices;
+
+        CpuSkinningResult result{ model.name, model.vertices.size() / model.vertex_layout.size_bytes };
+        for (JobSystem* jobs : { (JobSystem*)nullptr, &job_system })
+        {
+            SkinVertices(model, skinning_matrices, skinned, jobs); // warm up caches
+            const auto start = std::chrono::steady_clock::now();
+            for (int run = 0; run < num_runs; run++)
+            {
+                SkinVertices(model, skinning_matrices, skinned, jobs);
+            }
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / num_runs;
+            (jobs ? result.threaded_mvps : result.single_thread_mvps) = (float)(result.vertex_count / seconds / 1e6);
+        }
+        std::cout << "CPU skinning " << model.name << ": " << result.vertex_count << " vertices, " << result.single_thread_mvps
+            << " M vertices/s on 1 thread, " << result.threaded_mvps << " M vertices/s on " << job_system.ActiveThreadCount()
+            << " threads (" << GetAnimationKernels().name << ")\n";
+        cpu_skinning_results.push_back(std::move(result));
+    }
+}
+
+void CrowdScene::UpdateAndRenderImpl(const Input& input, float dt)
+{
+    if (input.w_pressed) camera.ProcessKeyboard(CAM_FORWARD, dt);
+    if (input.a_pressed) camera.ProcessKeyboard(CAM_LEFT, dt);
+    if (input.s_pressed) camera.ProcessKeyboard(CAM_BACKWARD, dt);
+    if (input.d_pressed) camera.ProcessKeyboard(CAM_RIGHT, dt);
+    if (input.left_mouse_pressed) camera.ProcessMouseMovement(input.mouse_delta_x, input.mouse_delta_y);
+
+    {
+        ImGui::Begin("Crowd");
+
+        if (ImGui::SliderInt("Instances", &instance_count, 1, 4096))
+        {
+            SpawnInstances(instance_count);
+        }
+        if (ImGui::SliderInt("Threads", &active_threads, 1, (int)job_system.ThreadCount()))
+        {
+            job_system.SetActiveThreadCount(active_threads);
+        }
+        ImGui::SliderInt("Instances per job", &instances_per_job, 1, 64);
+        ImGui::Checkbox("Pause", &paused);
+        ImGui::Checkbox("Apply root motion", &apply_root_motion);
+        ImGui::SameLine();
+        if (ImGui::Button("Reset positions")) std::fill(instances.root_offsets.begin(), instances.root_offsets.end(), glm::vec2(0.0f));
+
+        ImGui::Checkbox("Baked palettes", &use_baked_palettes);
+        if (use_baked_palettes) ImGui::Text("%u instances played back on the GPU", last_baked_instance_count);
+        ImGui::Checkbox("Instanced draws", &use_instancing);
+        if (use_instancing) ImGui::Text("%u instanced draws", last_instanced_draw_count);
+        ImGui::Text("Draw submission: %.3f ms CPU", last_render_ms);
+        ImGui::Checkbox("Mesh LOD", &use_mesh_lods);
+        if (use_mesh_lods && ImGui::TreeNode("Mesh LOD settings"))
+        {
+            for (int lod = 0; lod + 1 < AnimatedModel::max_mesh_lods; lod++)
+            {
+                ImGui::PushID(lod);
+                ImGui::SliderFloat("Min screen height", &mesh_lod_min_screen_heights[lod], 0.0f, 1.0f);
+                ImGui::SameLine();
+                ImGui::Text("LOD %d", lod);
+                ImGui::PopID();
+            }
+            ImGui::TreePop();
+        }
+        ImGui::Text("%u triangles drawn, instances per mesh LOD: %u / %u / %u / %u", last_triangle_count, last_mesh_lod_instances[0],
+            last_mesh_lod_instances[1], last_mesh_lod_instances[2], last_mesh_lod_instances[3]);
+        ImGui::Checkbox("Animation LOD", &use_lods);
+        if (use_lods && ImGui::TreeNode("LOD settings"))
+        {
+            for (int lod = 0; lod + 1 < num_lods; lod++)
+            {
+                ImGui::PushID(lod);
+                ImGui::Text("LOD %d", lod);
+                ImGui::SliderFloat("Min screen height", &lods[lod].min_screen_height, 0.0f, 1.0f);
+                ImGui::SliderInt("Update interval", &lods[lod].update_interval, 1, 16);
+                ImGui::PopID();
+            }
+            ImGui::SliderInt("LOD 3 update interval", &lods[num_lods - 1].update_interval, 1, 16);
+            if (ImGui::SliderFloat("Freeze joints reaching under", &freeze_tip_distance, 0.0f, 0.25f, "%.2f of height"))
+            {
+                BuildModelLods();
+            }
+            ImGui::TreePop();
+        }
+        for (int lod = 0; lod < num_lods; lod++)
+        {
+            ImGui::Text("LOD %d: %u instances, %u updated, %.1f us (%.2f us per update)", lod, lod_stats.instances[lod], lod_stats.updated[lod],
+                lod_stats.update_us[lod], lod_stats.updated[lod] > 0 ? lod_stats.update_us[lod] / lod_stats.updated[lod] : 0.0f);
+        }
+
+        const auto num_instances = instances.size();
+        ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+        ImGui::Text("Animation: %.3f ms for %zu instances, %.1f M joints/s", last_evaluation_ms, num_instances,
+            last_evaluation_ms > 0.0f ? instances.skinning_matrices.size() / (last_evaluation_ms * 1000.0f) : 0.0f);
+        ImGui::Text("Palette upload: %.1f of %.1f KB in %u ranges", last_palette_upload_bytes / 1024.0f,
+            instances.skinning_matrices.size() * sizeof(glm::mat4x3) / 1024.0f, last_palette_upload_ranges);
+        ImGui::Text("Heap allocations in update: %llu", (unsigned long long)last_update_allocations);
+        const auto& queue_stats = render_queue.LastStats();
+        ImGui::Text("Render queue: %u draws, %u triangles, %u shader / %u model / %u texture changes", queue_stats.draws, queue_stats.triangles,
+            queue_stats.shader_changes, queue_stats.model_changes, queue_stats.texture_changes);
+
+        if (ImGui::Button("Measure thread scaling"))
+        {
+            MeasureThreadScaling();
+        }
+        for (std::size_t i = 0; i < thread_scaling_ms.size(); i++)
+        {
+            ImGui::Text("%zu threads: %.3f ms (%.2fx)", i + 1, thread_scaling_ms[i], thread_scaling_ms[0] / thread_scaling_ms[i]);
+        }
+        if (ImGui::Button("Measure CPU skinning"))
+        {
+            MeasureCpuSkinning();
+        }
+        for (const auto& result : cpu_skinning_results)
+        {
+            ImGui::Text("%s: %zu vertices, %.1f M vertices/s on 1 thread, %.1f M vertices/s on %d threads (%s)", result.model_name.c_str(),
+                result.vertex_count, result.single_thread_mvps, result.threaded_mvps, active_threads, GetAnimationKernels().name);
+        }
+
+        ImGui::End();
+    }
+
+    const auto allocations_before_update = HeapAllocationCount();
+
+    const auto evaluation_start = std::chrono::steady_clock::now();
+    EvaluateInstances(paused ? 0.0f : dt);
+    frame_index++;
+    last_evaluation_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - evaluation_start).count();
+
+    const auto view_matrix = camera.GetViewMatrix();
+    UploadPalettes();
+    const auto render_start = std::chrono::steady_clock::now();
+    last_instanced_draw_count = 0;
+    last_triangle_count = 0;
+    std::fill(std::begin(last_mesh_lod_instances), std::end(last_mesh_lod_instances), 0u);
+    for (auto mesh_lod : instances.mesh_lods) last_mesh_lod_instances[mesh_lod]++;
+    if (use_instancing)
+    {
+        RenderInstanced();
+    }
+    else
+    {
+        BindPaletteTexture();
+        render_queue.Begin(view_matrix);
+        const auto num_instances = instances.size();
+        for (std::size_t i = 0; i < num_instances; i++)
+        {
+            const auto& model = models[instances.model_indices[i]];
+            if (use_baked_palettes && model.clips[instances.clip_indices[i]].baked_palette_texture != 0) continue;
+            render_queue.Submit(skinned_shaders, model, WorldMatrix(i), (int)instances.first_matrices[i] * 3, model.uniform_joint_scale, instances.mesh_lods[i]);
+        }
+        render_queue.Flush();
+        last_triangle_count += render_queue.LastStats().triangles;
+    }
+
+    last_baked_instance_count = 0;
+    if (use_baked_palettes) RenderBakedInstances(view_matrix);
+    last_render_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - render_start).count();
+
+    last_update_allocations = HeapAllocationCount() - allocations_before_update;
+}
+
+glm::vec3 CrowdScene::WorldPosition(std::size_t instance) const
+{
+    const auto& root_offset = instances.root_offsets[instance];
+    return instances.positions[instance] + glm::vec3(root_offset.x, 0.0f, root_offset.y) * scale;
+}
+
+glm::mat4 CrowdScene::WorldMatrix(std::size_t instance) const
+{
+    auto world_matrix = glm::translate(glm::identity<glm::mat4>(), WorldPosition(instance));
+    return glm::scale(world_matrix, glm::vec3(scale));
+}
+
+void CrowdScene::UploadPalettes()
+{
+    // Palettes are back to back in instance order, so a run of rewritten instances goes up as one range
+    last_palette_upload_bytes = 0;
+    last_palette_upload_ranges = 0;
+    glBindBuffer(GL_TEXTURE_BUFFER, palette_buffer);
+    const auto num_instances = instances.size();
+    for (std::size_t begin = 0; begin < num_instances; )
+    {
+        if (!instances.palette_dirty[begin])
+        {
+            begin++;
+            continue;
+        }
+        auto end = begin;
+        while (end < num_instances && instances.palette_dirty[end]) instances.palette_dirty[end++] = 0;
+        const std::size_t first_matrix = instances.first_matrices[begin];
+        const std::size_t end_matrix = end < num_instances ? instances.first_matrices[end] : instances.skinning_matrices.size();
+        const auto size_bytes = (end_matrix - first_matrix) * sizeof(glm::mat4x3);
+        glBufferSubData(GL_TEXTURE_BUFFER, first_matrix * sizeof(glm::mat4x3), size_bytes, instances.skinning_matrices.data() + first_matrix);
+        last_palette_upload_bytes += size_bytes;
+        last_palette_upload_ranges++;
+        begin = end;
+    }
+}
+
+void CrowdScene::BindPaletteTexture()
+{
+    glActiveTexture(GL_TEXTURE0 + palette_texture_unit);
+    glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+}
+
+void CrowdScene::RenderInstanced()
+{
+    instanced_shader.use();
+    BindPaletteTexture();
+    instanced_shader.SetInt("skinning_palette", palette_texture_unit);
+    instanced_shader.SetInt("diffuse_maps", 0);
+    instanced_shader.SetInt("specular_maps", 1);
+    instanced_shader.SetInt("normal_maps", 2);
+
+    // draw_order groups instances by model. Each model's instances go up in one batch per mesh LOD that every mesh
+    // draws from.
+    const auto num_instances = instances.size();
+    for (std::size_t run_begin = 0; run_begin < num_instances; )
+    {
+        const auto model_index = instances.model_indices[instances.draw_order[run_begin]];
+        const auto& model = models[model_index];
+        auto run_end = run_begin;
+        while (run_end < num_instances && instances.model_indices[instances.draw_order[run_end]] == model_index) run_end++;
+
+        for (int lod = 0; lod < AnimatedModel::max_mesh_lods; lod++)
+        {
+            instance_data.clear();
+            for (auto run_index = run_begin; run_index < run_end; run_index++)
+            {
+                const auto i = instances.draw_order[run_index];
+                if (instances.mesh_lods[i] != lod) continue;
+                if (use_baked_palettes && model.clips[instances.clip_indices[i]].baked_palette_texture != 0) continue;
+                instance_data.push_back({ WorldMatrix(i), (int)instances.first_matrices[i] * 3, {} });
+            }
+            if (instance_data.empty()) continue;
+
+            const auto instance_offset = instance_stream.Upload(instance_data.data(), instance_data.size() * sizeof(SkinnedInstance), alignof(SkinnedInstance));
+            model.BindInstancedGeometry(instance_stream.Buffer(), instance_offset);
+            model.BindMaterials();
+            // Blended meshes after solid ones. Instances aren't depth sorted, see RenderQueue for single draws that are.
+            for (const bool blended : { false, true })
+            {
+                for (std::uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++)
+                {
+                    const auto& mesh = model.meshes[mesh_index];
+                    if (model.materials[mesh.material_index].HasFlag(PhongMaterialFlags::DIFFUSE_WITH_ALPHA) != blended) continue;
+                    model.BindMaterialTextures(mesh.material_index);
+                    model.SetMeshUniforms(instanced_shader, mesh_index);
+                    model.DrawMeshInstanced(mesh_index, (int)instance_data.size(), lod);
+                    last_instanced_draw_count++;
+                    last_triangle_count += model.MeshTriangleCount(mesh_index, lod) * (std::uint32_t)instance_data.size();
+                }
+            }
+        }
+        run_begin = run_end;
+    }
+}
+
+void CrowdScene::RenderBakedInstances(const glm::mat4& view_matrix)
+{
+    const auto model_matrix = glm::scale(glm::identity<glm::mat4>(), glm::vec3(scale));
+    const auto normal_matrix = glm::mat3(glm::transpose(glm::inverse(view_matrix * model_matrix)));
+    baked_shader.use();
+    baked_shader.SetMat4("model", glm::value_ptr(model_matrix));
+    baked_shader.SetMat3("normalMatrix", glm::value_ptr(normal_matrix));
+    baked_shader.SetInt("diffuse_maps", 0);
+    baked_shader.SetInt("specular_maps", 1);
+    baked_shader.SetInt("normal_maps", 2);
+    baked_shader.SetInt("baked_palettes", 3);
+
+    // Instances are drawn in runs sharing a model and clip, one instanced draw per mesh LOD and batch of the run
+    float batch_poses[max_baked_instances];
+    glm::vec3 batch_offsets[max_baked_instances];
+    const auto num_instances = instances.size();
+    for (std::size_t run_begin = 0; run_begin < num_instances; )
+    {
+        const auto first = instances.draw_order[run_begin];
+        const auto& model = models[instances.model_indices[first]];
+        const auto& clip = model.clips[instances.clip_indices[first]];
+        auto run_end = run_begin;
+        while (run_end < num_instances && instances.model_indices[instances.draw_order[run_end]] == instances.model_indices[first] &&
+            instances.clip_indices[instances.draw_order[run_end]] == instances.clip_indices[first]) run_end++;
+        const auto run_instances_begin = run_begin;
+        run_begin = run_end;
+        if (clip.baked_palette_texture == 0) continue;
+
+        model.BindGeometry();
+        model.BindMaterials();
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, clip.baked_palette_texture);
+        baked_shader.SetInt("baked_pose_count", (int)clip.pose_count);
+
+        for (int lod = 0; lod < AnimatedModel::max_mesh_lods; lod++)
+        {
+            for (auto run_index = run_instances_begin; run_index < run_end; )
+            {
+                int batch_size = 0;
+                for (; run_index < run_end && batch_size < max_baked_instances; run_index++)
+                {
+                    const auto i = instances.draw_order[run_index];
+                    if (instances.mesh_lods[i] != lod) continue;
+                    batch_poses[batch_size] = instances.clip_times[i] * clip.frames_per_second;
+                    batch_offsets[batch_size] = WorldPosition(i);
+                    batch_size++;
+                }
+                if (batch_size == 0) continue;
+
+                baked_shader.SetFloatArray("baked_poses", batch_poses, batch_size);
+                baked_shader.SetVec3Array("instance_offsets", &batch_offsets[0].x, batch_size);
+                // Blended meshes after solid ones, as in RenderInstanced
+                for (const bool blended : { false, true })
+                {
+                    for (std::uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++)
+                    {
+                        const auto& mesh = model.meshes[mesh_index];
+                        if (model.materials[mesh.material_index].HasFlag(PhongMaterialFlags::DIFFUSE_WITH_ALPHA) != blended) continue;
+                        model.BindMaterialTextures(mesh.material_index);
+                        model.SetMeshUniforms(baked_shader, mesh_index);
+                        model.DrawMeshInstanced(mesh_index, batch_size, lod);
+                        last_triangle_count += model.MeshTriangleCount(mesh_index, lod) * (std::uint32_t)batch_size;
+                    }
+                }
+                last_baked_instance_count += batch_size;
+            }
+        }
+    }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "Scene.h"
+
+#include <cstdint>
+#include "JobSystem.h"
+#include <vector>
+
+// Grid of many animated instances for previewing crowds. Every instance is sampled and posed in parallel on the
+// job system, a range of instances per job.
+class CrowdScene : public Scene
+{
+public:
+	CrowdScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders);
+	~CrowdScene() override;
+
+	// For RunRenderChecks, same as the UI
+	void SetInstanceCount(int count);
+	void SetInstancing(bool enabled) { use_instancing = enabled; }
+	void SetBakedPalettes(bool enabled) { use_baked_palettes = enabled; }
+	void SetAnimationLods(bool enabled) { use_lods = enabled; } // off evaluates every instance at LOD 0 every frame
+
+private:
+	virtual void UpdateAndRenderImpl(const Input& input, float dt) override;
+
+	void BuildModelLods();
+	void SpawnInstances(int count);
+	void EvaluateInstances(float dt);
+	void MeasureThreadScaling();
+	void MeasureCpuSkinning();
+	void RenderBakedInstances(const glm::mat4& view_matrix);
+	void UploadPalettes();
+	void BindPaletteTexture();
+	void RenderInstanced();
+	glm::vec3 WorldPosition(std::size_t instance) const;
+	glm::mat4 WorldMatrix(std::size_t instance) const;
+
+	// One element per instance in every array, so evaluation only pulls the data it reads into cache
+	struct Instances
+	{
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec2> root_offsets; // accumulated root motion on the ground plane, in model units
+		std::vector<std::uint16_t> model_indices;
+		std::vector<std::uint16_t> clip_indices;
+		std::vector<float> clip_times;
+		std::vector<float> clip_speeds;
+		std::vector<ClipCursor> cursors;
+		std::vector<std::uint8_t> lods; // LOD the palette was last evaluated at
+		std::vector<std::uint8_t> mesh_lods; // mesh LOD drawn this frame
+		std::vector<std::uint32_t> first_matrices; // offset of the instance's palette in skinning_matrices
+		std::vector<glm::mat4x3> skinning_matrices;
+		std::vector<std::uint8_t> palette_dirty; // palette rewritten since UploadPalettes last ran
+		std::vector<std::uint32_t> draw_order; // instance indices sorted by model and clip, for batching baked draws
+
+		std::size_t size() const { return positions.size(); }
+	};
+
+	static constexpr int num_lods = 4;
+	struct AnimationLod
+	{
+		float min_screen_height; // fraction of the viewport height the instance has to cover
+		int update_interval;     // frames between pose updates, instances are spread over the frames
+		bool freeze_leaf_joints;
+		bool nearest_key;
+	};
+	AnimationLod lods[num_lods] =
+	{
+		{ 0.25f, 1, false, false },
+		{ 0.1f, 2, true, false },
+		{ 0.04f, 4, true, true },
+		{ 0.0f, 8, true, true },
+	};
+
+	// Mesh LOD n + 1 is drawn for instances covering less than mesh_lod_min_screen_heights[n] of the viewport height
+	float mesh_lod_min_screen_heights[AnimatedModel::max_mesh_lods - 1] = { 0.2f, 0.1f, 0.05f };
+
+	struct ModelLod
+	{
+		SkeletonPose bind_pose; // frozen joints are left at their bind pose
+		std::vector<std::uint16_t> all_joints;
+		std::vector<std::uint16_t> animated_joints; // joints still sampled when leaf joints are frozen
+		float height; // bind pose height in model units
+	};
+
+	// Per-thread so jobs don't share cache lines
+	struct alignas(64) LodStats
+	{
+		std::uint32_t instances[num_lods];
+		std::uint32_t updated[num_lods];
+		float update_us[num_lods];
+	};
+
+	// Must match MAX_BAKED_INSTANCES in anim_baked.vert
+	static constexpr int max_baked_instances = 64;
+	Shader baked_shader{ "Shaders/anim_baked.vert", "Shaders/anim.frag", nullptr,
+		{
+			{
+				.uniform_block_name = "Matrices",
+				.uniform_block_binding = 0
+			},
+			{
+				.uniform_block_name = "Lights",
+				.uniform_block_binding = 1
+			},
+			{
+				.uniform_block_name = "Materials",
+				.uniform_block_binding = materials_block_binding
+			}
+		},
+		VertexFormatDefines()
+	};
+
+	Shader instanced_shader{ "Shaders/anim_instanced.vert", "Shaders/anim.frag", nullptr,
+		{
+			{
+				.uniform_block_name = "Matrices",
+				.uniform_block_binding = 0
+			},
+			{
+				.uniform_block_name = "Lights",
+				.uniform_block_binding = 1
+			},
+			{
+				.uniform_block_name = "Materials",
+				.uniform_block_binding = materials_block_binding
+			}
+		},
+		VertexFormatDefines()
+	};
+	std::vector<SkinnedInstance> instance_data; // one model's instances, rebuilt for every instanced batch
+
+	// Palettes stay in palette_buffer across frames at the same offsets as in skinning_matrices, rather than going
+	// through palette_stream, and only the ones EvaluateInstances rewrote are uploaded. Instances at the lower
+	// animation LODs update every few frames, so most palettes are unchanged on any one frame.
+	unsigned int palette_buffer = 0;
+	unsigned int palette_texture = 0; // GL_RGBA32F buffer texture over palette_buffer
+	std::size_t last_palette_upload_bytes = 0;
+	std::uint32_t last_palette_upload_ranges = 0;
+
+	JobSystem job_system;
+	std::vector<PoseScratch> thread_scratch; // local pose and global matrices are only needed while evaluating
+	Instances instances;
+	std::vector<ModelLod> model_lods;
+	std::vector<LodStats> thread_lod_stats;
+	LodStats lod_stats{}; // summed over threads for the last frame
+	std::uint32_t frame_index = 0;
+	bool use_lods = true;
+	bool use_mesh_lods = true;
+	float freeze_tip_distance = 0.06f; // joints reaching less than this fraction of the height are frozen
+	int instance_count = 256;
+	int instances_per_job = 8;
+	int active_threads;
+	float spacing = 1.5f;
+	float scale = 0.01f; // Mixamo models are using cm so converting to m
+	bool paused = false;
+	bool apply_root_motion = false;
+	bool use_baked_palettes = false; // instances playing baked clips skip CPU sampling
+	bool use_instancing = true; // one draw per mesh for all instances of a model instead of one per instance
+	std::uint32_t last_baked_instance_count = 0;
+	std::uint32_t last_instanced_draw_count = 0;
+	std::uint32_t last_triangle_count = 0; // drawn by the crowd last frame, over all instances
+	std::uint32_t last_mesh_lod_instances[AnimatedModel::max_mesh_lods] = {};
+
+	float last_evaluation_ms = 0.0f;
+	float last_render_ms = 0.0f; // CPU time spent issuing draws
+	std::vector<float> thread_scaling_ms; // evaluation time with 1 to N threads from the last measurement
+	struct CpuSkinningResult
+	{
+		std::string model_name;
+		std::size_t vertex_count;
+		float single_thread_mvps = 0.0f; // millions of vertices skinned per second
+		float threaded_mvps = 0.0f;
+	};
+	std::vector<CpuSkinningResult> cpu_skinning_results;
+	std::uint64_t last_update_allocations = 0;
+};
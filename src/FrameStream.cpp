@@ -0,0 +1,87 @@
+#include "FrameStream.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+// Regions start on this boundary so any alignment up to it holds for offsets into the whole buffer
+static constexpr std::size_t region_alignment = 256;
+
+static std::size_t AlignUp(std::size_t value, std::size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+FrameStream::FrameStream(GLenum target, std::size_t frame_capacity_bytes)
+	: target(target)
+{
+	glGenBuffers(1, &buffer);
+	Allocate(frame_capacity_bytes);
+}
+
+FrameStream::~FrameStream()
+{
+	for (auto& fence : fences)
+	{
+		if (fence) glDeleteSync(fence);
+	}
+	glDeleteBuffers(1, &buffer);
+}
+
+void FrameStream::Allocate(std::size_t frame_capacity_bytes)
+{
+	frame_capacity = AlignUp(frame_capacity_bytes, region_alignment);
+	glBindBuffer(target, buffer);
+	glBufferData(target, frame_capacity * frames_in_flight, nullptr, GL_STREAM_DRAW);
+}
+
+void FrameStream::BeginFrame()
+{
+	auto& fence = fences[frame_index];
+	if (fence)
+	{
+		// Usually signaled long ago, only wait when the GPU is frames_in_flight frames behind
+		if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		{
+			fence_waits++;
+			while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000'000) == GL_TIMEOUT_EXPIRED) {}
+		}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+	frame_used = 0;
+}
+
+void FrameStream::EndFrame()
+{
+	fences[frame_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	frame_index = (frame_index + 1) % frames_in_flight;
+	last_frame_bytes = frame_used;
+}
+
+std::size_t FrameStream::Upload(const void* data, std::size_t size_bytes, std::size_t alignment)
+{
+	assert(alignment <= region_alignment);
+	auto offset = AlignUp(frame_used, alignment);
+	if (size_bytes == 0) return frame_index * frame_capacity + std::min(offset, frame_capacity);
+	if (offset + size_bytes > frame_capacity)
+	{
+		// Everything in flight has to finish before the storage is replaced, the new storage starts out unused
+		glFinish();
+		for (auto& fence : fences)
+		{
+			if (fence) glDeleteSync(fence);
+			fence = nullptr;
+		}
+		Allocate(std::max(frame_capacity * 2, offset + size_bytes));
+		offset = 0;
+	}
+
+	const auto buffer_offset = frame_index * frame_capacity + offset;
+	glBindBuffer(target, buffer);
+	void* mapped = glMapBufferRange(target, buffer_offset, size_bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	std::memcpy(mapped, data, size_bytes);
+	glUnmapBuffer(target);
+	frame_used = offset + size_bytes;
+	return buffer_offset;
+}
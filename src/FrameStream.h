@@ -0,0 +1,50 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <glad/glad.h>
+
+#include <cstddef>
+#include <cstdint>
+
+// Ring of per-frame regions in one GL buffer for data that is rewritten every frame (camera matrices, skinning
+// palettes). Each frame writes into its own region with unsynchronized maps, so the driver never has to wait for
+// or copy the buffer, and a fence per region makes BeginFrame wait in the rare case the GPU is still reading the
+// region from frames_in_flight frames ago.
+//
+// The buffer grows when a frame uploads more than its region holds. Growing waits for the GPU once and re-specifies
+// the storage of the same buffer object with glBufferData, which discards its contents, so data uploaded earlier in
+// the frame is lost and its offsets point into the new layout; upload everything a draw needs before binding it.
+class FrameStream
+{
+public:
+	static constexpr int frames_in_flight = 3;
+
+	FrameStream(GLenum target, std::size_t frame_capacity_bytes);
+	~FrameStream();
+	FrameStream(const FrameStream&) = delete;
+	FrameStream& operator=(const FrameStream&) = delete;
+
+	void BeginFrame();
+	void EndFrame();
+	// Copies size_bytes into this frame's region at a multiple of alignment, returns the offset into Buffer()
+	std::size_t Upload(const void* data, std::size_t size_bytes, std::size_t alignment);
+
+	unsigned int Buffer() const { return buffer; }
+	std::size_t FrameCapacity() const { return frame_capacity; }
+	std::size_t LastFrameBytes() const { return last_frame_bytes; }
+	std::uint32_t FenceWaitCount() const { return fence_waits; } // frames that had to wait for the GPU
+
+private:
+	void Allocate(std::size_t frame_capacity_bytes);
+
+	GLenum target;
+	unsigned int buffer = 0;
+	std::size_t frame_capacity = 0;
+	std::size_t frame_used = 0;
+	std::size_t last_frame_bytes = 0;
+	int frame_index = 0;
+	GLsync fences[frames_in_flight] = {};
+	std::uint32_t fence_waits = 0;
+};
+
+#endif // !FRAME_STREAM_H
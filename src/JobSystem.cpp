@@ -0,0 +1,141 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <cassert>
+
+JobSystem::JobSystem(unsigned int thread_count)
+{
+	if (thread_count == 0) thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	queues.reserve(thread_count);
+	for (auto i = 0u; i < thread_count; i++)
+	{
+		queues.push_back(std::make_unique<WorkQueue>());
+	}
+	active_thread_count.store(thread_count, std::memory_order_relaxed);
+
+	workers.reserve(thread_count - 1);
+	for (auto i = 1u; i < thread_count; i++)
+	{
+		workers.emplace_back(&JobSystem::WorkerLoop, this, i);
+	}
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard lock(wake_mutex);
+		quit = true;
+	}
+	wake_condition.notify_all();
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+}
+
+void JobSystem::SetActiveThreadCount(unsigned int count)
+{
+	active_thread_count.store(std::clamp(count, 1u, ThreadCount()), std::memory_order_relaxed);
+}
+
+bool JobSystem::WorkQueue::Push(const Job& job)
+{
+	std::lock_guard lock(mutex);
+	if (back - front == capacity) return false;
+	jobs[back % capacity] = job;
+	back++;
+	return true;
+}
+
+bool JobSystem::WorkQueue::Pop(Job& out_job)
+{
+	std::lock_guard lock(mutex);
+	if (back == front) return false;
+	back--;
+	out_job = jobs[back % capacity];
+	return true;
+}
+
+bool JobSystem::WorkQueue::Steal(Job& out_job)
+{
+	std::lock_guard lock(mutex);
+	if (back == front) return false;
+	out_job = jobs[front % capacity];
+	front++;
+	return true;
+}
+
+void JobSystem::Run(std::uint32_t count, std::uint32_t grain_size, JobFunction function, const void* context)
+{
+	if (count == 0) return;
+	assert(grain_size > 0);
+	assert(pending_jobs.load() == 0 && "ParallelFor isn't reentrant");
+
+	const auto num_threads = ActiveThreadCount();
+	const auto num_jobs = (count + grain_size - 1) / grain_size;
+	pending_jobs.store(num_jobs, std::memory_order_relaxed);
+
+	// Deal ranges out round robin so every queue starts with a similar share, stealing evens out the rest
+	for (auto job_index = 0u; job_index < num_jobs; job_index++)
+	{
+		const auto begin = job_index * grain_size;
+		const Job job{ function, context, begin, std::min(begin + grain_size, count) };
+		if (!queues[job_index % num_threads]->Push(job))
+		{
+			// Queue is full, the grain size is very small for this count
+			function(context, job.begin, job.end, 0);
+			pending_jobs.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+
+	if (num_threads > 1)
+	{
+		{
+			std::lock_guard lock(wake_mutex);
+			batch_index++;
+		}
+		wake_condition.notify_all();
+	}
+
+	while (pending_jobs.load(std::memory_order_acquire) > 0)
+	{
+		if (!ExecuteJob(0)) std::this_thread::yield();
+	}
+}
+
+bool JobSystem::ExecuteJob(unsigned int thread_index)
+{
+	Job job;
+	bool found = queues[thread_index]->Pop(job);
+	const auto num_threads = ActiveThreadCount();
+	for (auto i = 1u; i < num_threads && !found; i++)
+	{
+		found = queues[(thread_index + i) % num_threads]->Steal(job);
+	}
+	if (!found) return false;
+
+	job.function(job.context, job.begin, job.end, thread_index);
+	// Release so the thread waiting for pending_jobs to reach 0 sees everything the job wrote
+	pending_jobs.fetch_sub(1, std::memory_order_release);
+	return true;
+}
+
+void JobSystem::WorkerLoop(unsigned int thread_index)
+{
+	std::uint64_t last_batch_index = 0;
+	while (true)
+	{
+		{
+			std::unique_lock lock(wake_mutex);
+			wake_condition.wait(lock, [&]() { return quit || batch_index != last_batch_index; });
+			if (quit) return;
+			last_batch_index = batch_index;
+		}
+
+		if (thread_index >= ActiveThreadCount()) continue;
+		while (pending_jobs.load(std::memory_order_acquire) > 0)
+		{
+			if (!ExecuteJob(thread_index)) std::this_thread::yield();
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Fixed pool of worker threads for data parallel loops. Every thread owns a queue of jobs: it takes jobs from the
+// back of its own queue and steals from the front of the others once it runs dry, so uneven jobs still spread
+// over all cores. The calling thread works as thread 0 until the whole loop is done.
+//
+// ParallelFor only returns once every job has run. It is meant to be called from one thread at a time and not
+// from inside a job.
+class JobSystem
+{
+public:
+	// thread_count includes the calling thread, 0 uses one thread per hardware thread
+	explicit JobSystem(unsigned int thread_count = 0);
+	~JobSystem();
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	unsigned int ThreadCount() const { return (unsigned int)queues.size(); }
+	// Number of threads ParallelFor spreads jobs over, between 1 and ThreadCount(). Lets the caller measure how
+	// work scales without recreating the pool.
+	unsigned int ActiveThreadCount() const { return active_thread_count.load(std::memory_order_relaxed); }
+	void SetActiveThreadCount(unsigned int count);
+
+	// Calls fn(begin, end, thread_index) for consecutive ranges of at most grain_size items covering [0, count).
+	// thread_index is below ThreadCount() and can be used to pick per-thread scratch memory. Doesn't allocate.
+	template<typename Fn>
+	void ParallelFor(std::uint32_t count, std::uint32_t grain_size, const Fn& fn)
+	{
+		Run(count, grain_size, [](const void* context, std::uint32_t begin, std::uint32_t end, unsigned int thread_index)
+		{
+			(*(const Fn*)context)(begin, end, thread_index);
+		}, &fn);
+	}
+
+private:
+	using JobFunction = void (*)(const void* context, std::uint32_t begin, std::uint32_t end, unsigned int thread_index);
+
+	struct Job
+	{
+		JobFunction function;
+		const void* context;
+		std::uint32_t begin, end;
+	};
+
+	// Ring buffer of jobs. The owner pushes and pops at the back, thieves take from the front.
+	struct WorkQueue
+	{
+		static constexpr std::uint32_t capacity = 1024;
+
+		std::mutex mutex;
+		Job jobs[capacity];
+		std::uint32_t front = 0, back = 0; // back - front jobs are queued
+
+		bool Push(const Job& job);
+		bool Pop(Job& out_job);
+		bool Steal(Job& out_job);
+	};
+
+	void Run(std::uint32_t count, std::uint32_t grain_size, JobFunction function, const void* context);
+	bool ExecuteJob(unsigned int thread_index);
+	void WorkerLoop(unsigned int thread_index);
+
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<unsigned int> active_thread_count;
+	std::atomic<std::uint32_t> pending_jobs{ 0 };
+
+	std::mutex wake_mutex;
+	std::condition_variable wake_condition;
+	std::uint64_t batch_index = 0; // bumped every ParallelFor to wake the workers
+	bool quit = false;
+};
+
+#endif // !JOB_SYSTEM_H
@@ -0,0 +1,61 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+	file_handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+	{
+		file_handle = nullptr;
+		return;
+	}
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) return;
+	// PAGE_WRITECOPY and FILE_MAP_COPY make the view copy-on-write
+	mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+	if (mapping_handle == nullptr) return;
+	data = (std::uint8_t*)MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+	if (data != nullptr) size = (std::size_t)file_size.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data != nullptr) UnmapViewOfFile(data);
+	if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+	if (file_handle != nullptr) CloseHandle(file_handle);
+}
+#else
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+	{
+		void* mapping = mmap(nullptr, (std::size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (mapping != MAP_FAILED)
+		{
+			data = (std::uint8_t*)mapping;
+			size = (std::size_t)file_stat.st_size;
+		}
+	}
+	// The mapping keeps the file referenced
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (data != nullptr) munmap(data, size);
+}
+#endif
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+
+// A whole file mapped into memory. Pages are read in from the page cache as they're first touched, so data used
+// straight from the mapping is never copied into a staging buffer. The mapping is copy-on-write: writes through
+// Data() stay private to the process and never reach the file.
+class MappedFile
+{
+public:
+	// Empty if the file can't be opened or mapped, check with IsOpen
+	explicit MappedFile(const std::filesystem::path& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool IsOpen() const { return data != nullptr; }
+	std::span<std::uint8_t> Data() const { return { data, size }; }
+
+private:
+	std::uint8_t* data = nullptr; // page aligned
+	std::size_t size = 0;
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#endif
+};
+
+#endif // !MAPPED_FILE_H
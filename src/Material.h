@@ -41,9 +41,11 @@ struct PhongMaterial
 	float shininess;
     PhongMaterialFlags flags = PhongMaterialFlags::DEFAULT;
 
-	Texture diffuse_map;
-	Texture specular_map;
-	Texture normal_map;
+	// Where the maps were packed in AnimatedModel::texture_arrays
+	TextureArrayLayer diffuse_map;
+	TextureArrayLayer specular_map;
+	TextureArrayLayer normal_map;
+	std::uint16_t texture_set = 0; // materials sampling the same three arrays share a set
 
     inline bool HasFlag(PhongMaterialFlags flag) const
     {
@@ -0,0 +1,494 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <glm/glm.hpp>
+#include <limits>
+#include <numeric>
+
+static constexpr std::uint32_t no_vertex = std::numeric_limits<std::uint32_t>::max();
+
+VertexCacheStats AnalyzeVertexCache(std::span<const std::uint32_t> indices, std::size_t vertex_count, std::uint32_t cache_size)
+{
+	VertexCacheStats stats;
+	if (indices.empty()) return stats;
+
+	// A vertex is in the FIFO if fewer than cache_size misses happened since it was last transformed
+	std::vector<std::uint32_t> miss_time(vertex_count, 0);
+	std::uint32_t time = cache_size + 1;
+	std::uint32_t transformed = 0;
+	for (auto index : indices)
+	{
+		if (time - miss_time[index] > cache_size)
+		{
+			miss_time[index] = time++;
+			transformed++;
+		}
+	}
+	std::vector<bool> referenced(vertex_count, false);
+	std::uint32_t unique_vertices = 0;
+	for (auto index : indices)
+	{
+		if (!referenced[index]) unique_vertices++;
+		referenced[index] = true;
+	}
+	stats.acmr = (float)transformed / (float)(indices.size() / 3);
+	stats.atvr = (float)transformed / (float)unique_vertices;
+	return stats;
+}
+
+std::size_t WeldVertices(std::vector<std::uint8_t>& vertices, std::size_t vertex_size, std::span<std::uint32_t> indices)
+{
+	const auto vertex_count = vertices.size() / vertex_size;
+	auto Vertex = [&](std::uint32_t vertex) { return vertices.data() + vertex * vertex_size; };
+	std::vector<std::uint32_t> order(vertex_count);
+	std::iota(order.begin(), order.end(), 0u);
+	std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) { return std::memcmp(Vertex(a), Vertex(b), vertex_size) < 0; });
+
+	// Every vertex first points at the lowest numbered copy of itself, which is the first of its run after the stable sort
+	std::vector<std::uint32_t> remap(vertex_count);
+	for (std::size_t i = 0; i < vertex_count; i++)
+	{
+		const bool same_as_previous = i > 0 && std::memcmp(Vertex(order[i - 1]), Vertex(order[i]), vertex_size) == 0;
+		remap[order[i]] = same_as_previous ? remap[order[i - 1]] : order[i];
+	}
+	std::uint32_t welded_count = 0;
+	for (std::uint32_t vertex = 0; vertex < vertex_count; vertex++)
+	{
+		if (remap[vertex] != vertex)
+		{
+			remap[vertex] = remap[remap[vertex]];
+			continue;
+		}
+		std::memmove(Vertex(welded_count), Vertex(vertex), vertex_size);
+		remap[vertex] = welded_count++;
+	}
+	for (auto& index : indices)
+	{
+		index = remap[index];
+	}
+	vertices.resize(welded_count * vertex_size);
+	return welded_count;
+}
+
+// Scoring from Forsyth's article, tuned for caches of 16 to 32 entries
+static constexpr int forsyth_cache_size = 32;
+
+static float ForsythVertexScore(int cache_position, std::uint32_t remaining_triangles)
+{
+	if (remaining_triangles == 0) return -1.0f;
+	float score = 0.0f;
+	if (cache_position >= 0)
+	{
+		// The last triangle's vertices get a fixed score so its neighbours don't win just by sharing an edge with it
+		score = cache_position < 3 ? 0.75f : std::pow(1.0f - (float)(cache_position - 3) / (forsyth_cache_size - 3), 1.5f);
+	}
+	// Vertices with few triangles left are finished off first so they can leave the cache
+	return score + 2.0f * std::pow((float)remaining_triangles, -0.5f);
+}
+
+void OptimizeVertexCache(std::span<std::uint32_t> indices, std::size_t vertex_count)
+{
+	const auto triangle_count = indices.size() / 3;
+	if (triangle_count == 0) return;
+
+	// Triangles using each vertex, the first remaining[vertex] entries of its list are the ones not drawn yet
+	std::vector<std::uint32_t> remaining(vertex_count, 0);
+	for (auto index : indices) remaining[index]++;
+	std::vector<std::uint32_t> adjacency_offsets(vertex_count + 1, 0);
+	for (std::size_t vertex = 0; vertex < vertex_count; vertex++)
+	{
+		adjacency_offsets[vertex + 1] = adjacency_offsets[vertex] + remaining[vertex];
+	}
+	std::vector<std::uint32_t> adjacency(indices.size());
+	{
+		std::vector<std::uint32_t> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+		for (std::size_t i = 0; i < indices.size(); i++)
+		{
+			adjacency[fill[indices[i]]++] = (std::uint32_t)(i / 3);
+		}
+	}
+
+	std::vector<int> cache_positions(vertex_count, -1);
+	std::vector<float> vertex_scores(vertex_count);
+	for (std::size_t vertex = 0; vertex < vertex_count; vertex++)
+	{
+		vertex_scores[vertex] = ForsythVertexScore(-1, remaining[vertex]);
+	}
+	auto TriangleScore = [&](std::uint32_t triangle)
+	{
+		const auto* vertices = &indices[triangle * 3];
+		return vertex_scores[vertices[0]] + vertex_scores[vertices[1]] + vertex_scores[vertices[2]];
+	};
+	std::vector<bool> emitted(triangle_count, false);
+	std::uint32_t best_triangle = 0;
+	for (std::uint32_t triangle = 1; triangle < triangle_count; triangle++)
+	{
+		if (TriangleScore(triangle) > TriangleScore(best_triangle)) best_triangle = triangle;
+	}
+
+	std::vector<std::uint32_t> output;
+	output.reserve(indices.size());
+	std::vector<std::uint32_t> cache, new_cache;
+	cache.reserve(forsyth_cache_size + 3);
+	new_cache.reserve(forsyth_cache_size + 3);
+	std::uint32_t scan_cursor = 0; // no triangle before it is left, for restarting when nothing in the cache is
+	while (output.size() < indices.size())
+	{
+		if (best_triangle == no_vertex)
+		{
+			// Nothing in the cache has triangles left, continue with the next triangle in the original order
+			while (emitted[scan_cursor]) scan_cursor++;
+			best_triangle = scan_cursor;
+		}
+		const std::uint32_t triangle_vertices[3] = { indices[best_triangle * 3], indices[best_triangle * 3 + 1], indices[best_triangle * 3 + 2] };
+		output.insert(output.end(), triangle_vertices, triangle_vertices + 3);
+		emitted[best_triangle] = true;
+
+		// Degenerate triangles name a vertex twice, it only takes one slot
+		new_cache.clear();
+		for (auto vertex : triangle_vertices)
+		{
+			if (std::find(new_cache.begin(), new_cache.end(), vertex) == new_cache.end()) new_cache.push_back(vertex);
+		}
+		for (auto vertex : triangle_vertices)
+		{
+			auto list = &adjacency[adjacency_offsets[vertex]];
+			auto position = std::find(list, list + remaining[vertex], best_triangle);
+			assert(position != list + remaining[vertex]);
+			std::swap(*position, list[remaining[vertex] - 1]);
+			remaining[vertex]--;
+		}
+		for (auto vertex : cache)
+		{
+			if (std::find(triangle_vertices, triangle_vertices + 3, vertex) == triangle_vertices + 3) new_cache.push_back(vertex);
+		}
+
+		for (std::size_t i = 0; i < new_cache.size(); i++)
+		{
+			const auto vertex = new_cache[i];
+			cache_positions[vertex] = i < forsyth_cache_size ? (int)i : -1;
+			vertex_scores[vertex] = ForsythVertexScore(cache_positions[vertex], remaining[vertex]);
+		}
+		// Only triangles of vertices whose score changed can have a new score, the best of them goes next
+		best_triangle = no_vertex;
+		float best_score = -1.0f;
+		for (auto vertex : new_cache)
+		{
+			const auto list = &adjacency[adjacency_offsets[vertex]];
+			for (std::uint32_t i = 0; i < remaining[vertex]; i++)
+			{
+				const auto triangle = list[i];
+				const auto score = TriangleScore(triangle);
+				if (score > best_score)
+				{
+					best_score = score;
+					best_triangle = triangle;
+				}
+			}
+		}
+		if (new_cache.size() > forsyth_cache_size) new_cache.resize(forsyth_cache_size);
+		std::swap(cache, new_cache);
+	}
+	std::copy(output.begin(), output.end(), indices.begin());
+}
+
+void OptimizeOverdraw(std::span<std::uint32_t> indices, std::span<const std::uint8_t> vertices, std::size_t vertex_size)
+{
+	const auto triangle_count = indices.size() / 3;
+	if (triangle_count == 0) return;
+	const auto vertex_count = vertices.size() / vertex_size;
+	auto Position = [&](std::uint32_t vertex)
+	{
+		glm::vec3 position;
+		std::memcpy(&position, vertices.data() + vertex * vertex_size, sizeof(position));
+		return position;
+	};
+
+	// Same FIFO as AnalyzeVertexCache, a cluster starts where the cache has none of the triangle's vertices
+	constexpr std::uint32_t cache_size = 16;
+	std::vector<std::uint32_t> miss_time(vertex_count, 0);
+	std::uint32_t time = cache_size + 1;
+	std::vector<std::uint32_t> cluster_starts;
+	for (std::uint32_t triangle = 0; triangle < triangle_count; triangle++)
+	{
+		int misses = 0;
+		for (int corner = 0; corner < 3; corner++)
+		{
+			const auto vertex = indices[triangle * 3 + corner];
+			if (time - miss_time[vertex] > cache_size)
+			{
+				miss_time[vertex] = time++;
+				misses++;
+			}
+		}
+		if (triangle == 0 || misses == 3) cluster_starts.push_back(triangle);
+	}
+	cluster_starts.push_back((std::uint32_t)triangle_count);
+	const auto cluster_count = cluster_starts.size() - 1;
+	if (cluster_count < 2) return;
+
+	// Area weighted centroid and normal of each cluster
+	struct Cluster
+	{
+		glm::vec3 centroid{ 0.0f };
+		glm::vec3 normal{ 0.0f };
+		float area = 0.0f;
+		float sort_key = 0.0f;
+		std::uint32_t first_triangle, end_triangle;
+	};
+	std::vector<Cluster> clusters(cluster_count);
+	glm::vec3 mesh_centroid(0.0f);
+	float mesh_area = 0.0f;
+	for (std::size_t i = 0; i < cluster_count; i++)
+	{
+		auto& cluster = clusters[i];
+		cluster.first_triangle = cluster_starts[i];
+		cluster.end_triangle = cluster_starts[i + 1];
+		for (auto triangle = cluster.first_triangle; triangle < cluster.end_triangle; triangle++)
+		{
+			const auto a = Position(indices[triangle * 3]), b = Position(indices[triangle * 3 + 1]), c = Position(indices[triangle * 3 + 2]);
+			const auto normal = glm::cross(b - a, c - a);
+			const auto area = glm::length(normal);
+			cluster.centroid += (a + b + c) * (area / 3.0f);
+			cluster.normal += normal;
+			cluster.area += area;
+		}
+		mesh_centroid += cluster.centroid;
+		mesh_area += cluster.area;
+		if (cluster.area > 0.0f) cluster.centroid /= cluster.area;
+	}
+	if (mesh_area > 0.0f) mesh_centroid /= mesh_area;
+	for (auto& cluster : clusters)
+	{
+		const auto normal_length = glm::length(cluster.normal);
+		cluster.sort_key = normal_length > 0.0f ? glm::dot(cluster.centroid - mesh_centroid, cluster.normal / normal_length) : 0.0f;
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) { return a.sort_key > b.sort_key; });
+
+	std::vector<std::uint32_t> output;
+	output.reserve(indices.size());
+	for (const auto& cluster : clusters)
+	{
+		output.insert(output.end(), indices.begin() + cluster.first_triangle * 3, indices.begin() + cluster.end_triangle * 3);
+	}
+	std::copy(output.begin(), output.end(), indices.begin());
+}
+
+// Sum of squared distances to a set of planes, the upper triangle of the symmetric 4x4 matrix
+struct Quadric
+{
+	double a2 = 0.0, ab = 0.0, ac = 0.0, ad = 0.0;
+	double b2 = 0.0, bc = 0.0, bd = 0.0;
+	double c2 = 0.0, cd = 0.0;
+	double d2 = 0.0;
+
+	static Quadric FromPlane(glm::vec3 normal, float d, float weight)
+	{
+		const double a = normal.x, b = normal.y, c = normal.z;
+		return { weight * a * a, weight * a * b, weight * a * c, weight * a * d, weight * b * b, weight * b * c, weight * b * d,
+			weight * c * c, weight * c * d, weight * (double)d * d };
+	}
+
+	Quadric& operator+=(const Quadric& other)
+	{
+		a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+		b2 += other.b2; bc += other.bc; bd += other.bd;
+		c2 += other.c2; cd += other.cd;
+		d2 += other.d2;
+		return *this;
+	}
+
+	double Error(glm::vec3 p) const
+	{
+		const double x = p.x, y = p.y, z = p.z;
+		return a2 * x * x + 2.0 * ab * x * y + 2.0 * ac * x * z + 2.0 * ad * x + b2 * y * y + 2.0 * bc * y * z + 2.0 * bd * y +
+			c2 * z * z + 2.0 * cd * z + d2;
+	}
+};
+
+std::vector<std::uint32_t> SimplifyMesh(std::span<const std::uint32_t> indices, std::span<const std::uint8_t> vertices, std::size_t vertex_size,
+	std::span<const std::uint8_t> joint_groups, std::size_t target_index_count)
+{
+	std::vector<std::uint32_t> result(indices.begin(), indices.end());
+	const auto vertex_count = vertices.size() / vertex_size;
+	assert(joint_groups.empty() || joint_groups.size() == vertex_count);
+	auto Position = [&](std::uint32_t vertex)
+	{
+		glm::vec3 position;
+		std::memcpy(&position, vertices.data() + vertex * vertex_size, sizeof(position));
+		return position;
+	};
+
+	// Vertices at the same position share an id, seams show up as more than one vertex per id
+	std::vector<std::uint32_t> order(vertex_count);
+	std::iota(order.begin(), order.end(), 0u);
+	auto ComparePositions = [&](std::uint32_t a, std::uint32_t b) { return std::memcmp(vertices.data() + a * vertex_size, vertices.data() + b * vertex_size, sizeof(glm::vec3)); };
+	std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) { return ComparePositions(a, b) < 0; });
+	std::vector<std::uint32_t> position_ids(vertex_count);
+	std::vector<std::uint32_t> vertices_per_position;
+	for (std::size_t i = 0; i < vertex_count; i++)
+	{
+		if (i == 0 || ComparePositions(order[i - 1], order[i]) != 0) vertices_per_position.push_back(0);
+		position_ids[order[i]] = (std::uint32_t)vertices_per_position.size() - 1;
+		vertices_per_position.back()++;
+	}
+
+	// Edges used by one triangle are open borders, counted on positions so seams don't look like borders
+	std::vector<bool> locked_positions(vertices_per_position.size(), false);
+	for (std::size_t position = 0; position < vertices_per_position.size(); position++)
+	{
+		locked_positions[position] = vertices_per_position[position] > 1;
+	}
+	{
+		std::vector<std::uint64_t> edges;
+		edges.reserve(result.size());
+		for (std::size_t i = 0; i < result.size(); i += 3)
+		{
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const auto a = position_ids[result[i + corner]], b = position_ids[result[i + (corner + 1) % 3]];
+				edges.push_back((std::uint64_t)std::min(a, b) << 32 | std::max(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		for (std::size_t i = 0; i < edges.size(); )
+		{
+			auto run_end = i + 1;
+			while (run_end < edges.size() && edges[run_end] == edges[i]) run_end++;
+			if (run_end - i == 1)
+			{
+				locked_positions[edges[i] >> 32] = true;
+				locked_positions[edges[i] & 0xFFFFFFFFu] = true;
+			}
+			i = run_end;
+		}
+	}
+
+	std::vector<Quadric> quadrics(vertex_count);
+	for (std::size_t i = 0; i < result.size(); i += 3)
+	{
+		const auto a = Position(result[i]), b = Position(result[i + 1]), c = Position(result[i + 2]);
+		const auto normal = glm::cross(b - a, c - a);
+		const auto area = glm::length(normal);
+		if (area == 0.0f) continue;
+		const auto unit_normal = normal / area;
+		const auto plane = Quadric::FromPlane(unit_normal, -glm::dot(unit_normal, a), area);
+		for (int corner = 0; corner < 3; corner++) quadrics[result[i + corner]] += plane;
+	}
+
+	struct Collapse
+	{
+		std::uint32_t from, to;
+		double error;
+	};
+	std::vector<Collapse> collapses;
+	std::vector<std::uint32_t> adjacency_offsets(vertex_count + 1), adjacency;
+	std::vector<std::uint32_t> remap(vertex_count);
+	std::vector<bool> touched(vertex_count);
+	auto CanMove = [&](std::uint32_t from, std::uint32_t to)
+	{
+		return !locked_positions[position_ids[from]] && (joint_groups.empty() || joint_groups[from] == joint_groups[to]);
+	};
+	while (result.size() > target_index_count)
+	{
+		// Cheapest direction of every edge, cheapest edges first
+		collapses.clear();
+		for (std::size_t i = 0; i < result.size(); i += 3)
+		{
+			for (int corner = 0; corner < 3; corner++)
+			{
+				const auto a = result[i + corner], b = result[i + (corner + 1) % 3];
+				if (a > b) continue; // every interior edge comes up once in each direction, borders never collapse anyway
+				auto merged = quadrics[a];
+				merged += quadrics[b];
+				const auto a_to_b = CanMove(a, b) ? merged.Error(Position(b)) : std::numeric_limits<double>::max();
+				const auto b_to_a = CanMove(b, a) ? merged.Error(Position(a)) : std::numeric_limits<double>::max();
+				if (a_to_b == std::numeric_limits<double>::max() && b_to_a == std::numeric_limits<double>::max()) continue;
+				collapses.push_back(a_to_b <= b_to_a ? Collapse{ a, b, a_to_b } : Collapse{ b, a, b_to_a });
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& x, const Collapse& y) { return x.error < y.error; });
+
+		std::fill(adjacency_offsets.begin(), adjacency_offsets.end(), 0u);
+		for (auto index : result) adjacency_offsets[index + 1]++;
+		for (std::size_t vertex = 0; vertex < vertex_count; vertex++) adjacency_offsets[vertex + 1] += adjacency_offsets[vertex];
+		adjacency.resize(result.size());
+		{
+			std::vector<std::uint32_t> fill(adjacency_offsets.begin(), adjacency_offsets.end() - 1);
+			for (std::size_t i = 0; i < result.size(); i++) adjacency[fill[result[i]]++] = (std::uint32_t)(i / 3);
+		}
+
+		// A collapse removes about two triangles. Vertices around a collapse wait for the next pass so every flip
+		// check sees the triangles as they'll be.
+		const auto max_collapses = std::max<std::size_t>((result.size() - target_index_count) / 6, 1);
+		std::size_t collapse_count = 0;
+		std::iota(remap.begin(), remap.end(), 0u);
+		std::fill(touched.begin(), touched.end(), false);
+		for (const auto& collapse : collapses)
+		{
+			if (collapse_count == max_collapses) break;
+			if (touched[collapse.from] || touched[collapse.to]) continue;
+
+			const auto from_triangles = std::span(adjacency).subspan(adjacency_offsets[collapse.from], adjacency_offsets[collapse.from + 1] - adjacency_offsets[collapse.from]);
+			bool flips = false;
+			for (auto triangle : from_triangles)
+			{
+				const auto* corners = &result[triangle * 3];
+				if (corners[0] == collapse.to || corners[1] == collapse.to || corners[2] == collapse.to) continue;
+				glm::vec3 before[3], after[3];
+				for (int corner = 0; corner < 3; corner++)
+				{
+					before[corner] = Position(corners[corner]);
+					after[corner] = Position(corners[corner] == collapse.from ? collapse.to : corners[corner]);
+				}
+				const auto normal_before = glm::cross(before[1] - before[0], before[2] - before[0]);
+				const auto normal_after = glm::cross(after[1] - after[0], after[2] - after[0]);
+				flips |= glm::dot(normal_before, normal_after) <= 0.0f;
+			}
+			if (flips) continue;
+
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to] += quadrics[collapse.from];
+			for (auto triangle : from_triangles)
+			{
+				for (int corner = 0; corner < 3; corner++) touched[result[triangle * 3 + corner]] = true;
+			}
+			collapse_count++;
+		}
+		if (collapse_count == 0) break;
+
+		std::size_t write = 0;
+		for (std::size_t i = 0; i < result.size(); i += 3)
+		{
+			const auto a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			if (a == b || b == c || a == c) continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+	}
+	return result;
+}
+
+std::size_t OptimizeVertexFetch(std::vector<std::uint8_t>& vertices, std::size_t vertex_size, std::span<std::uint32_t> indices)
+{
+	const auto vertex_count = vertices.size() / vertex_size;
+	std::vector<std::uint32_t> remap(vertex_count, no_vertex);
+	std::uint32_t next_vertex = 0;
+	for (auto& index : indices)
+	{
+		if (remap[index] == no_vertex) remap[index] = next_vertex++;
+		index = remap[index];
+	}
+	std::vector<std::uint8_t> reordered(next_vertex * vertex_size);
+	for (std::size_t vertex = 0; vertex < vertex_count; vertex++)
+	{
+		if (remap[vertex] != no_vertex) std::memcpy(reordered.data() + remap[vertex] * vertex_size, vertices.data() + vertex * vertex_size, vertex_size);
+	}
+	vertices = std::move(reordered);
+	return next_vertex;
+}
@@ -0,0 +1,47 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Index and vertex buffer reordering run on a model's triangles when it's loaded. Every function works on a triangle
+// list with 32 bit indices into interleaved vertices of vertex_size bytes and keeps the triangles' winding.
+
+// Post-transform vertex cache efficiency of a triangle list on a FIFO cache of cache_size entries
+struct VertexCacheStats
+{
+	float acmr = 0.0f; // average cache miss ratio: vertices transformed per triangle, 0.5 at best, 3 at worst
+	float atvr = 0.0f; // average transform to vertex ratio: vertices transformed per vertex referenced, 1 at best
+};
+VertexCacheStats AnalyzeVertexCache(std::span<const std::uint32_t> indices, std::size_t vertex_count, std::uint32_t cache_size = 16);
+
+// Collapses byte identical vertices into one and points indices at the survivors, which keep their relative order.
+// Returns the new vertex count, vertices is shrunk to it.
+std::size_t WeldVertices(std::vector<std::uint8_t>& vertices, std::size_t vertex_size, std::span<std::uint32_t> indices);
+
+// Reorders triangles so consecutive ones share vertices while they're still in the post-transform cache (Forsyth,
+// "Linear-Speed Vertex Cache Optimisation")
+void OptimizeVertexCache(std::span<std::uint32_t> indices, std::size_t vertex_count);
+
+// Reorders clusters of triangles left by OptimizeVertexCache so those facing away from the mesh center, which tend
+// to occlude the rest, are drawn first (Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw"). A cluster starts at every triangle that misses the cache with all three vertices, so the cache
+// efficiency within clusters is kept. Positions are the first vec3 of every vertex.
+void OptimizeOverdraw(std::span<std::uint32_t> indices, std::span<const std::uint8_t> vertices, std::size_t vertex_size);
+
+// Quadric error edge collapse (Garland and Heckbert) down to target_index_count indices or as close as the
+// constraints allow. Vertices only merge into one of their neighbours, so the result indexes the same vertices.
+// Vertices on open borders or sharing their position with another vertex (UV and normal seams) never move, and with
+// joint_groups (one value per vertex, e.g. each vertex's most weighted joint) only vertices of the same group merge,
+// which keeps the boundaries between bones where skinning stretches the mesh. Collapses that flip a triangle are
+// skipped.
+std::vector<std::uint32_t> SimplifyMesh(std::span<const std::uint32_t> indices, std::span<const std::uint8_t> vertices, std::size_t vertex_size,
+	std::span<const std::uint8_t> joint_groups, std::size_t target_index_count);
+
+// Renumbers vertices in the order indices first reference them so vertex fetches walk memory forward. Vertices no
+// index references are dropped; returns the new vertex count.
+std::size_t OptimizeVertexFetch(std::vector<std::uint8_t>& vertices, std::size_t vertex_size, std::span<std::uint32_t> indices);
+
+#endif // !MESH_OPTIMIZER_H
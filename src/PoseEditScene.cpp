@@ -1,11 +1,12 @@
 #include "PoseEditScene.h"
 
 #include <algorithm>
+#include "AllocationCounter.h"
 #include "glm/glm.hpp"
 #include "imgui.h"
 
-PoseEditScene::PoseEditScene(const std::vector<AnimatedModel>& models, unsigned int proj_view_ubo, unsigned int lights_ubo, Shader& model_shader)
-	:Scene(models, proj_view_ubo, lights_ubo, model_shader), model_states(models.size())
+PoseEditScene::PoseEditScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders)
+	:Scene(models, lights_ubo, skinned_shaders), model_states(models.size())
 {
 	// Resize skeleton pose to have same size as the number of joints in the skeleton it belongs to
 	int num_models = (int)models.size();
@@ -29,6 +30,7 @@ PoseEditScene::PoseEditScene(const std::vector<AnimatedModel>& models, unsigned
 			});
 
 		model_state.pose = ComputeLocalMatrices(bind_pose_global_mats, model.skeleton);
+		model_state.cache.Resize(num_joints);
 
 		/*model_state.pose.joint_poses.resize(model.skeleton.joints.size());
 
@@ -89,22 +91,28 @@ void PoseEditScene::UpdateAndRenderImpl(const Input& input, float dt)
 			const auto& name = current_model.skeleton.joint_names[i];
 			if (ImGui::TreeNode(name.c_str()))
 			{
-				ImGui::DragFloat3("Scale", &model_states[current_model_idx].pose.joint_poses[i].scale.x, 0.01f, 0.0f, 10.0f);
-				ImGui::DragFloat3("Translation", &model_states[current_model_idx].pose.joint_poses[i].translation.x, 0.1f, -1000.0f, 1000.0f);
-				glm::mat3 rotation{ model_states[current_model_idx].pose.joint_poses[i].rotation };
-				ImGui::DragFloat3("Rotation X", &rotation[0][0], 0.1f, -36000.0f, 36000.0f);
-				ImGui::DragFloat3("Rotation Y", &rotation[1][0], 0.1f, -36000.0f, 36000.0f);
-				ImGui::DragFloat3("Rotation X", &rotation[2][0], 0.1f, -36000.0f, 36000.0f);
-				model_states[current_model_idx].pose.joint_poses[i].rotation = rotation;
+				// Only edited joints are marked dirty, the cache recomputes just their subtrees
+				bool edited = ImGui::DragFloat3("Scale", &model_states[current_model_idx].pose.scales[i].x, 0.01f, 0.0f, 10.0f);
+				edited |= ImGui::DragFloat3("Translation", &model_states[current_model_idx].pose.translations[i].x, 0.1f, -1000.0f, 1000.0f);
+				glm::mat3 rotation{ model_states[current_model_idx].pose.rotations[i] };
+				bool rotation_edited = ImGui::DragFloat3("Rotation X", &rotation[0][0], 0.1f, -36000.0f, 36000.0f);
+				rotation_edited |= ImGui::DragFloat3("Rotation Y", &rotation[1][0], 0.1f, -36000.0f, 36000.0f);
+				rotation_edited |= ImGui::DragFloat3("Rotation X", &rotation[2][0], 0.1f, -36000.0f, 36000.0f);
+				if (rotation_edited) model_states[current_model_idx].pose.rotations[i] = rotation;
+				if (edited || rotation_edited) model_states[current_model_idx].cache.MarkDirty(i);
 				ImGui::TreePop();
 			}
 		}
 
 		ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+		ImGui::Text("Heap allocations in update: %llu", (unsigned long long)last_update_allocations);
+		ImGui::Text("Joints recomputed: %u / %d", model_states[current_model_idx].cache.last_update_joint_count, num_joints);
 
 		ImGui::End();
 	}
 
+	const auto allocations_before_update = HeapAllocationCount();
+
 	const auto& current_model = models[current_model_idx];
 	auto& current_model_state = model_states[current_model_idx];
 
@@ -112,36 +120,19 @@ void PoseEditScene::UpdateAndRenderImpl(const Input& input, float dt)
 	auto world_matrix = glm::identity<glm::mat4>();
 	world_matrix = glm::translate(world_matrix, current_model_state.position);
 	world_matrix = glm::scale(world_matrix, glm::vec3(current_model_state.scale));
-	auto normal_matrix = glm::mat3(glm::transpose(glm::inverse(view_matrix * world_matrix)));
 
-	current_model.BindGeometry();
-	model_shader->use();
 	//auto skinning_matrices = ComputeSkinningMatrices(current_model_state.pose, current_model.skeleton);
 	//auto skinning_matrices = current_model_state.pose.joint_poses;
 	//std::vector<glm::mat4> skinning_matrices(100, glm::identity<glm::mat4>());
-	auto skinning_matrices = ComputeSkinningMatrices(current_model_state.pose, current_model.skeleton);
-	model_shader->SetMat4("skinning_matrices", glm::value_ptr(skinning_matrices.front()), (int)skinning_matrices.size());
-	model_shader->SetMat4("model", glm::value_ptr(world_matrix));
-	model_shader->SetMat3("normalMatrix", glm::value_ptr(normal_matrix));
+	current_model_state.cache.Update(current_model_state.pose, current_model.skeleton);
+	const auto& skinning_matrices = current_model_state.cache.skinning_matrices;
+	const auto palette_offset = StreamSkinningPalette(skinning_matrices);
+	BindSkinningPaletteTexture();
 
-	const auto& materials = current_model.materials;
-	for (auto& mesh : current_model.meshes)
-	{
-		auto& material = materials[mesh.material_index];
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, material.diffuse_map.id);
-		glActiveTexture(GL_TEXTURE1);
-		glBindTexture(GL_TEXTURE_2D, material.specular_map.id);
-		glActiveTexture(GL_TEXTURE2);
-		glBindTexture(GL_TEXTURE_2D, material.normal_map.id);
-		model_shader->SetInt("material.diffuse", 0);
-		model_shader->SetInt("material.specular", 1);
-		model_shader->SetInt("material.normal", 2);
-		model_shader->SetFloat("material.shininess", material.shininess);
-		model_shader->SetVec3("material.diffuse_coeff", material.diffuse_coefficient);
-		model_shader->SetVec3("material.specular_coeff", material.specular_coefficient);
-		static_assert(std::is_same_v<std::uint32_t, std::underlying_type<PhongMaterialFlags>::type>);
-		model_shader->SetUint("material.flags", (std::uint32_t)material.flags);
-		glDrawElements(GL_TRIANGLES, mesh.indices_end - mesh.indices_begin + 1, GL_UNSIGNED_INT, (void*)(mesh.indices_begin * sizeof(GLuint)));
-	}
+	// Joint scales can be edited freely here, so normals always get the full inverse transpose
+	render_queue.Begin(view_matrix);
+	render_queue.Submit(skinned_shaders, current_model, world_matrix, palette_offset, false);
+	render_queue.Flush();
+
+	last_update_allocations = HeapAllocationCount() - allocations_before_update;
 }
@@ -2,10 +2,12 @@
 
 #include "Scene.h"
 
+#include <cstdint>
+
 class PoseEditScene : public Scene
 {
 public:
-	PoseEditScene(const std::vector<AnimatedModel>& models, unsigned int prov_view_ubo, unsigned int lights_ubo, Shader& model_shader);
+	PoseEditScene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders);
 
 private:
 	virtual void UpdateAndRenderImpl(const Input& input, float dt) override;
@@ -13,10 +15,12 @@ private:
 	struct ModelState
 	{
 		SkeletonPose pose;
+		PoseCache cache;
 		glm::vec3 position = { 0.0f, 0.0f, 0.0f };
 		glm::vec3 scale = { 0.01f, 0.01f, 0.01f };
 	};
 
 	std::vector<ModelState> model_states;
 	int current_model_idx = 0;
+	std::uint64_t last_update_allocations = 0;
 };
\ No newline at end of file
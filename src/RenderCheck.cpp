@@ -0,0 +1,187 @@
+#include "RenderCheck.h"
+
+#include <glad/glad.h>
+#include "imgui.h"
+#include "imgui_impl_glfw.h"
+#include "imgui_impl_opengl3.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "ClipPickScene.h"
+#include "CrowdScene.h"
+#include "Input.h"
+#include "Shader.h"
+
+static constexpr int check_width = 640;
+static constexpr int check_height = 480;
+// Frames drawn before capturing and timing, so first-use program links and uploads are out of the way and animation
+// LODs that update instances every few frames have posed all of them
+static constexpr int warm_up_frames = 8;
+static constexpr int timed_frames = 16;
+// A pixel counts as different when any channel is further apart than this
+static constexpr int channel_tolerance = 16;
+static constexpr float clear_color[4] = { 0.45f, 0.55f, 0.60f, 1.0f };
+static constexpr const char* output_directory = "RenderCheck";
+
+struct Capture
+{
+	std::vector<std::uint8_t> pixels; // RGBA, bottom row first
+	float frame_ms = 0.0f;
+};
+
+static void RenderFrame(Scene& scene, const Input& input)
+{
+	// Scenes build their UI while updating, it's never drawn so only the scene ends up in the image
+	ImGui_ImplOpenGL3_NewFrame();
+	ImGui_ImplGlfw_NewFrame();
+	ImGui::NewFrame();
+	glViewport(0, 0, check_width, check_height);
+	glClearColor(clear_color[0], clear_color[1], clear_color[2], clear_color[3]);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// No time passes, every frame draws the same pose
+	scene.UpdateAndRender(input, 0.0f);
+	Shader::call_stats = {};
+	ImGui::EndFrame();
+}
+
+static Capture CaptureScene(Scene& scene, const Input& input)
+{
+	for (int i = 0; i < warm_up_frames; i++) RenderFrame(scene, input);
+	glFinish();
+	const auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < timed_frames; i++) RenderFrame(scene, input);
+	glFinish();
+
+	Capture capture;
+	capture.frame_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count() / timed_frames;
+	capture.pixels.resize((std::size_t)check_width * check_height * 4);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, check_width, check_height, GL_RGBA, GL_UNSIGNED_BYTE, capture.pixels.data());
+	return capture;
+}
+
+static void WritePpm(const std::string& file_name, const Capture& capture)
+{
+	std::error_code error;
+	std::filesystem::create_directories(output_directory, error);
+	std::ofstream file(std::filesystem::path(output_directory) / file_name, std::ios::binary);
+	file << "P6\n" << check_width << ' ' << check_height << "\n255\n";
+	for (int y = check_height - 1; y >= 0; y--)
+	{
+		for (int x = 0; x < check_width; x++)
+		{
+			file.write((const char*)capture.pixels.data() + ((std::size_t)y * check_width + x) * 4, 3);
+		}
+	}
+}
+
+static bool ChannelsDiffer(const std::uint8_t* a, const std::uint8_t* b)
+{
+	for (int c = 0; c < 3; c++)
+	{
+		if (std::abs((int)a[c] - (int)b[c]) > channel_tolerance) return true;
+	}
+	return false;
+}
+
+// max_differing_fraction is relative to the pixels either path drew on, so it doesn't depend on how much of the
+// image the scene covers. An empty image fails, it would otherwise match another empty image.
+static bool CompareCaptures(const char* check, const char* name_a, const Capture& a, const char* name_b, const Capture& b,
+	float max_differing_fraction)
+{
+	std::uint8_t clear_pixel[3];
+	for (int c = 0; c < 3; c++) clear_pixel[c] = (std::uint8_t)(clear_color[c] * 255.0f + 0.5f);
+
+	std::size_t covered = 0, differing = 0;
+	for (std::size_t i = 0; i < a.pixels.size(); i += 4)
+	{
+		const auto* pixel_a = a.pixels.data() + i;
+		const auto* pixel_b = b.pixels.data() + i;
+		if (!ChannelsDiffer(pixel_a, clear_pixel) && !ChannelsDiffer(pixel_b, clear_pixel)) continue;
+		covered++;
+		if (ChannelsDiffer(pixel_a, pixel_b)) differing++;
+	}
+	const float differing_fraction = covered > 0 ? (float)differing / covered : 1.0f;
+	const bool passed = covered > 0 && differing_fraction <= max_differing_fraction;
+
+	WritePpm(std::string(check) + "_" + name_a + ".ppm", a);
+	WritePpm(std::string(check) + "_" + name_b + ".ppm", b);
+	std::cout << "Render check " << check << ": " << name_a << " " << a.frame_ms << " ms/frame, " << name_b << " " << b.frame_ms
+		<< " ms/frame, " << differing << " of " << covered << " drawn pixels differ (" << differing_fraction * 100.0f << "%, at most "
+		<< max_differing_fraction * 100.0f << "%) " << (passed ? "OK" : "FAILED") << '\n';
+	return passed;
+}
+
+int RunRenderChecks(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders)
+{
+	if (models.empty() || models[0].clips.empty())
+	{
+		std::cout << "Render check: the first model needs clips to compare skinning paths\n";
+		return 1;
+	}
+
+	unsigned int framebuffer, renderbuffers[2];
+	glGenFramebuffers(1, &framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, check_width, check_height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, check_width, check_height);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+	{
+		std::cout << "Render check: offscreen framebuffer is incomplete\n";
+		return 1;
+	}
+
+	Input input{};
+	input.window_width = check_width;
+	input.window_height = check_height;
+	bool passed = true;
+
+	{
+		// Dual quaternions keep volume around bent joints where linear blending collapses it, so a band of pixels
+		// there is expected to move. A broken path misplaces the whole character.
+		ClipPickScene scene(models, lights_ubo, skinned_shaders);
+		scene.SetSkinningMode(SkinningMode::LINEAR_BLEND);
+		const auto linear = CaptureScene(scene, input);
+		scene.SetSkinningMode(SkinningMode::DUAL_QUATERNION);
+		const auto dual_quaternion = CaptureScene(scene, input);
+		passed &= CompareCaptures("skinning", "linear", linear, "dual_quaternion", dual_quaternion, 0.1f);
+	}
+	{
+		// Same palettes and mesh LODs either way. Only the order blended meshes are drawn in differs, RenderQueue
+		// sorts them by depth and instanced draws don't.
+		CrowdScene scene(models, lights_ubo, skinned_shaders);
+		scene.SetInstanceCount(1000);
+		scene.SetInstancing(true);
+		const auto instanced = CaptureScene(scene, input);
+		scene.SetInstancing(false);
+		const auto single_draws = CaptureScene(scene, input);
+		passed &= CompareCaptures("crowd", "instanced", instanced, "single_draws", single_draws, 0.01f);
+	}
+	{
+		// Baked palettes are sampled at the exact clip time, so the CPU path has to sample every joint between keys
+		// every frame as well, which is animation LOD 0. What's left is that the baked shader blends skinning
+		// matrices between poses where the CPU path blends joint rotations.
+		CrowdScene scene(models, lights_ubo, skinned_shaders);
+		scene.SetInstanceCount(1000);
+		scene.SetAnimationLods(false);
+		scene.SetBakedPalettes(true);
+		const auto baked = CaptureScene(scene, input);
+		scene.SetBakedPalettes(false);
+		const auto cpu = CaptureScene(scene, input);
+		passed &= CompareCaptures("baked", "baked", baked, "cpu", cpu, 0.02f);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteRenderbuffers(2, renderbuffers);
+	glDeleteFramebuffers(1, &framebuffer);
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,21 @@
+#ifndef RENDER_CHECK_H
+#define RENDER_CHECK_H
+
+#include "AnimatedModel.h"
+#include "ShaderPermutations.h"
+
+#include <vector>
+
+// Headless comparisons of rendering paths that should draw the same image up to a per-check tolerance, run with
+// --render-check instead of opening the viewer. Each check renders a scene into an offscreen framebuffer once per
+// path, reads both images back and compares them pixel by pixel, printing how many pixels differ and the frame time
+// of each path:
+// - ClipPickScene with linear blend against dual quaternion skinning
+// - CrowdScene with 1000 instances, instanced draws against one RenderQueue draw per mesh
+// - CrowdScene with 1000 instances at animation LOD 0, baked palettes against palettes posed on the CPU
+//
+// Both images are also written to RenderCheck/<check>_<path>.ppm under the working directory for inspection.
+// Returns the process exit code, 0 when every check is within its tolerance.
+int RunRenderChecks(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders);
+
+#endif // !RENDER_CHECK_H
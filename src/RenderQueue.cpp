@@ -0,0 +1,144 @@
+#include "RenderQueue.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <glm/gtc/type_ptr.hpp>
+
+enum class RenderPass : std::uint64_t
+{
+	SOLID = 0,
+	BLENDED = 1, // materials with alpha in their diffuse map
+};
+
+static constexpr std::uint64_t depth_bits = 24;
+static constexpr std::uint64_t depth_mask = (1ull << depth_bits) - 1;
+
+// Positive floats order the same as their bit patterns, the top bits below the sign are a coarse monotonic depth
+static std::uint64_t QuantizeDepth(float view_depth)
+{
+	return std::bit_cast<std::uint32_t>(std::max(view_depth, 0.0f)) >> (31 - depth_bits);
+}
+
+void RenderQueue::Begin(const glm::mat4& view_matrix)
+{
+	this->view_matrix = view_matrix;
+	draws.clear();
+	instance_matrices.clear();
+	sort_entries.clear();
+	shaders.clear();
+	models.clear();
+}
+
+std::uint32_t RenderQueue::ShaderIndex(Shader* shader)
+{
+	auto iter = std::find(shaders.begin(), shaders.end(), shader);
+	if (iter == shaders.end()) iter = shaders.insert(shaders.end(), shader);
+	assert(shaders.size() <= 256);
+	return (std::uint32_t)(iter - shaders.begin());
+}
+
+std::uint32_t RenderQueue::ModelIndex(const AnimatedModel* model)
+{
+	auto iter = std::find(models.begin(), models.end(), model);
+	if (iter == models.end()) iter = models.insert(models.end(), model);
+	assert(models.size() <= 1024);
+	return (std::uint32_t)(iter - models.begin());
+}
+
+std::uint32_t RenderQueue::AddInstance(const glm::mat4& world_matrix)
+{
+	instance_matrices.push_back({ world_matrix, glm::mat3(glm::transpose(glm::inverse(view_matrix * world_matrix))) });
+	return (std::uint32_t)instance_matrices.size() - 1;
+}
+
+void RenderQueue::Submit(Shader& shader, const AnimatedModel& model, const glm::mat4& world_matrix, int palette_offset, int lod)
+{
+	const auto instance = AddInstance(world_matrix);
+	for (std::uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++)
+	{
+		SubmitMesh(shader, model, mesh_index, instance, palette_offset, lod);
+	}
+}
+
+void RenderQueue::Submit(ShaderPermutations& permutations, const AnimatedModel& model, const glm::mat4& world_matrix, int palette_offset,
+	bool uniform_scale, int lod)
+{
+	const auto instance = AddInstance(world_matrix);
+	for (std::uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++)
+	{
+		SubmitMesh(permutations.Get(SelectPermutation(model, mesh_index, uniform_scale)), model, mesh_index, instance, palette_offset, lod);
+	}
+}
+
+void RenderQueue::SubmitMesh(Shader& shader, const AnimatedModel& model, std::uint32_t mesh_index, std::uint32_t instance, int palette_offset, int lod)
+{
+	const std::uint64_t shader_index = ShaderIndex(&shader);
+	const std::uint64_t model_index = ModelIndex(&model);
+	const auto& mesh = model.meshes[mesh_index];
+	const auto& material = model.materials[mesh.material_index];
+	const std::uint64_t material_index = mesh.material_index;
+	const std::uint64_t texture_set = material.texture_set;
+	assert(material_index < 1024 && texture_set < 1024);
+	// View space looks down -z
+	const auto world_center = instance_matrices[instance].world * glm::vec4(model.mesh_centers[mesh_index], 1.0f);
+	const auto depth = QuantizeDepth(-(view_matrix * world_center).z);
+
+	std::uint64_t key;
+	if (material.HasFlag(PhongMaterialFlags::DIFFUSE_WITH_ALPHA))
+	{
+		key = (std::uint64_t)RenderPass::BLENDED << 62 | (depth_mask - depth) << 38 | shader_index << 30 |
+			model_index << 20 | material_index << 10;
+	}
+	else
+	{
+		key = (std::uint64_t)RenderPass::SOLID << 62 | shader_index << 54 | model_index << 44 | texture_set << 34 |
+			material_index << 24 | depth;
+	}
+	sort_entries.push_back({ key, (std::uint32_t)draws.size() });
+	draws.push_back({ &shader, &model, mesh_index, palette_offset, instance, lod });
+}
+
+void RenderQueue::Flush()
+{
+	std::sort(sort_entries.begin(), sort_entries.end(), [](const SortEntry& a, const SortEntry& b) { return a.key < b.key; });
+
+	last_stats = {};
+	const Shader* bound_shader = nullptr;
+	const AnimatedModel* bound_model = nullptr;
+	int bound_texture_set = -1;
+	for (const auto& entry : sort_entries)
+	{
+		const auto& draw = draws[entry.draw];
+		const auto& mesh = draw.model->meshes[draw.mesh];
+		const auto& material = draw.model->materials[mesh.material_index];
+		if (draw.shader != bound_shader)
+		{
+			bound_shader = draw.shader;
+			draw.shader->use();
+			last_stats.shader_changes++;
+		}
+		if (draw.model != bound_model)
+		{
+			bound_model = draw.model;
+			draw.model->BindGeometry();
+			draw.model->BindMaterials();
+			bound_texture_set = -1;
+			last_stats.model_changes++;
+		}
+		if (material.texture_set != bound_texture_set)
+		{
+			bound_texture_set = material.texture_set;
+			draw.model->BindMaterialTextures(mesh.material_index);
+			last_stats.texture_changes++;
+		}
+		const auto& matrices = instance_matrices[draw.instance];
+		draw.shader->SetMat4("model", glm::value_ptr(matrices.world));
+		draw.shader->SetMat3("normalMatrix", glm::value_ptr(matrices.normal));
+		draw.shader->SetInt("palette_offset", draw.palette_offset);
+		draw.model->SetMeshUniforms(*draw.shader, draw.mesh);
+		draw.model->DrawMesh(draw.mesh, draw.lod);
+		last_stats.draws++;
+		last_stats.triangles += draw.model->MeshTriangleCount(draw.mesh, draw.lod);
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include "AnimatedModel.h"
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "Shader.h"
+#include "ShaderPermutations.h"
+#include <vector>
+
+// Collects a frame's mesh draws and issues them ordered by a 64 bit sort key, so consecutive draws share as much
+// GL state as possible and state is only changed where the key's fields change. Opaque meshes are drawn first,
+// grouped by shader, model, texture set and material and front to back within a material so early depth testing
+// rejects hidden fragments. Transparent meshes follow back to front, which blending needs to look right.
+//
+// Opaque:      pass (2) | shader (8) | model (10) | texture set (10) | material (10) | depth (24)
+// Transparent: pass (2) | inverted depth (24) | shader (8) | model (10) | material (10) | unused (10)
+class RenderQueue
+{
+public:
+	struct Stats
+	{
+		std::uint32_t draws = 0;
+		std::uint32_t triangles = 0;
+		std::uint32_t shader_changes = 0;
+		std::uint32_t model_changes = 0;
+		std::uint32_t texture_changes = 0;
+	};
+
+	// Starts a frame of submissions, view_matrix is used to sort by depth
+	void Begin(const glm::mat4& view_matrix);
+	// Queues every mesh of the model at the given mesh LOD. The shader's material samplers and skinning palette must
+	// already be set (Scene::BindSkinningPalette), palette_offset is passed per draw.
+	void Submit(Shader& shader, const AnimatedModel& model, const glm::mat4& world_matrix, int palette_offset, int lod = 0);
+	// Same, drawing each mesh with the leanest permutation for its vertices and material, see SelectPermutation.
+	// The permutations have their samplers set already by ShaderPermutations::Get, the palette texture must be bound.
+	void Submit(ShaderPermutations& permutations, const AnimatedModel& model, const glm::mat4& world_matrix, int palette_offset,
+		bool uniform_scale, int lod = 0);
+	// Issues everything submitted since Begin
+	void Flush();
+
+	const Stats& LastStats() const { return last_stats; }
+
+private:
+	struct Draw
+	{
+		Shader* shader;
+		const AnimatedModel* model;
+		std::uint32_t mesh;
+		int palette_offset;
+		std::uint32_t instance; // index into instance_matrices
+		int lod;
+	};
+	struct InstanceMatrices
+	{
+		glm::mat4 world;
+		glm::mat3 normal;
+	};
+
+	std::uint32_t ShaderIndex(Shader* shader);
+	std::uint32_t AddInstance(const glm::mat4& world_matrix);
+	void SubmitMesh(Shader& shader, const AnimatedModel& model, std::uint32_t mesh_index, std::uint32_t instance, int palette_offset, int lod);
+	std::uint32_t ModelIndex(const AnimatedModel* model);
+
+	glm::mat4 view_matrix{ 1.0f };
+	std::vector<Draw> draws;
+	std::vector<InstanceMatrices> instance_matrices; // submitted models share their matrices between meshes
+	struct SortEntry
+	{
+		std::uint64_t key;
+		std::uint32_t draw;
+	};
+	std::vector<SortEntry> sort_entries;
+	// Key fields index these, filled in submission order each frame
+	std::vector<Shader*> shaders;
+	std::vector<const AnimatedModel*> models;
+	Stats last_stats;
+};
+
+#endif // !RENDER_QUEUE_H
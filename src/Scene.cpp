@@ -1,25 +1,101 @@
 #include "Scene.h"
+#include <cassert>
+#include <cstring>
 #include "imgui.h"
 
+static constexpr std::size_t palette_texel_size = 4 * sizeof(float);
+
+Scene::Scene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders)
+    : models(models), skinned_shaders(skinned_shaders), lights_ubo(lights_ubo)
+{
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_offset_alignment);
+    glGenTextures(1, &palette_texture);
+
+    const auto lights_block_size = max_point_lights * sizeof(PointLight) + max_spot_lights * sizeof(SpotLight) + sizeof(DirectionalLight) + 2 * sizeof(int);
+    lights_block.resize(lights_block_size);
+    uploaded_lights_block.resize(lights_block_size);
+}
+
+std::vector<std::string> Scene::VertexFormatDefines() const
+{
+    const bool compressed = !models.empty() && HasFlag(models[0].vertex_flags, VertexFlags::COMPRESSED);
+    for (const auto& model : models)
+    {
+        assert(HasFlag(model.vertex_flags, VertexFlags::COMPRESSED) == compressed);
+    }
+    return { std::string("COMPRESSED_VERTICES ") + (compressed ? "1" : "0") };
+}
+
+Scene::~Scene()
+{
+    glDeleteTextures(1, &palette_texture);
+}
+
 void Scene::UpdateAndRender(const Input& input, float dt)
 {
+    uniform_stream.BeginFrame();
+    palette_stream.BeginFrame();
+    instance_stream.BeginFrame();
+
     auto view = camera.GetViewMatrix();
     auto aspect = (float)input.window_width / (float)input.window_height;
     auto proj = camera.GetProjectionMatrix(aspect);
 
-    glBindBuffer(GL_UNIFORM_BUFFER, proj_view_ubo);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4),
-        glm::value_ptr(proj));
-    glBufferSubData(GL_UNIFORM_BUFFER, sizeof(glm::mat4), sizeof(glm::mat4),
-        glm::value_ptr(view));
+    glm::mat4 matrices[2] = { proj, view };
+    const auto matrices_offset = uniform_stream.Upload(matrices, sizeof(matrices), uniform_offset_alignment);
+    glBindBufferRange(GL_UNIFORM_BUFFER, 0, uniform_stream.Buffer(), matrices_offset, sizeof(matrices));
+
+    UploadLights();
+
+    UpdateAndRenderImpl(input, dt);
+
+    uniform_stream.EndFrame();
+    palette_stream.EndFrame();
+    instance_stream.EndFrame();
+}
 
+void Scene::UploadLights()
+{
+    // Lights rarely change, so the block is assembled on the CPU and only uploaded when it differs from the last one
     DirectionalLight dirLightViewSpace = DirectionalLight(glm::vec3(0.2f, 0.2f, 0.2f), glm::vec3(0.8, 0.8f, 0.8f), glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f));
     const int num_lights[2] = { (int)point_lights.size(), (int)spot_lights.size() };
+    const auto spot_lights_offset = max_point_lights * sizeof(PointLight);
+    const auto dir_light_offset = spot_lights_offset + max_spot_lights * sizeof(SpotLight);
+    auto* block = lights_block.data();
+    if (num_lights[0] > 0) std::memcpy(block, point_lights.data(), num_lights[0] * sizeof(PointLight));
+    if (num_lights[1] > 0) std::memcpy(block + spot_lights_offset, spot_lights.data(), num_lights[1] * sizeof(SpotLight));
+    std::memcpy(block + dir_light_offset, &dirLightViewSpace, sizeof(DirectionalLight));
+    std::memcpy(block + dir_light_offset + sizeof(DirectionalLight), num_lights, sizeof(num_lights));
+
+    // The UBO is shared between scenes, a new scene always uploads once
+    if (lights_uploaded && lights_block == uploaded_lights_block) return;
     glBindBuffer(GL_UNIFORM_BUFFER, lights_ubo);
-    if (num_lights[0] > 0) glBufferSubData(GL_UNIFORM_BUFFER, 0, num_lights[0] * sizeof(PointLight), point_lights.data());
-    if (num_lights[1] > 0) glBufferSubData(GL_UNIFORM_BUFFER, max_point_lights * sizeof(PointLight), num_lights[1] * sizeof(SpotLight), spot_lights.data());
-    glBufferSubData(GL_UNIFORM_BUFFER, max_point_lights * sizeof(PointLight) + max_spot_lights * sizeof(SpotLight) + sizeof(DirectionalLight), sizeof(num_lights), num_lights);
-    glBufferSubData(GL_UNIFORM_BUFFER, max_point_lights * sizeof(PointLight) + max_spot_lights * sizeof(SpotLight), sizeof(DirectionalLight), &dirLightViewSpace);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, lights_block.size(), lights_block.data());
+    uploaded_lights_block = lights_block;
+    lights_uploaded = true;
+}
 
-    UpdateAndRenderImpl(input, dt);
+int Scene::StreamSkinningPalette(const void* data, std::size_t size_bytes)
+{
+    const auto offset = palette_stream.Upload(data, size_bytes, palette_texel_size);
+    if (palette_texture_buffer != palette_stream.Buffer())
+    {
+        palette_texture_buffer = palette_stream.Buffer();
+        glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, palette_texture_buffer);
+    }
+    return (int)(offset / palette_texel_size);
+}
+
+void Scene::BindSkinningPaletteTexture()
+{
+    glActiveTexture(GL_TEXTURE0 + palette_texture_unit);
+    glBindTexture(GL_TEXTURE_BUFFER, palette_texture);
+}
+
+void Scene::BindSkinningPalette(Shader& shader, int texel_offset)
+{
+    BindSkinningPaletteTexture();
+    shader.SetInt("skinning_palette", palette_texture_unit);
+    shader.SetInt("palette_offset", texel_offset);
 }
@@ -3,31 +3,67 @@
 #include "AnimatedModel.h"
 #include <algorithm>
 #include "Camera.h"
+#include "FrameStream.h"
 #include <glm/glm.hpp>
 #include "Light.h"
 #include "Input.h"
+#include "RenderQueue.h"
 #include "Shader.h"
+#include "ShaderPermutations.h"
+#include <span>
+#include <string>
 #include <string_view>
 #include <vector>
 
 class Scene
 {
 public:
-	Scene(const std::vector<AnimatedModel>& models, unsigned int proj_view_ubo, unsigned int lights_ubo, Shader& shader) 
-		: models(models), proj_view_ubo(proj_view_ubo), lights_ubo(lights_ubo), model_shader(&shader) {}
+	// skinned_shaders are permutations of Shaders/anim.vert and Shaders/anim.frag, shared by every scene so switching
+	// scenes doesn't compile them again. They have to set skinning_palette to palette_texture_unit.
+	Scene(const std::vector<AnimatedModel>& models, unsigned int lights_ubo, ShaderPermutations& skinned_shaders);
 	void UpdateAndRender(const Input& input, float dt);
-	virtual ~Scene() = default;
+	virtual ~Scene();
 
 	static constexpr int max_point_lights = 25;
 	static constexpr int max_spot_lights = 25;
+	static constexpr int palette_texture_unit = 4;
 protected:
 	const std::vector<AnimatedModel>& models;
-	Shader* model_shader;
+	ShaderPermutations& skinned_shaders;
 	Camera camera{ glm::vec3{0.0f, 0.0f, 3.0f} };
 	std::vector<PointLight> point_lights;
 	std::vector<SpotLight> spot_lights;
 	DirectionalLight dir_light{ glm::vec3(0.2f, 0.2f, 0.2f), glm::vec3(0.8, 0.8f, 0.8f), glm::vec3(1.0f, 1.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f) };
-	unsigned int proj_view_ubo, lights_ubo;
+	unsigned int lights_ubo;
+
+	// Streams palette data (4x3 matrices or any other vec4 aligned data) into this frame's palette buffer. Returns
+	// the texel offset of the first element for BindSkinningPalette.
+	int StreamSkinningPalette(const void* data, std::size_t size_bytes);
+	int StreamSkinningPalette(std::span<const glm::mat4x3> skinning_matrices)
+	{
+		return StreamSkinningPalette(skinning_matrices.data(), skinning_matrices.size_bytes());
+	}
+	// Points the shader's skinning_palette buffer texture at palettes streamed this frame
+	void BindSkinningPalette(Shader& shader, int texel_offset);
+	// Only binds the palette texture, for shaders that already have their sampler set (skinned_shaders)
+	void BindSkinningPaletteTexture();
+	// Defines for skinned shaders that aren't ShaderPermutations, matching the vertex format every model was
+	// loaded with (COMPRESSED_VERTICES)
+	std::vector<std::string> VertexFormatDefines() const;
+
+	FrameStream uniform_stream{ GL_UNIFORM_BUFFER, 4 * 1024 }; // Matrices block
+	FrameStream palette_stream{ GL_TEXTURE_BUFFER, 256 * 1024 };
+	FrameStream instance_stream{ GL_ARRAY_BUFFER, 256 * 1024 }; // per-instance vertex data
+	RenderQueue render_queue;
 private:
+	void UploadLights();
+
+	unsigned int palette_texture = 0; // GL_RGBA32F buffer texture over palette_stream
+	unsigned int palette_texture_buffer = 0; // buffer palette_texture was last attached to
+	int uniform_offset_alignment = 256;
+	// Lights block as last written to lights_ubo, it's only rewritten when something in it changed
+	std::vector<std::uint8_t> lights_block, uploaded_lights_block;
+	bool lights_uploaded = false;
+
 	virtual void UpdateAndRenderImpl(const Input& input, float dt) = 0;
 };
\ No newline at end of file
@@ -1,157 +1,402 @@
 #include "Shader.h"
 
-Shader::Shader(const char * vertexPath, const char * fragmentPath, const char * geometryPath, const std::vector<UniformBlockBinding>& ub_bindings)
-{
-	unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-	unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 
-	auto vertexSource = get_file_contents(vertexPath);
-	auto fragmentSource = get_file_contents(fragmentPath);
+// Not in core GL 3.3 headers, values from the KHR_parallel_shader_compile spec
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
 
-	auto vShaderCode = vertexSource.c_str();
-	auto fShaderCode = fragmentSource.c_str();
-	
-	glShaderSource(vertexShader, 1, &vShaderCode, NULL);
-	glShaderSource(fragmentShader, 1, &fShaderCode, NULL);
+// Binaries are only valid for the driver that produced them, stale files just miss
+static constexpr const char* program_cache_directory = "ShaderCache";
+static constexpr std::uint32_t program_cache_magic = 0x62707267; // "grpb"
 
-	glCompileShader(vertexShader);
+static std::uint64_t HashBytes(std::uint64_t hash, std::string_view bytes)
+{
+	// 64 bit FNV-1a
+	for (char c : bytes)
+	{
+		hash = (hash ^ (std::uint8_t)c) * 1099511628211ull;
+	}
+	return hash;
+}
 
-	int success;
-	char infoLog[512];
-	glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-	if (!success)
+static bool HasExtension(std::string_view name)
+{
+	GLint num_extensions = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_extensions);
+	for (GLint i = 0; i < num_extensions; i++)
 	{
-		glGetShaderInfoLog(vertexShader, sizeof(infoLog), NULL, infoLog);
-		std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << '\n';
-		// TODO find a solution for this. It's affecting the next Shader object created
-		// when this one fails
+		if (name == (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i)) return true;
 	}
+	return false;
+}
 
-	glCompileShader(fragmentShader);
-	glGetShaderiv(fragmentShader, GL_COMPILE_STATUS, &success);
-	if (!success)
+static bool ProgramBinariesSupported()
+{
+	static const bool supported = [] {
+		if (glGetProgramBinary == nullptr || glProgramBinary == nullptr || glProgramParameteri == nullptr) return false;
+		GLint num_formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+		return num_formats > 0;
+	}();
+	return supported;
+}
+
+struct Shader::PendingProgram
+{
+	std::string sources[3]; // vertex, fragment, geometry (empty without one)
+	unsigned int shaders[3] = {};
+	std::filesystem::path cache_path;
+	bool from_cache = false;
+};
+
+ShaderCacheStats Shader::cache_stats;
+
+Shader::Shader(const char * vertexPath, const char * fragmentPath, const char * geometryPath, const std::vector<UniformBlockBinding>& ub_bindings,
+	const std::vector<std::string>& defines)
+	: ub_bindings(ub_bindings), pending(std::make_unique<PendingProgram>())
+{
+	const auto start = std::chrono::steady_clock::now();
+	static const bool parallel_compile = HasExtension("GL_KHR_parallel_shader_compile") || HasExtension("GL_ARB_parallel_shader_compile");
+	cache_stats.parallel_compile = parallel_compile;
+
+	auto& sources = pending->sources;
+	sources[0] = get_file_contents(vertexPath);
+	sources[1] = get_file_contents(fragmentPath);
+	if (geometryPath != nullptr) sources[2] = get_file_contents(geometryPath);
+	for (auto& source : sources)
 	{
-		glGetShaderInfoLog(fragmentShader, sizeof(infoLog), NULL, infoLog);
-		std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << '\n';
+		if (!source.empty()) InsertDefines(source, defines);
 	}
 
 	id = glCreateProgram();
-	glAttachShader(id, vertexShader);
-	glAttachShader(id, fragmentShader);
-
-	if (geometryPath != nullptr) {
-		unsigned int geomShader = glCreateShader(GL_GEOMETRY_SHADER);
-		auto geomSource = get_file_contents(geometryPath);
-		auto code = geomSource.c_str();
-		glShaderSource(geomShader, 1, &code, NULL);
-		glCompileShader(geomShader);
-		glGetShaderiv(geomShader, GL_COMPILE_STATUS, &success);
-		if (!success)
+	if (ProgramBinariesSupported())
+	{
+		// Defines are part of the sources by now. The driver strings catch driver updates that invalidate binaries.
+		std::uint64_t hash = 14695981039346656037ull;
+		for (const auto& source : sources)
 		{
-			glGetShaderInfoLog(geomShader, sizeof(infoLog), NULL, infoLog);
-			std::cout << "ERROR::SHADER::GEOMETRY::COMPILATION_FAILED\n" << infoLog << '\n';
+			hash = HashBytes(hash, source);
+			hash = HashBytes(hash, std::string_view("\0", 1));
 		}
-
-		glAttachShader(id, geomShader);
+		for (auto name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+		{
+			hash = HashBytes(hash, (const char*)glGetString(name));
+		}
+		char file_name[32];
+		std::snprintf(file_name, sizeof(file_name), "%016llx.bin", (unsigned long long)hash);
+		pending->cache_path = std::filesystem::path(program_cache_directory) / file_name;
+		pending->from_cache = LoadProgramBinary();
 	}
+	if (!pending->from_cache) CompileAndLink();
+	cache_stats.create_ms += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+Shader::~Shader() = default;
+
+bool Shader::LoadProgramBinary()
+{
+	std::ifstream in(pending->cache_path, std::ios::binary);
+	if (!in) return false;
+	std::uint32_t header[3]; // magic, format, size
+	if (!in.read((char*)header, sizeof(header)) || header[0] != program_cache_magic) return false;
+	std::vector<char> binary(header[2]);
+	if (!in.read(binary.data(), binary.size())) return false;
+	// Link status is checked in FinishLinking, a binary the driver rejects falls back to compiling
+	glProgramBinary(id, (GLenum)header[1], binary.data(), (GLsizei)binary.size());
+	return true;
+}
 
+void Shader::CompileAndLink()
+{
+	static constexpr GLenum stages[3] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, GL_GEOMETRY_SHADER };
+	// Nothing here waits for the driver, so compiles of shaders created back to back can overlap when it compiles
+	// in parallel. Errors are read in FinishLinking.
+	for (int stage = 0; stage < 3; stage++)
+	{
+		if (pending->sources[stage].empty()) continue;
+		auto& shader = pending->shaders[stage];
+		shader = glCreateShader(stages[stage]);
+		auto code = pending->sources[stage].c_str();
+		glShaderSource(shader, 1, &code, NULL);
+		glCompileShader(shader);
+		glAttachShader(id, shader);
+	}
+	if (ProgramBinariesSupported()) glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(id);
+}
+
+bool Shader::LinkCompleted() const
+{
+	if (!pending) return true;
+	if (!cache_stats.parallel_compile) return false;
+	GLint completed = GL_FALSE;
+	glGetProgramiv(id, GL_COMPLETION_STATUS_KHR, &completed);
+	return completed == GL_TRUE;
+}
+
+void Shader::FinishLinking()
+{
+	if (!pending) return;
+	const auto start = std::chrono::steady_clock::now();
 
+	int success;
 	glGetProgramiv(id, GL_LINK_STATUS, &success);
+	if (!success && pending->from_cache)
+	{
+		std::cout << "Shader cache: " << pending->cache_path.string() << " was rejected, compiling\n";
+		glDeleteProgram(id);
+		id = glCreateProgram();
+		pending->from_cache = false;
+		CompileAndLink();
+		glGetProgramiv(id, GL_LINK_STATUS, &success);
+	}
+
+	char infoLog[512];
+	static constexpr const char* stage_names[3] = { "VERTEX", "FRAGMENT", "GEOMETRY" };
+	for (int stage = 0; stage < 3; stage++)
+	{
+		const auto shader = pending->shaders[stage];
+		if (shader == 0) continue;
+		int compiled;
+		glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+		if (!compiled)
+		{
+			glGetShaderInfoLog(shader, sizeof(infoLog), NULL, infoLog);
+			std::cout << "ERROR::SHADER::" << stage_names[stage] << "::COMPILATION_FAILED\n" << infoLog << '\n';
+		}
+		glDeleteShader(shader);
+	}
 	if (!success)
 	{
 		glGetProgramInfoLog(id, sizeof(infoLog), NULL, infoLog);
 		std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << '\n';
 	}
+	else if (!pending->from_cache && !pending->cache_path.empty())
+	{
+		SaveProgramBinary();
+	}
+	(pending->from_cache ? cache_stats.programs_from_cache : cache_stats.programs_compiled)++;
+	pending.reset();
+	cache_stats.link_wait_ms += std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
-
-	use();
+	ReflectUniforms();
 	for (const auto& binding : ub_bindings)
 	{
-		auto block_index = glGetUniformBlockIndex(id, binding.uniform_block_name.c_str());
-		glUniformBlockBinding(id, block_index, binding.uniform_block_binding);
+		auto block_index = UniformBlockIndex(binding.uniform_block_name);
+		if (block_index != GL_INVALID_INDEX) glUniformBlockBinding(id, block_index, binding.uniform_block_binding);
+	}
+}
+
+void Shader::SaveProgramBinary()
+{
+	GLint length = 0;
+	glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(id, length, &length, &format, binary.data());
+
+	std::error_code error;
+	std::filesystem::create_directories(program_cache_directory, error);
+	std::ofstream out(pending->cache_path, std::ios::binary);
+	const std::uint32_t header[3] = { program_cache_magic, (std::uint32_t)format, (std::uint32_t)length };
+	out.write((const char*)header, sizeof(header));
+	out.write(binary.data(), length);
+}
+
+ShaderCallStats Shader::call_stats;
+
+void Shader::InsertDefines(std::string& source, const std::vector<std::string>& defines)
+{
+	if (defines.empty()) return;
+	// #version has to stay the first line
+	auto insert_at = source.find("#version");
+	insert_at = insert_at == std::string::npos ? 0 : source.find('\n', insert_at);
+	insert_at = insert_at == std::string::npos ? source.size() : insert_at + 1;
+	std::string lines;
+	for (const auto& define : defines)
+	{
+		lines += "#define " + define + "\n";
+	}
+	source.insert(insert_at, lines);
+}
+
+void Shader::ReflectUniforms()
+{
+	GLint num_uniforms = 0, max_name_length = 0;
+	glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &num_uniforms);
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_name_length);
+	std::string name(std::max(max_name_length, 1), '\0');
+	for (GLint i = 0; i < num_uniforms; i++)
+	{
+		GLsizei length = 0;
+		GLint size = 0;
+		GLenum type = 0;
+		glGetActiveUniform(id, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+		std::string_view uniform_name(name.data(), length);
+		const auto location = glGetUniformLocation(id, name.c_str());
+		if (location < 0) continue; // members of uniform blocks
+		// Arrays are reported as "name[0]", callers use the plain name
+		if (uniform_name.ends_with("[0]")) uniform_name.remove_suffix(3);
+		uniforms.push_back({ HashUniformName(uniform_name), location });
+	}
+	std::sort(uniforms.begin(), uniforms.end(), [](const UniformEntry& a, const UniformEntry& b) { return a.hash < b.hash; });
+	for (std::size_t i = 1; i < uniforms.size(); i++)
+	{
+		if (uniforms[i].hash == uniforms[i - 1].hash) std::cout << "ERROR::SHADER::UNIFORM_NAME_HASH_COLLISION in program " << id << '\n';
 	}
+
+	GLint num_blocks = 0, max_block_name_length = 0;
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCKS, &num_blocks);
+	glGetProgramiv(id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_block_name_length);
+	name.assign(std::max(max_block_name_length, 1), '\0');
+	for (GLint i = 0; i < num_blocks; i++)
+	{
+		GLsizei length = 0;
+		glGetActiveUniformBlockName(id, (GLuint)i, (GLsizei)name.size(), &length, name.data());
+		uniform_blocks.push_back({ name.substr(0, length), (unsigned int)i });
+	}
+}
+
+int Shader::UniformLocation(UniformName name) const
+{
+	auto it = std::lower_bound(uniforms.begin(), uniforms.end(), name.hash, [](const UniformEntry& entry, std::uint32_t hash) { return entry.hash < hash; });
+	return it != uniforms.end() && it->hash == name.hash ? it->location : -1;
+}
+
+unsigned int Shader::UniformBlockIndex(std::string_view name) const
+{
+	for (const auto& block : uniform_blocks)
+	{
+		if (block.name == name) return block.index;
+	}
+	return GL_INVALID_INDEX;
 }
 
 void Shader::use()
 {
+	if (pending) FinishLinking();
+	if (bound_program == id)
+	{
+		call_stats.program_binds_skipped++;
+		return;
+	}
 	glUseProgram(id);
+	bound_program = id;
+	call_stats.program_binds++;
 }
 
-void Shader::SetBool(const char * name, bool value) const
+void Shader::SetBool(UniformName name, bool value) const
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform1i(uniformLocation, value);
 }
 
-void Shader::SetInt(const char * name, int value) const
+void Shader::SetInt(UniformName name, int value) const
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform1i(uniformLocation, value);
 }
 
-void Shader::SetUint(const char* name, std::uint32_t value) const
+void Shader::SetUint(UniformName name, std::uint32_t value) const
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform1ui(uniformLocation, value);
 }
 
-void Shader::SetFloat(const char * name, float value) const
+void Shader::SetFloat(UniformName name, float value) const
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform1f(uniformLocation, value);
 }
 
-void Shader::SetMat4(const char * name, const float * value)
+void Shader::SetFloatArray(UniformName name, const float* values, int count) const
+{
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
+	glUniform1fv(uniformLocation, count, values);
+}
+
+void Shader::SetMat4(UniformName name, const float * value)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniformMatrix4fv(uniformLocation, 1, GL_FALSE, value);
 }
 
-void Shader::SetMat4(const char* name, const float* value, int count)
+void Shader::SetMat4(UniformName name, const float* value, int count)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniformMatrix4fv(uniformLocation, count, GL_FALSE, value);
 }
 
-void Shader::SetMat3(const char* name, const float* value)
+void Shader::SetMat4x3(UniformName name, const float* value, int count)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
+	glUniformMatrix4x3fv(uniformLocation, count, GL_FALSE, value);
+}
+
+void Shader::SetMat3(UniformName name, const float* value)
+{
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniformMatrix3fv(uniformLocation, 1, GL_FALSE, value);
 }
 
-void Shader::SetVec3(const char * name, float x, float y, float z)
+void Shader::SetVec3(UniformName name, float x, float y, float z)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform3f(uniformLocation, x, y, z);
 }
 
-void Shader::SetVec3(const char* name, const glm::vec3& vec)
+void Shader::SetVec3(UniformName name, const glm::vec3& vec)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform3f(uniformLocation, vec.x, vec.y, vec.z);
 }
 
-void Shader::SetVec4(const char* name, float x, float y, float z, float w)
+void Shader::SetVec4(UniformName name, float x, float y, float z, float w)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform4f(uniformLocation, x, y, z, w);
 }
 
-void Shader::SetVec4(const char* name, const glm::vec4& vec)
+void Shader::SetVec4(UniformName name, const glm::vec4& vec)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform4f(uniformLocation, vec.x, vec.y, vec.z, vec.w);
 }
 
-void Shader::SetVec3Array(const char* name, float* values, unsigned int count)
+void Shader::SetVec3Array(UniformName name, float* values, unsigned int count)
 {
-	int uniformLocation = glGetUniformLocation(id, name);
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
 	glUniform3fv(uniformLocation, count, values);
 }
 
+void Shader::SetVec4Array(UniformName name, const float* values, unsigned int count)
+{
+	int uniformLocation = UniformLocation(name);
+	call_stats.uniform_calls++;
+	glUniform4fv(uniformLocation, count, values);
+}
+
 std::string Shader::get_file_contents(const char * path)
 {
 	std::ifstream in(path);
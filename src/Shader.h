@@ -3,9 +3,12 @@
 
 #include <glad/glad.h>
 
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 //#include <glm/gtc/type_ptr.hpp>
@@ -17,28 +20,113 @@ struct UniformBlockBinding
 	GLuint uniform_block_binding;
 };
 
+// FNV-1a, shared by the compile time names below and the names reflected from linked programs
+constexpr std::uint32_t HashUniformName(std::string_view name)
+{
+	std::uint32_t hash = 2166136261u;
+	for (char c : name)
+	{
+		hash = (hash ^ (std::uint8_t)c) * 16777619u;
+	}
+	return hash;
+}
+
+// Uniform name hashed at compile time. Set* calls with string literals convert to this implicitly, so looking up a
+// location never touches the string or GL at run time.
+struct UniformName
+{
+	std::uint32_t hash;
+	const char* name;
+
+	consteval UniformName(const char* name) : hash(HashUniformName(name)), name(name) {}
+};
+
+// GL calls made through Shader, reset by the caller once per frame
+struct ShaderCallStats
+{
+	std::uint32_t uniform_calls = 0;
+	std::uint32_t program_binds = 0;
+	std::uint32_t program_binds_skipped = 0; // use() on the program that was already bound
+};
+
+// Where programs came from and how long creating them took, accumulated since startup
+struct ShaderCacheStats
+{
+	std::uint32_t programs_from_cache = 0;
+	std::uint32_t programs_compiled = 0;
+	float create_ms = 0.0f;    // reading sources and handing them (or cached binaries) to the driver
+	float link_wait_ms = 0.0f; // waiting for the driver to finish compiling and linking in FinishLinking
+	bool parallel_compile = false; // KHR/ARB_parallel_shader_compile is available
+};
+
 class Shader
 {
 public:
 	unsigned int id;
-	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const std::vector<UniformBlockBinding>& ub_bindings = {});
+	// defines are inserted into every stage after its #version line as "#define <define>", e.g. "HAS_TANGENT 0"
+	Shader(const char* vertexPath, const char* fragmentPath, const char* geometryPath = nullptr, const std::vector<UniformBlockBinding>& ub_bindings = {},
+		const std::vector<std::string>& defines = {});
+	~Shader();
 
+	// The constructor only hands the program to the driver. Creating all programs before using any lets a driver
+	// with parallel shader compilation work on them at the same time; the first use() waits for the link and
+	// reports errors.
 	void use();
+	void FinishLinking();
+	// True once FinishLinking won't block. Without parallel compile support there's no way to ask, so this is only
+	// true after FinishLinking.
+	bool LinkCompleted() const;
+	// Location of an active uniform, -1 if the program doesn't use it. Arrays are found by their plain name.
+	int UniformLocation(UniformName name) const;
+	// Index of an active uniform block, GL_INVALID_INDEX if the program doesn't use it
+	unsigned int UniformBlockIndex(std::string_view name) const;
 
-	void SetBool(const char* name, bool value) const;
-	void SetInt(const char* name, int value) const;
-	void SetUint(const char* name, std::uint32_t value) const;
-	void SetFloat(const char* name, float value) const;
-	void SetMat4(const char* name, const float* value);
-	void SetMat4(const char* name, const float* value, int count);
-	void SetMat3(const char* name, const float* value);
-	void SetVec3(const char* name, float x, float y, float z);
-	void SetVec3(const char* name, const glm::vec3& vec);
-	void SetVec4(const char* name, float x, float y, float z, float w);
-	void SetVec4(const char* name, const glm::vec4& vec);
-	void SetVec3Array(const char* name, float* values, unsigned int count);
+	static ShaderCallStats call_stats;
+	// Linked programs are cached as binaries in ShaderCache/, keyed by their sources, defines and the driver
+	static ShaderCacheStats cache_stats;
+	// Code that binds programs without going through use() has to call this so the next use() isn't skipped
+	static void InvalidateBoundProgram() { bound_program = 0; }
+
+	void SetBool(UniformName name, bool value) const;
+	void SetInt(UniformName name, int value) const;
+	void SetUint(UniformName name, std::uint32_t value) const;
+	void SetFloat(UniformName name, float value) const;
+	void SetFloatArray(UniformName name, const float* values, int count) const;
+	void SetMat4(UniformName name, const float* value);
+	void SetMat4(UniformName name, const float* value, int count);
+	void SetMat4x3(UniformName name, const float* value, int count);
+	void SetMat3(UniformName name, const float* value);
+	void SetVec3(UniformName name, float x, float y, float z);
+	void SetVec3(UniformName name, const glm::vec3& vec);
+	void SetVec4(UniformName name, float x, float y, float z, float w);
+	void SetVec4(UniformName name, const glm::vec4& vec);
+	void SetVec3Array(UniformName name, float* values, unsigned int count);
+	void SetVec4Array(UniformName name, const float* values, unsigned int count);
 private:
 	std::string get_file_contents(const char* path);
+	static void InsertDefines(std::string& source, const std::vector<std::string>& defines);
+	void ReflectUniforms();
+	bool LoadProgramBinary();
+	void CompileAndLink();
+	void SaveProgramBinary();
+
+	struct UniformEntry
+	{
+		std::uint32_t hash;
+		int location;
+	};
+	std::vector<UniformEntry> uniforms; // sorted by hash
+	struct UniformBlockEntry
+	{
+		std::string name;
+		unsigned int index;
+	};
+	std::vector<UniformBlockEntry> uniform_blocks;
+	static inline unsigned int bound_program = 0;
+
+	std::vector<UniformBlockBinding> ub_bindings;
+	struct PendingProgram;
+	std::unique_ptr<PendingProgram> pending; // set until FinishLinking
 };
 
 #endif // !SHADER_H
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "ShaderPermutations.h"
+
+#include <algorithm>
+#include <cassert>
+#include <type_traits>
+#include <utility>
+
+std::uint32_t ShaderPermutationKey::Packed() const
+{
+	static_assert(std::is_same_v<std::uint32_t, std::underlying_type<PhongMaterialFlags>::type>);
+	assert((std::uint32_t)material_flags < (1u << 16));
+	return (std::uint32_t)has_tangents | (std::uint32_t)uniform_scale << 1 | (std::uint32_t)compressed_vertices << 5 | (std::uint32_t)joint_influences << 2 | (std::uint32_t)material_flags << 16;
+}
+
+ShaderPermutationKey SelectPermutation(const AnimatedModel& model, std::uint32_t mesh_index, bool uniform_scale)
+{
+	const auto& mesh = model.meshes[mesh_index];
+	ShaderPermutationKey key;
+	key.has_tangents = model.vertex_layout.tangent_offset != 0;
+	key.joint_influences = model.mesh_joint_influences[mesh_index];
+	key.uniform_scale = uniform_scale;
+	key.compressed_vertices = HasFlag(model.vertex_flags, VertexFlags::COMPRESSED);
+	key.material_flags = model.materials[mesh.material_index].flags;
+	return key;
+}
+
+ShaderPermutations::ShaderPermutations(std::string vertex_path, std::string fragment_path, std::vector<UniformBlockBinding> ub_bindings, int palette_texture_unit)
+	: vertex_path(std::move(vertex_path)), fragment_path(std::move(fragment_path)), ub_bindings(std::move(ub_bindings)), palette_texture_unit(palette_texture_unit)
+{
+}
+
+ShaderPermutations::Permutation& ShaderPermutations::Create(ShaderPermutationKey key)
+{
+	const auto packed_key = key.Packed();
+	auto iter = std::find_if(permutations.begin(), permutations.end(), [packed_key](const Permutation& permutation) { return permutation.key == packed_key; });
+	if (iter != permutations.end()) return *iter;
+
+	const std::vector<std::string> defines =
+	{
+		"HAS_TANGENT " + std::to_string((int)key.has_tangents),
+		"JOINT_INFLUENCES " + std::to_string((int)key.joint_influences),
+		"UNIFORM_SCALE " + std::to_string((int)key.uniform_scale),
+		"COMPRESSED_VERTICES " + std::to_string((int)key.compressed_vertices),
+		"STATIC_MATERIAL_FLAGS " + std::to_string((std::uint32_t)key.material_flags),
+	};
+	auto shader = std::make_unique<Shader>(vertex_path.c_str(), fragment_path.c_str(), nullptr, ub_bindings, defines);
+	permutations.push_back({ packed_key, std::move(shader), false });
+	return permutations.back();
+}
+
+Shader& ShaderPermutations::Get(ShaderPermutationKey key)
+{
+	auto& permutation = Create(key);
+	if (!permutation.samplers_set)
+	{
+		// First use, this is where a precompiled permutation waits for the driver
+		auto& shader = *permutation.shader;
+		shader.use();
+		shader.SetInt("diffuse_maps", 0);
+		shader.SetInt("specular_maps", 1);
+		shader.SetInt("normal_maps", 2);
+		shader.SetInt("skinning_palette", palette_texture_unit);
+		permutation.samplers_set = true;
+	}
+	return *permutation.shader;
+}
+
+void ShaderPermutations::Precompile(const std::vector<AnimatedModel>& models)
+{
+	for (const auto& model : models)
+	{
+		for (std::uint32_t mesh_index = 0; mesh_index < model.meshes.size(); mesh_index++)
+		{
+			Create(SelectPermutation(model, mesh_index, false));
+			if (model.uniform_joint_scale) Create(SelectPermutation(model, mesh_index, true));
+		}
+	}
+}
+
+void ShaderPermutations::PrecompileDefaults(bool compressed_vertices)
+{
+	ShaderPermutationKey key;
+	key.compressed_vertices = compressed_vertices;
+	for (const bool uniform_scale : { false, true })
+	{
+		key.uniform_scale = uniform_scale;
+		Create(key);
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef SHADER_PERMUTATIONS_H
+#define SHADER_PERMUTATIONS_H
+
+#include "AnimatedModel.h"
+#include <cstdint>
+#include <memory>
+#include "Shader.h"
+#include <string>
+#include <vector>
+
+// Compile time features of the skinned mesh shaders, see the defines at the top of Shaders/anim.vert and
+// Shaders/anim.frag. The default key compiles the shaders as they'd be without any defines.
+struct ShaderPermutationKey
+{
+	bool has_tangents = true;
+	std::uint8_t joint_influences = 4; // 1, 2 or 4
+	bool uniform_scale = false;
+	bool compressed_vertices = false; // VertexFlags::COMPRESSED
+	PhongMaterialFlags material_flags = PhongMaterialFlags::DEFAULT;
+
+	std::uint32_t Packed() const;
+};
+
+// Leanest key that still draws the mesh correctly. uniform_scale should only be set when the pose being drawn
+// can't hold non uniform scale, which AnimatedModel::uniform_joint_scale says for poses sampled from its clips.
+ShaderPermutationKey SelectPermutation(const AnimatedModel& model, std::uint32_t mesh_index, bool uniform_scale);
+
+// Compiles a vertex/fragment shader pair once per permutation key, on first use
+class ShaderPermutations
+{
+public:
+	// Samplers are assigned their texture units once when a permutation is compiled: the material maps to units
+	// 0 to 2 and skinning_palette to palette_texture_unit
+	ShaderPermutations(std::string vertex_path, std::string fragment_path, std::vector<UniformBlockBinding> ub_bindings, int palette_texture_unit);
+
+	Shader& Get(ShaderPermutationKey key);
+	// Creates the permutations every mesh of the models can ask for without waiting for them, so the driver can
+	// compile them side by side (and from the program cache) before the first frame needs them
+	void Precompile(const std::vector<AnimatedModel>& models);
+	// Creates the default key's permutations for the vertex format models will be loaded with. Called before any
+	// model is loaded, the driver links them (or loads their cached binaries) while the models load.
+	void PrecompileDefaults(bool compressed_vertices);
+	std::size_t CompiledCount() const { return permutations.size(); }
+
+private:
+	struct Permutation
+	{
+		std::uint32_t key;
+		std::unique_ptr<Shader> shader;
+		bool samplers_set;
+	};
+
+	Permutation& Create(ShaderPermutationKey key);
+
+	std::string vertex_path, fragment_path;
+	std::vector<UniformBlockBinding> ub_bindings;
+	int palette_texture_unit;
+	std::vector<Permutation> permutations;
+};
+
+#endif // !SHADER_PERMUTATIONS_H
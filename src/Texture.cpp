@@ -5,6 +5,7 @@
 #include <glad/glad.h>
 #include <iostream>
 
+#include <algorithm>
 #include <cassert>
 #include <unordered_map>
 
@@ -85,9 +86,8 @@ static unsigned int TextureFromMemory(unsigned char* buffer, int length)
 	return id;
 }
 
-// Warning: Don't manually free textures that are loaded from this function.
+// Warning: Don't manually free textures that are loaded from this function, use ReleaseTexture.
 // Otherwise they will still get returned if looked up rather than reloaded.
-// TODO: add freeTexture function if needed.
 unsigned int LoadTexture(const char* fileName, const std::string& directory)
 {
 	std::string path = directory + "/" + fileName;
@@ -168,3 +168,81 @@ unsigned int LoadCubemap(const std::vector<std::string>& faces)
 
 	return ID;
 }
+
+void ReleaseTexture(unsigned int id)
+{
+	auto iter = std::find_if(textures.begin(), textures.end(), [id](const auto& entry) { return entry.second == id; });
+	if (iter != textures.end()) textures.erase(iter);
+	glDeleteTextures(1, &id);
+}
+
+std::vector<TextureArrayLayer> PackTextureArrays(std::span<const unsigned int> source_textures, std::vector<TextureArray>& out_arrays)
+{
+	struct Source
+	{
+		unsigned int id;
+		int width, height;
+	};
+	std::vector<Source> sources;
+	std::vector<TextureArrayLayer> layers(source_textures.size());
+	std::vector<std::size_t> source_indices(source_textures.size());
+	for (std::size_t i = 0; i < source_textures.size(); i++)
+	{
+		auto iter = std::find_if(sources.begin(), sources.end(), [id = source_textures[i]](const Source& source) { return source.id == id; });
+		if (iter == sources.end())
+		{
+			Source source{ source_textures[i], 0, 0 };
+			glBindTexture(GL_TEXTURE_2D, source.id);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &source.width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &source.height);
+			sources.push_back(source);
+			iter = sources.end() - 1;
+		}
+		source_indices[i] = iter - sources.begin();
+	}
+
+	// Sources of the same size share an array, in the order they were first seen
+	std::vector<TextureArrayLayer> source_layers(sources.size());
+	const auto first_array = out_arrays.size();
+	for (std::size_t i = 0; i < sources.size(); i++)
+	{
+		auto array = std::find_if(out_arrays.begin() + first_array, out_arrays.end(),
+			[&source = sources[i]](const TextureArray& array) { return array.width == source.width && array.height == source.height; });
+		if (array == out_arrays.end())
+		{
+			out_arrays.push_back({ 0, sources[i].width, sources[i].height, 0 });
+			array = out_arrays.end() - 1;
+		}
+		source_layers[i] = { (std::uint16_t)(array - out_arrays.begin()), (std::uint16_t)array->layer_count++ };
+	}
+
+	std::vector<unsigned char> pixels;
+	for (auto array_index = first_array; array_index < out_arrays.size(); array_index++)
+	{
+		auto& array = out_arrays[array_index];
+		glGenTextures(1, &array.id);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, array.id);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, array.width, array.height, array.layer_count, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		pixels.resize((std::size_t)array.width * array.height * 4);
+		for (std::size_t i = 0; i < sources.size(); i++)
+		{
+			if (source_layers[i].array != array_index) continue;
+			// Texture data only lives on the GPU, read it back once at load
+			glBindTexture(GL_TEXTURE_2D, sources[i].id);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, source_layers[i].layer, array.width, array.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+		}
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	}
+
+	for (std::size_t i = 0; i < source_textures.size(); i++)
+	{
+		layers[i] = source_layers[source_indices[i]];
+	}
+	return layers;
+}
@@ -1,6 +1,8 @@
 #ifndef TEXTURE_H
 #define TEXTURE_H
 
+#include <cstdint>
+#include <span>
 #include <string>
 #include <vector>
 
@@ -10,10 +12,31 @@ unsigned int White1x1Texture();
 // Use in place of missing normal map (blue = (0, 0, 1) so tangent and bitangent are non-factors
 unsigned int Blue1x1Texture();
 unsigned int LoadCubemap(const std::vector<std::string>& faces);
+// Deletes a texture returned by the functions above and forgets it, so loading the same file again reloads it
+void ReleaseTexture(unsigned int id);
 
 struct Texture
 {
 	unsigned int id;
 };
 
+// GL_TEXTURE_2D_ARRAY of equally sized RGBA8 layers
+struct TextureArray
+{
+	unsigned int id;
+	int width, height;
+	int layer_count;
+};
+
+struct TextureArrayLayer
+{
+	std::uint16_t array = 0;
+	std::uint16_t layer = 0;
+};
+
+// Copies 2D textures into one texture array per distinct size, so draws sampling textures of the same size can
+// share their bindings. Textures may repeat, each distinct one gets a single layer. Returns where each element of
+// textures ended up, indices into out_arrays. The 2D textures are left alone.
+std::vector<TextureArrayLayer> PackTextureArrays(std::span<const unsigned int> textures, std::vector<TextureArray>& out_arrays);
+
 #endif
\ No newline at end of file
@@ -8,15 +8,21 @@
 #include "imgui_impl_glfw.h"
 #include "imgui_impl_opengl3.h"
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
+#include <chrono>
 #include <iostream>
 #include <memory>
+#include <string_view>
 #include <filesystem>
+#include "AllocationCounter.h"
 #include "AnimatedModel.h"
+#include "BakedAnimation.h"
 #include "Camera.h"
 #include "ClipPickScene.h"
+#include "CrowdScene.h"
 #include "Input.h"
 #include "Light.h"
 #include "PoseEditScene.h"  
+#include "RenderCheck.h"
 #include "Scene.h"
 #include "Shader.h"
 
@@ -95,8 +101,17 @@ void ProcessInput(GLFWwindow* window, Input& out_input, const ImGuiIO& io)
     }
 }
 
-int main(int, char**)
+int main(int argc, char** argv)
 {
+    const auto startup_begin = std::chrono::steady_clock::now();
+
+    // --render-check compares rendering paths offscreen and exits instead of opening the viewer, see RenderCheck.h
+    bool render_check = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string_view(argv[i]) == "--render-check") render_check = true;
+    }
+
     // Setup window
     glfwSetErrorCallback(GLFWErrorCallback);
     if (!glfwInit())
@@ -106,6 +121,7 @@ int main(int, char**)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (render_check) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
     
     GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "anim_view", NULL, NULL);
     if (window == NULL)
@@ -126,15 +142,11 @@ int main(int, char**)
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    GLuint projViewUBO, lightsUBO;
+    // The Matrices block (binding 0) is streamed by the scenes, see Scene::UpdateAndRender
+    GLuint lightsUBO;
     constexpr int maxPointLights = 25;
     constexpr int maxSpotLights = 25;
 
-    glGenBuffers(1, &projViewUBO);
-    glBindBuffer(GL_UNIFORM_BUFFER, projViewUBO);
-    glBufferData(GL_UNIFORM_BUFFER, 2 * sizeof(glm::mat4), NULL, GL_STATIC_DRAW);
-    glBindBufferBase(GL_UNIFORM_BUFFER, 0, projViewUBO);
-
     glGenBuffers(1, &lightsUBO);
     glBindBuffer(GL_UNIFORM_BUFFER, lightsUBO);
     glBufferData(GL_UNIFORM_BUFFER, maxPointLights * sizeof(PointLight) + maxSpotLights * sizeof(SpotLight) + sizeof(DirectionalLight) + 2 * sizeof(int), NULL, GL_STATIC_DRAW);
@@ -159,17 +171,12 @@ int main(int, char**)
     assert(fs::is_directory(models_directory));
     fs::path model_file_path, skeleton_file_path;
     std::vector<fs::path> animation_file_paths;
-    for (const auto& dir_entry : fs::directory_iterator(models_directory))
-    {
-        models.emplace_back(dir_entry.path().string());
-    }
-
-    float deltaTime = 0.0f;
-    float lastFrameTime = 0.0f;
+    // Smaller GPU vertices, see VertexFlags::COMPRESSED. The loader prints how far they are off the float vertices.
+    constexpr auto vertex_options = VertexFlags::COMPRESSED;
 
-    Input input{};
-
-    Shader model_shader{ "Shaders/anim.vert", "Shaders/anim.frag", nullptr, 
+    // Skinned mesh shaders shared by the scenes. The permutations most meshes use are created before loading
+    // models, so the driver links them (or loads their cached binaries) while the models load.
+    ShaderPermutations skinned_shaders{ "Shaders/anim.vert", "Shaders/anim.frag",
         {
             {
                 .uniform_block_name = "Matrices",
@@ -178,13 +185,84 @@ int main(int, char**)
             {
                 .uniform_block_name = "Lights",
                 .uniform_block_binding = 1
+            },
+            {
+                .uniform_block_name = "Materials",
+                .uniform_block_binding = materials_block_binding
             }
-        }
+        },
+        Scene::palette_texture_unit
     };
+    skinned_shaders.PrecompileDefaults(HasFlag(vertex_options, VertexFlags::COMPRESSED));
+
+    // The first run loads the source files and writes a model pack for each model (see ModelPackFile), later runs
+    // map the packs. Compare the two, or delete the ModelCache/ directories inside the model directories to measure
+    // the source files again.
+    const auto peak_resident_before_models = PeakResidentBytes();
+    const auto models_begin = std::chrono::steady_clock::now();
+    int models_from_packs = 0;
+    for (const auto& dir_entry : fs::directory_iterator(models_directory))
+    {
+        models.emplace_back(dir_entry.path().string(), ClipCompressionSettings{}, vertex_options);
+        models_from_packs += models.back().loaded_from_pack;
+    }
+    const auto models_load_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - models_begin).count();
+    const auto peak_resident_mb = PeakResidentBytes() / (1024.0f * 1024.0f);
+    std::cout << "Loaded " << models.size() << " models (" << models_from_packs << " from model packs) in " << models_load_ms
+        << " ms, peak RSS " << peak_resident_mb << " MB (" << peak_resident_before_models / (1024.0f * 1024.0f) << " MB before loading)\n";
+    // Whatever else the loaded meshes ask for
+    skinned_shaders.Precompile(models);
+    std::size_t float_vertex_bytes = 0, gpu_vertex_bytes = 0;
+    for (const auto& model : models)
+    {
+        float_vertex_bytes += model.vertices.size();
+        gpu_vertex_bytes += model.gpu_vertex_bytes;
+    }
+    std::cout << "GPU vertices: " << gpu_vertex_bytes / 1024 << " KB (" << float_vertex_bytes / 1024 << " KB as floats)\n";
+
+    // Clips that fit in the budget can be played back on the GPU by the crowd scene
+    constexpr std::size_t baked_palette_budget_bytes = 64 * 1024 * 1024;
+    std::size_t baked_palette_bytes = 0;
+    for (auto& model : models)
+    {
+        baked_palette_bytes += BakeClipPalettes(model, baked_palette_budget_bytes - baked_palette_bytes);
+    }
+    std::cout << "Baked skinning palettes: " << baked_palette_bytes / 1024 << " KB\n";
+
+    int exit_code = 0;
+    if (render_check)
+    {
+        exit_code = RunRenderChecks(models, lightsUBO, skinned_shaders);
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+    }
 
-    std::unique_ptr<Scene> scene = std::make_unique<PoseEditScene>(models, projViewUBO, lightsUBO, model_shader);
+    float deltaTime = 0.0f;
+    float lastFrameTime = 0.0f;
+
+    Input input{};
+
+    enum SceneType
+    {
+        POSE_EDIT_SCENE,
+        CLIP_PICK_SCENE,
+        CROWD_SCENE
+    };
+    static const char* scene_names[] = { "Pose edit", "Clip pick", "Crowd" };
+    auto CreateScene = [&](int scene_type) -> std::unique_ptr<Scene>
+    {
+        switch (scene_type)
+        {
+        case CLIP_PICK_SCENE: return std::make_unique<ClipPickScene>(models, lightsUBO, skinned_shaders);
+        case CROWD_SCENE: return std::make_unique<CrowdScene>(models, lightsUBO, skinned_shaders);
+        default: return std::make_unique<PoseEditScene>(models, lightsUBO, skinned_shaders);
+        }
+    };
+    int current_scene = POSE_EDIT_SCENE;
+    std::unique_ptr<Scene> scene = CreateScene(current_scene);
 
     // Main loop
+    ShaderCallStats last_shader_stats;
+    float startup_ms = 0.0f; // until the first frame was presented, compare runs with and without ShaderCache/
     while (!glfwWindowShouldClose(window))
     {
         float currentTime = (float)glfwGetTime();
@@ -198,6 +276,20 @@ int main(int, char**)
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        ImGui::Begin("Scene");
+        if (ImGui::Combo("Scene", &current_scene, scene_names, IM_ARRAYSIZE(scene_names)))
+        {
+            scene = CreateScene(current_scene);
+        }
+        ImGui::Text("Shader GL calls: %u uniform, %u glUseProgram (%u redundant skipped)", last_shader_stats.uniform_calls,
+            last_shader_stats.program_binds, last_shader_stats.program_binds_skipped);
+        const auto& cache_stats = Shader::cache_stats;
+        ImGui::Text("Startup: %.1f ms, programs: %u cached, %u compiled (%.1f ms creating, %.1f ms waiting on links)", startup_ms,
+            cache_stats.programs_from_cache, cache_stats.programs_compiled, cache_stats.create_ms, cache_stats.link_wait_ms);
+        ImGui::Text("Models: %.1f ms, %d of %zu from model packs, peak RSS %.1f MB after loading", models_load_ms, models_from_packs, models.size(),
+            peak_resident_mb);
+        ImGui::End();
+
         // Rendering
         int display_w, display_h;
         glfwGetFramebufferSize(window, &display_w, &display_h);
@@ -207,10 +299,23 @@ int main(int, char**)
 
         scene->UpdateAndRender(input, deltaTime);
 
+        last_shader_stats = Shader::call_stats;
+        Shader::call_stats = {};
+
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        // The ImGui backend binds its own program
+        Shader::InvalidateBoundProgram();
 
         glfwSwapBuffers(window);
+        if (startup_ms == 0.0f)
+        {
+            startup_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startup_begin).count();
+            const auto& cache_stats = Shader::cache_stats;
+            std::cout << "Startup: " << startup_ms << " ms to first frame, " << cache_stats.programs_from_cache << " programs from cache, "
+                << cache_stats.programs_compiled << " compiled (" << cache_stats.create_ms << " ms creating, " << cache_stats.link_wait_ms
+                << " ms waiting on links, parallel compile " << (cache_stats.parallel_compile ? "on" : "off") << ")\n";
+        }
         // Poll and handle events (inputs, window resize, etc.)
         // You can read the io.WantCaptureMouse, io.WantCaptureKeyboard flags to tell if dear imgui wants to use your inputs.
         // - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application.
@@ -228,5 +333,5 @@ int main(int, char**)
     glfwDestroyWindow(window);
     glfwTerminate();
 
-    return 0;
+    return exit_code;
 }
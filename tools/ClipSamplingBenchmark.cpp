@@ -0,0 +1,184 @@
+// Times clip sampling on the structure-of-arrays clip layout against the layout it replaced, where every pose was its
+// own array of JointPose. Both layouts hold the same synthetic keyframes and are sampled at the same random times,
+// spread over enough clips that keys come from memory rather than staying in cache.
+//
+// The first two loops blend joint by joint with the same scalar nlerp and lerp, so only the layout differs between
+// them. The third is SampleClip itself with the SIMD kernels picked for this CPU.
+//
+// Usage: ClipSamplingBenchmark [clips] [joints] [poses] [samples] [all|legacy|soa|kernels]
+//
+// Naming one loop runs only that one, so a profiler attributes its counters to one layout. On Linux, for example:
+//   perf stat -e cache-references,cache-misses ClipSamplingBenchmark 256 65 120 200000 legacy
+//   perf stat -e cache-references,cache-misses ClipSamplingBenchmark 256 65 120 200000 soa
+// Filling the clips costs the same in every run, so the difference between two runs is the sampling.
+
+#include "AnimatedModel.h"
+#include "AnimationKernels.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// The layout before the sampler moved to per-track arrays
+struct LegacyClip
+{
+	std::vector<std::vector<JointPose>> poses;
+	float frames_per_second;
+};
+
+// Same blend as SampleClipJoint, keys are already in the same hemisphere
+static inline void BlendJoint(const glm::quat& a_rotation, const glm::quat& b_rotation, const glm::vec3& a_translation,
+	const glm::vec3& b_translation, const glm::vec3& a_scale, const glm::vec3& b_scale, float t, JointPose& out)
+{
+	out.rotation = glm::normalize(a_rotation * (1.0f - t) + b_rotation * t);
+	out.translation = a_translation * (1.0f - t) + b_translation * t;
+	out.scale = a_scale * (1.0f - t) + b_scale * t;
+}
+
+static void SampleLegacyClip(const LegacyClip& clip, float time, std::vector<JointPose>& out_pose)
+{
+	const float pose_index = time * clip.frames_per_second;
+	const auto a = (std::size_t)pose_index;
+	const auto b = std::min(a + 1, clip.poses.size() - 1);
+	const float t = pose_index - (float)a;
+	for (std::size_t i = 0; i < out_pose.size(); i++)
+	{
+		const auto& a_pose = clip.poses[a][i];
+		const auto& b_pose = clip.poses[b][i];
+		BlendJoint(a_pose.rotation, b_pose.rotation, a_pose.translation, b_pose.translation, a_pose.scale, b_pose.scale, t, out_pose[i]);
+	}
+}
+
+static void SampleSoaClip(const AnimationClip& clip, float time, std::vector<JointPose>& out_pose)
+{
+	const float pose_index = time * clip.frames_per_second;
+	const auto a = (unsigned int)pose_index;
+	const auto b = std::min(a + 1, clip.pose_count - 1);
+	const float t = pose_index - (float)a;
+	const auto a_rotations = clip.PoseRotations(a), b_rotations = clip.PoseRotations(b);
+	const auto a_translations = clip.PoseTranslations(a), b_translations = clip.PoseTranslations(b);
+	const auto a_scales = clip.PoseScales(a), b_scales = clip.PoseScales(b);
+	for (std::size_t i = 0; i < out_pose.size(); i++)
+	{
+		BlendJoint(a_rotations[i], b_rotations[i], a_translations[i], b_translations[i], a_scales[i], b_scales[i], t, out_pose[i]);
+	}
+}
+
+static unsigned int ArgOr(int argc, char** argv, int index, unsigned int fallback)
+{
+	return argc > index ? (unsigned int)std::strtoul(argv[index], nullptr, 10) : fallback;
+}
+
+int main(int argc, char** argv)
+{
+	const auto num_clips = ArgOr(argc, argv, 1, 256);
+	const auto num_joints = ArgOr(argc, argv, 2, 65);
+	const auto num_poses = ArgOr(argc, argv, 3, 120);
+	const auto num_samples = ArgOr(argc, argv, 4, 200000);
+	const char* loop = argc > 5 ? argv[5] : "all";
+	const bool run_all = std::strcmp(loop, "all") == 0;
+	const bool run_legacy = run_all || std::strcmp(loop, "legacy") == 0;
+	const bool run_soa = run_all || std::strcmp(loop, "soa") == 0;
+	const bool run_kernels = run_all || std::strcmp(loop, "kernels") == 0;
+	if (num_clips == 0 || num_joints == 0 || num_poses < 2 || num_samples == 0 || !(run_legacy || run_soa || run_kernels))
+	{
+		std::cout << "Usage: ClipSamplingBenchmark [clips] [joints] [poses >= 2] [samples] [all|legacy|soa|kernels]\n";
+		return 1;
+	}
+	constexpr float frames_per_second = 30.0f;
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::vector<LegacyClip> legacy_clips(num_clips);
+	std::vector<AnimationClip> clips(num_clips);
+	for (auto c = 0u; c < num_clips; c++)
+	{
+		auto& legacy = legacy_clips[c];
+		auto& clip = clips[c];
+		legacy.frames_per_second = clip.frames_per_second = frames_per_second;
+		legacy.poses.assign(num_poses, std::vector<JointPose>(num_joints));
+		clip.Allocate(num_poses, num_joints);
+		clip.frame_count = num_poses - 1;
+		clip.loops = false;
+		for (auto j = 0u; j < num_joints; j++)
+		{
+			// Random walk per joint so neighbouring keys stay close, as they do in real clips
+			glm::quat rotation = glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+			glm::vec3 translation(unit(rng) * 10.0f, unit(rng) * 10.0f, unit(rng) * 10.0f);
+			for (auto p = 0u; p < num_poses; p++)
+			{
+				rotation = glm::normalize(rotation + glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)) * 0.05f);
+				translation += glm::vec3(unit(rng), unit(rng), unit(rng)) * 0.1f;
+				const glm::vec3 scale(1.0f);
+				legacy.poses[p][j] = { rotation, translation, scale };
+				const auto key = p * num_joints + j;
+				clip.rotations[key] = rotation;
+				clip.translations[key] = translation;
+				clip.scales[key] = scale;
+			}
+		}
+	}
+
+	const float duration = (float)(num_poses - 1) / frames_per_second;
+	std::uniform_int_distribution<unsigned int> pick_clip(0, num_clips - 1);
+	std::uniform_real_distribution<float> pick_time(0.0f, duration);
+	std::vector<std::pair<unsigned int, float>> samples(num_samples);
+	for (auto& sample : samples) sample = { pick_clip(rng), pick_time(rng) };
+
+	const double joint_samples = (double)num_samples * num_joints;
+	std::cout << num_clips << " clips, " << num_joints << " joints, " << num_poses << " poses, " << num_samples << " samples\n";
+	// Summed into the output so the compiler can't drop the sampling
+	float checksum = 0.0f;
+	double legacy_ns = 0.0, soa_ns = 0.0;
+
+	std::vector<JointPose> joint_poses(num_joints);
+	if (run_legacy)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for (const auto& [clip_index, time] : samples)
+		{
+			SampleLegacyClip(legacy_clips[clip_index], time, joint_poses);
+			checksum += joint_poses[num_joints - 1].rotation.w;
+		}
+		legacy_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "Per-pose JointPose, scalar nlerp: " << legacy_ns / joint_samples << " ns/joint, "
+			<< joint_samples / legacy_ns * 1000.0 << " M joints/s\n";
+	}
+
+	if (run_soa)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		for (const auto& [clip_index, time] : samples)
+		{
+			SampleSoaClip(clips[clip_index], time, joint_poses);
+			checksum += joint_poses[num_joints - 1].rotation.w;
+		}
+		soa_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "SoA tracks, scalar nlerp:         " << soa_ns / joint_samples << " ns/joint, "
+			<< joint_samples / soa_ns * 1000.0 << " M joints/s\n";
+	}
+
+	if (run_kernels)
+	{
+		SkeletonPose pose;
+		pose.Resize(num_joints);
+		const auto start = std::chrono::steady_clock::now();
+		for (const auto& [clip_index, time] : samples)
+		{
+			SampleClip(clips[clip_index], time, pose);
+			checksum += pose.rotations[num_joints - 1].w;
+		}
+		const auto kernels_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "SoA SampleClip (" << GetAnimationKernels().name << "): " << kernels_ns / joint_samples << " ns/joint, "
+			<< joint_samples / kernels_ns * 1000.0 << " M joints/s\n";
+	}
+
+	if (run_legacy && run_soa) std::cout << "Layout speedup: " << legacy_ns / soa_ns << "x\n";
+	std::cout << "Checksum " << checksum << '\n';
+	return 0;
+}
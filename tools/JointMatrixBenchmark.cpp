@@ -0,0 +1,140 @@
+// Times ComputeJointMatrices against the path it replaced, where every joint's local matrix was built as a full 4x4
+// with glm::translate, glm::mat4_cast and glm::scale and multiplied with its parent's, and a second loop over the
+// joints multiplied the results by the inverse bind matrices. Both paths pose the same synthetic skeleton from the
+// same local poses. Their skinning matrices are compared first and the benchmark fails if they differ by more than
+// float rounding, so a broken path can't look fast.
+//
+// Usage: JointMatrixBenchmark [joints] [poses] [iterations]
+
+#include "AnimatedModel.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Largest difference between matching skinning matrix elements, relative to the element when it's larger than 1
+static constexpr float max_relative_error = 1e-3f;
+
+// Global and skinning matrices as they were computed before ComputeJointMatrices
+static void ComputeLegacyMatrices(ConstPoseView local_pose, const Skeleton& skeleton, std::vector<glm::mat4>& global_matrices,
+	std::vector<glm::mat4>& skinning_matrices)
+{
+	const auto num_joints = local_pose.size();
+	for (std::size_t i = 0; i < num_joints; i++)
+	{
+		glm::mat4 local_mat = glm::translate(glm::identity<glm::mat4>(), local_pose.translations[i]);
+		local_mat *= glm::mat4_cast(local_pose.rotations[i]);
+		local_mat = glm::scale(local_mat, local_pose.scales[i]);
+		global_matrices[i] = i == 0 ? local_mat : global_matrices[skeleton.joints[i].parent] * local_mat;
+	}
+	for (std::size_t i = 0; i < num_joints; i++)
+	{
+		skinning_matrices[i] = global_matrices[i] * glm::mat4(skeleton.joints[i].local_to_joint);
+	}
+}
+
+static unsigned int ArgOr(int argc, char** argv, int index, unsigned int fallback)
+{
+	return argc > index ? (unsigned int)std::strtoul(argv[index], nullptr, 10) : fallback;
+}
+
+int main(int argc, char** argv)
+{
+	const auto num_joints = ArgOr(argc, argv, 1, 65);
+	const auto num_poses = ArgOr(argc, argv, 2, 64);
+	const auto num_iterations = ArgOr(argc, argv, 3, 20000);
+	if (num_joints == 0 || num_poses == 0 || num_iterations == 0)
+	{
+		std::cout << "Usage: JointMatrixBenchmark [joints] [poses] [iterations]\n";
+		return 1;
+	}
+
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	const auto random_rotation = [&]() { return glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng))); };
+	const auto random_translation = [&]() { return glm::vec3(unit(rng), unit(rng), unit(rng)) * 20.0f; };
+
+	// Breadth first like loaded skeletons, every parent comes before its children
+	Skeleton skeleton;
+	skeleton.joints.resize(num_joints);
+	for (auto i = 0u; i < num_joints; i++)
+	{
+		auto& joint = skeleton.joints[i];
+		joint.parent = i == 0 ? -1 : (int)(rng() % i);
+		joint.local_to_joint = glm::mat4x3(glm::translate(glm::identity<glm::mat4>(), random_translation()) * glm::mat4_cast(random_rotation()));
+	}
+
+	std::vector<SkeletonPose> poses(num_poses);
+	for (auto& pose : poses)
+	{
+		pose.Resize(num_joints);
+		for (auto i = 0u; i < num_joints; i++)
+		{
+			pose.rotations[i] = random_rotation();
+			pose.translations[i] = random_translation();
+			pose.scales[i] = glm::vec3(1.0f + unit(rng) * 0.1f);
+		}
+	}
+
+	std::vector<glm::mat4> legacy_global(num_joints), legacy_skinning(num_joints);
+	std::vector<glm::mat4x3> global(num_joints), skinning(num_joints);
+	float max_error = 0.0f;
+	for (const auto& pose : poses)
+	{
+		ComputeLegacyMatrices(pose, skeleton, legacy_global, legacy_skinning);
+		ComputeJointMatrices(pose, skeleton, global, skinning);
+		for (auto i = 0u; i < num_joints; i++)
+		{
+			for (int column = 0; column < 4; column++)
+			{
+				for (int row = 0; row < 3; row++)
+				{
+					const float legacy = legacy_skinning[i][column][row];
+					max_error = std::max(max_error, std::abs(legacy - skinning[i][column][row]) / std::max(std::abs(legacy), 1.0f));
+				}
+			}
+		}
+	}
+
+	if (max_error > max_relative_error)
+	{
+		std::cout << "ComputeJointMatrices differs from the 4x4 path by " << max_error << "\n";
+		return 1;
+	}
+
+	// Summed into the output so the compiler can't drop the evaluation
+	float checksum = 0.0f;
+
+	const auto legacy_start = std::chrono::steady_clock::now();
+	for (auto iteration = 0u; iteration < num_iterations; iteration++)
+	{
+		ComputeLegacyMatrices(poses[iteration % num_poses], skeleton, legacy_global, legacy_skinning);
+		checksum += legacy_skinning[num_joints - 1][3].x;
+	}
+	const auto legacy_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - legacy_start).count();
+
+	const auto fused_start = std::chrono::steady_clock::now();
+	for (auto iteration = 0u; iteration < num_iterations; iteration++)
+	{
+		ComputeJointMatrices(poses[iteration % num_poses], skeleton, global, skinning);
+		checksum += skinning[num_joints - 1][3].x;
+	}
+	const auto fused_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - fused_start).count();
+
+	const double joint_evaluations = (double)num_iterations * num_joints;
+	std::cout << num_joints << " joints, " << num_poses << " poses, " << num_iterations << " iterations\n";
+	std::cout << "4x4 translate/mat4_cast/scale + skinning loop: " << legacy_ns / joint_evaluations << " ns/joint, "
+		<< joint_evaluations / legacy_ns * 1000.0 << " M joints/s\n";
+	std::cout << "ComputeJointMatrices (fused 4x3):              " << fused_ns / joint_evaluations << " ns/joint, "
+		<< joint_evaluations / fused_ns * 1000.0 << " M joints/s\n";
+	std::cout << "Speedup: " << legacy_ns / fused_ns << "x, max relative difference " << max_error << " (checksum " << checksum << ")\n";
+	return 0;
+}
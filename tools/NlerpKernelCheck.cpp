@@ -0,0 +1,78 @@
+// Checks every nlerp kernel the CPU supports against glm::slerp, and the SIMD kernels against the scalar one.
+// Key pairs are random rotations up to max_key_angle_degrees apart, flipped into the same hemisphere the way the
+// clip loader does it. At that spacing nlerp and slerp stay well within tolerance_degrees of each other, so a
+// larger deviation means a kernel is wrong rather than just approximate. Exits non-zero on failure.
+
+#include "AnimationKernels.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+static constexpr float max_key_angle_degrees = 30.0f;
+static constexpr float tolerance_degrees = 0.1f;
+// Between implementations of the same formula only rounding and rsqrt refinement should differ
+static constexpr float kernel_tolerance_degrees = 0.01f;
+
+// Angle of the rotation taking a to b, in degrees. Taken from the chord between the quaternions rather than the acos
+// of their dot product, which loses everything below about 0.05 degrees in float.
+static float AngleBetweenDegrees(const glm::quat& a, const glm::quat& b)
+{
+	const float chord = std::min(glm::length(a - b), glm::length(a + b));
+	return glm::degrees(4.0f * std::asin(std::min(chord * 0.5f, 1.0f)));
+}
+
+int main()
+{
+	// Not a multiple of 8 so the SIMD tail loops run too
+	constexpr std::size_t count = 4099;
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::uniform_real_distribution<float> key_angle(0.0f, glm::radians(max_key_angle_degrees));
+
+	std::vector<glm::quat> a(count), b(count);
+	for (std::size_t i = 0; i < count; i++)
+	{
+		a[i] = glm::normalize(glm::quat(unit(rng), unit(rng), unit(rng), unit(rng)));
+		const glm::vec3 axis = glm::normalize(glm::vec3(unit(rng), unit(rng), unit(rng)) + glm::vec3(0.0f, 0.0f, 1e-3f));
+		// The first few pairs are identical keys, which nlerp has to return unchanged
+		b[i] = i < 8 ? a[i] : glm::normalize(a[i] * glm::angleAxis(key_angle(rng), axis));
+		if (glm::dot(a[i], b[i]) < 0.0f) b[i] = -b[i];
+	}
+
+	const auto kernels = GetSupportedAnimationKernels();
+	const auto& scalar = kernels.back();
+	std::vector<glm::quat> blended(count), scalar_blended(count);
+	bool passed = true;
+	for (const auto& kernel : kernels)
+	{
+		float max_slerp_error = 0.0f, max_scalar_error = 0.0f;
+		for (float t : { 0.0f, 0.1f, 0.25f, 0.5f, 0.75f, 0.9f, 1.0f })
+		{
+			kernel.nlerp_quaternions((const float*)a.data(), (const float*)b.data(), t, (float*)blended.data(), count);
+			scalar.nlerp_quaternions((const float*)a.data(), (const float*)b.data(), t, (float*)scalar_blended.data(), count);
+			for (std::size_t i = 0; i < count; i++)
+			{
+				max_slerp_error = std::max(max_slerp_error, AngleBetweenDegrees(glm::slerp(a[i], b[i], t), blended[i]));
+				max_scalar_error = std::max(max_scalar_error, AngleBetweenDegrees(scalar_blended[i], blended[i]));
+				const float length_error = std::abs(glm::length(blended[i]) - 1.0f);
+				if (length_error > 1e-5f || std::isnan(length_error))
+				{
+					std::cout << kernel.name << ": quaternion " << i << " at t = " << t << " is not normalized\n";
+					passed = false;
+					break;
+				}
+			}
+		}
+		const bool kernel_passed = max_slerp_error <= tolerance_degrees && max_scalar_error <= kernel_tolerance_degrees;
+		std::cout << kernel.name << ": max deviation " << max_slerp_error << " degrees from slerp, " << max_scalar_error
+			<< " degrees from scalar " << (kernel_passed ? "OK" : "FAILED") << "\n";
+		passed = passed && kernel_passed;
+	}
+	return passed ? 0 : 1;
+}